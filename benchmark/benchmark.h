@@ -0,0 +1,42 @@
+#ifndef BENCHMARK_BENCHMARK_H_
+#define BENCHMARK_BENCHMARK_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+struct BenchmarkCounts
+{
+	uint64_t instructions;
+	uint64_t cycles;
+};
+
+class BenchmarkWorkload
+{
+public:
+	explicit BenchmarkWorkload(const char *name) : name(name) {}
+	virtual ~BenchmarkWorkload() {}
+
+	// Sets up the machine. Returns false if the workload cannot run, for
+	// example because a file it needs is missing.
+	virtual bool Prepare() = 0;
+	// Called before every run, outside of the timed part. Returns false if the
+	// workload cannot go on.
+	virtual bool PrepareRun() { return true; }
+	// Emulates for about |cycles| CPU cycles, continuing where the last run
+	// stopped unless PrepareRun() started over
+	virtual BenchmarkCounts Run(uint64_t cycles) = 0;
+
+	const std::string name;
+};
+
+typedef std::vector<std::unique_ptr<BenchmarkWorkload>> BenchmarkWorkloadList;
+
+// cpu/65816/cpu_65c816_perftest.cc
+void AddWDC65C816Workloads(BenchmarkWorkloadList *workloads);
+// benchmark/system_workloads.cc
+void AddSystemWorkloads(BenchmarkWorkloadList *workloads, const std::string& c256_kernel_path);
+
+#endif
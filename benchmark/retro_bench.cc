@@ -0,0 +1,402 @@
+#include "benchmark/benchmark.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#ifndef RETRO_BENCH_REVISION
+#define RETRO_BENCH_REVISION "unknown"
+#endif
+
+namespace {
+enum class Format
+{
+	kText,
+	kJson,
+	kCsv,
+};
+
+struct Options
+{
+	uint64_t cycles = 20000000;
+	uint32_t warmup_runs = 1;
+	uint32_t runs = 5;
+	std::string filter;
+	std::string c256_kernel;
+	Format format = Format::kText;
+	std::string output;
+	std::string baseline;
+	double threshold = 5.0;
+	std::string revision = RETRO_BENCH_REVISION;
+};
+
+struct RunResult
+{
+	double seconds;
+	BenchmarkCounts counts;
+
+	double mips() const { return counts.instructions / seconds / 1e6; }
+	double cycles_per_second() const { return counts.cycles / seconds; }
+	double ns_per_instruction() const { return counts.instructions ? seconds * 1e9 / counts.instructions : 0; }
+};
+
+struct WorkloadResult
+{
+	std::string name;
+	RunResult median;
+	double variance;
+	double best;
+};
+
+void Usage()
+{
+	printf("usage: retro_bench [options]\n"
+		"  --cycles N       CPU cycles per run (default 20000000)\n"
+		"  --runs N         timed runs per workload (default 5)\n"
+		"  --warmup N       untimed runs before measuring (default 1)\n"
+		"  --filter NAME    only run workloads whose name contains NAME\n"
+		"  --c256-kernel F  Intel HEX kernel for the c256_boot workload\n"
+		"  --format F       text, json or csv (default text)\n"
+		"  --output F       write the results to F instead of stdout\n"
+		"  --baseline F     compare against results saved with json or csv,\n"
+		"                   exits with 2 if a workload regressed\n"
+		"  --threshold P    median MIPS drop in percent counted as a\n"
+		"                   regression (default 5)\n"
+		"  --revision R     revision to record (default from the build)\n"
+		"  --list           list the workloads\n");
+}
+
+std::string HostCpuName()
+{
+	std::string name;
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	unsigned int regs[12];
+	for(unsigned int i = 0; i < 3; i++) {
+#if defined(_MSC_VER)
+		__cpuid((int*)&regs[i * 4], 0x80000002 + i);
+#else
+		if(!__get_cpuid(0x80000002 + i, &regs[i * 4], &regs[i * 4 + 1], &regs[i * 4 + 2], &regs[i * 4 + 3]))
+			break;
+#endif
+	}
+	name.assign((const char*)regs, strnlen((const char*)regs, sizeof(regs)));
+#else
+	if(FILE *f = fopen("/proc/cpuinfo", "r")) {
+		char line[256];
+		while(name.empty() && fgets(line, sizeof(line), f)) {
+			const char *colon = strchr(line, ':');
+			if(colon && (!strncmp(line, "model name", 10) || !strncmp(line, "Hardware", 8)))
+				name = colon + 1;
+		}
+		fclose(f);
+	}
+#endif
+	// Trim, the brand string is padded
+	size_t begin = name.find_first_not_of(" \t\n");
+	size_t end = name.find_last_not_of(" \t\n");
+	return begin == std::string::npos ? "unknown" : name.substr(begin, end - begin + 1);
+}
+
+RunResult TimeRun(BenchmarkWorkload *w, uint64_t cycles)
+{
+	auto start = std::chrono::steady_clock::now();
+	BenchmarkCounts counts = w->Run(cycles);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return RunResult{std::max(elapsed.count(), 1e-9), counts};
+}
+
+// Median by MIPS, since that is what the runs are compared on
+WorkloadResult Summarize(const std::string& name, std::vector<RunResult> runs)
+{
+	std::sort(runs.begin(), runs.end(), [](const RunResult& a, const RunResult& b) {
+		return a.mips() < b.mips();
+	});
+	double mean = 0;
+	for(auto& r : runs)
+		mean += r.mips() / runs.size();
+	double variance = 0;
+	if(runs.size() > 1) {
+		for(auto& r : runs)
+			variance += (r.mips() - mean) * (r.mips() - mean) / (runs.size() - 1);
+	}
+	return WorkloadResult{name, runs[runs.size() / 2], variance, runs.back().mips()};
+}
+
+std::string JsonString(const std::string& s)
+{
+	std::string out = "\"";
+	for(char c : s) {
+		if(c == '"' || c == '\\')
+			out += '\\';
+		if((unsigned char)c >= 0x20)
+			out += c;
+	}
+	return out + "\"";
+}
+
+std::string CsvField(const std::string& s)
+{
+	if(s.find_first_of(",\"\n") == std::string::npos)
+		return s;
+	std::string out = "\"";
+	for(char c : s) {
+		if(c == '"')
+			out += '"';
+		out += c;
+	}
+	return out + "\"";
+}
+
+// One workload per line, so LoadBaseline can read it back without a JSON parser
+void WriteJson(FILE *f, const Options& options, const std::string& host_cpu,
+	const std::vector<WorkloadResult>& results)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "  \"revision\": %s,\n", JsonString(options.revision).c_str());
+	fprintf(f, "  \"host_cpu\": %s,\n", JsonString(host_cpu).c_str());
+	fprintf(f, "  \"cycles_per_run\": %llu,\n", (unsigned long long)options.cycles);
+	fprintf(f, "  \"runs\": %u,\n", options.runs);
+	fprintf(f, "  \"workloads\": [\n");
+	for(size_t i = 0; i < results.size(); i++) {
+		auto& r = results[i];
+		fprintf(f, "    {\"name\": %s, \"median_mips\": %.4f, \"variance_mips\": %.6f, \"best_mips\": %.4f, "
+			"\"cycles_per_second\": %.0f, \"ns_per_instruction\": %.3f}%s\n",
+			JsonString(r.name).c_str(), r.median.mips(), r.variance, r.best,
+			r.median.cycles_per_second(), r.median.ns_per_instruction(),
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+void WriteCsv(FILE *f, const Options& options, const std::string& host_cpu,
+	const std::vector<WorkloadResult>& results)
+{
+	fprintf(f, "revision,host_cpu,workload,median_mips,variance_mips,best_mips,cycles_per_second,ns_per_instruction\n");
+	for(auto& r : results) {
+		fprintf(f, "%s,%s,%s,%.4f,%.6f,%.4f,%.0f,%.3f\n", CsvField(options.revision).c_str(),
+			CsvField(host_cpu).c_str(), CsvField(r.name).c_str(), r.median.mips(), r.variance, r.best,
+			r.median.cycles_per_second(), r.median.ns_per_instruction());
+	}
+}
+
+std::vector<std::string> SplitCsvLine(const char *line)
+{
+	std::vector<std::string> fields(1);
+	bool quoted = false;
+	for(const char *p = line; *p && *p != '\n' && *p != '\r'; p++) {
+		if(quoted) {
+			if(*p == '"' && p[1] == '"')
+				fields.back() += *p++;
+			else if(*p == '"')
+				quoted = false;
+			else
+				fields.back() += *p;
+		} else if(*p == '"') {
+			quoted = true;
+		} else if(*p == ',') {
+			fields.emplace_back();
+		} else {
+			fields.back() += *p;
+		}
+	}
+	return fields;
+}
+
+// Reads the median MIPS per workload from a file written with --format json or csv
+bool LoadBaseline(const std::string& path, std::map<std::string, double> *baseline)
+{
+	FILE *f = fopen(path.c_str(), "r");
+	if(!f)
+		return false;
+	char line[1024];
+	bool json = false;
+	bool first = true;
+	while(fgets(line, sizeof(line), f)) {
+		if(first) {
+			first = false;
+			json = line[0] == '{';
+			// The CSV header
+			if(!json)
+				continue;
+		}
+		if(json) {
+			const char *name = strstr(line, "\"name\": \"");
+			const char *mips = strstr(line, "\"median_mips\": ");
+			if(!name || !mips)
+				continue;
+			name += 9;
+			const char *name_end = strchr(name, '"');
+			if(!name_end)
+				continue;
+			(*baseline)[std::string(name, name_end)] = strtod(mips + 15, nullptr);
+		} else {
+			auto fields = SplitCsvLine(line);
+			if(fields.size() >= 4)
+				(*baseline)[fields[2]] = strtod(fields[3].c_str(), nullptr);
+		}
+	}
+	fclose(f);
+	return !baseline->empty();
+}
+
+// Returns the number of workloads that regressed by more than the threshold
+int Compare(FILE *f, const Options& options, const std::map<std::string, double>& baseline,
+	const std::vector<WorkloadResult>& results)
+{
+	int regressions = 0;
+	fprintf(f, "%-20s %10s %10s %8s\n", "workload", "baseline", "current", "change");
+	for(auto& r : results) {
+		auto it = baseline.find(r.name);
+		if(it == baseline.end() || it->second <= 0) {
+			fprintf(f, "%-20s %10s %10.2f\n", r.name.c_str(), "-", r.median.mips());
+			continue;
+		}
+		double change = (r.median.mips() - it->second) * 100 / it->second;
+		bool regressed = change < -options.threshold;
+		fprintf(f, "%-20s %10.2f %10.2f %+7.1f%%%s\n", r.name.c_str(), it->second, r.median.mips(),
+			change, regressed ? "  REGRESSION" : "");
+		if(regressed)
+			regressions++;
+	}
+	return regressions;
+}
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	bool list = false;
+	for(int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+		if(!strcmp(arg, "--list")) {
+			list = true;
+			continue;
+		}
+		if(!value || strncmp(arg, "--", 2)) {
+			Usage();
+			return 1;
+		}
+		i++;
+		if(!strcmp(arg, "--cycles")) {
+			options.cycles = strtoull(value, nullptr, 0);
+		} else if(!strcmp(arg, "--runs")) {
+			options.runs = std::max(1, atoi(value));
+		} else if(!strcmp(arg, "--warmup")) {
+			options.warmup_runs = atoi(value);
+		} else if(!strcmp(arg, "--filter")) {
+			options.filter = value;
+		} else if(!strcmp(arg, "--c256-kernel")) {
+			options.c256_kernel = value;
+		} else if(!strcmp(arg, "--format")) {
+			if(!strcmp(value, "text"))
+				options.format = Format::kText;
+			else if(!strcmp(value, "json"))
+				options.format = Format::kJson;
+			else if(!strcmp(value, "csv"))
+				options.format = Format::kCsv;
+			else {
+				Usage();
+				return 1;
+			}
+		} else if(!strcmp(arg, "--output")) {
+			options.output = value;
+		} else if(!strcmp(arg, "--baseline")) {
+			options.baseline = value;
+		} else if(!strcmp(arg, "--threshold")) {
+			options.threshold = atof(value);
+		} else if(!strcmp(arg, "--revision")) {
+			options.revision = value;
+		} else {
+			Usage();
+			return 1;
+		}
+	}
+
+	BenchmarkWorkloadList workloads;
+	AddWDC65C816Workloads(&workloads);
+	AddSystemWorkloads(&workloads, options.c256_kernel);
+	if(list) {
+		for(auto& w : workloads)
+			printf("%s\n", w->name.c_str());
+		return 0;
+	}
+
+	std::map<std::string, double> baseline;
+	if(!options.baseline.empty() && !LoadBaseline(options.baseline, &baseline)) {
+		fprintf(stderr, "Could not read baseline %s\n", options.baseline.c_str());
+		return 1;
+	}
+	FILE *out = stdout;
+	if(!options.output.empty()) {
+		out = fopen(options.output.c_str(), "w");
+		if(!out) {
+			fprintf(stderr, "Could not open %s\n", options.output.c_str());
+			return 1;
+		}
+	}
+	// Progress and comparisons go to stderr when stdout carries json or csv
+	FILE *report = (options.format == Format::kText && out == stdout) ? stdout : stderr;
+
+	std::string host_cpu = HostCpuName();
+	if(options.format == Format::kText) {
+		fprintf(out, "revision %s, host %s\n", options.revision.c_str(), host_cpu.c_str());
+		fprintf(out, "%-20s %10s %10s %14s %10s %10s\n", "workload", "MIPS", "variance", "cycles/s", "ns/insn", "best MIPS");
+	}
+	std::vector<WorkloadResult> results;
+	for(auto& w : workloads) {
+		if(!options.filter.empty() && w->name.find(options.filter) == std::string::npos)
+			continue;
+		if(!w->Prepare()) {
+			fprintf(report, "%-20s skipped\n", w->name.c_str());
+			continue;
+		}
+		bool ok = true;
+		for(uint32_t i = 0; i < options.warmup_runs && ok; i++) {
+			if((ok = w->PrepareRun()))
+				w->Run(options.cycles);
+		}
+		std::vector<RunResult> runs;
+		for(uint32_t i = 0; i < options.runs && ok; i++) {
+			if((ok = w->PrepareRun()))
+				runs.push_back(TimeRun(w.get(), options.cycles));
+		}
+		if(!ok) {
+			fprintf(report, "%-20s failed\n", w->name.c_str());
+			continue;
+		}
+		results.push_back(Summarize(w->name, std::move(runs)));
+		auto& r = results.back();
+		if(options.format == Format::kText) {
+			fprintf(out, "%-20s %10.2f %10.4f %14.0f %10.2f %10.2f\n", r.name.c_str(), r.median.mips(),
+				r.variance, r.median.cycles_per_second(), r.median.ns_per_instruction(), r.best);
+			fflush(out);
+		}
+	}
+	if(options.format == Format::kJson)
+		WriteJson(out, options, host_cpu, results);
+	else if(options.format == Format::kCsv)
+		WriteCsv(out, options, host_cpu, results);
+	if(out != stdout)
+		fclose(out);
+
+	if(!baseline.empty()) {
+		fprintf(report, "\n");
+		int regressions = Compare(report, options, baseline, results);
+		if(regressions) {
+			fprintf(report, "%d workload(s) regressed by more than %.1f%%\n", regressions, options.threshold);
+			return 2;
+		}
+	}
+	return 0;
+}
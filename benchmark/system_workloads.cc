@@ -0,0 +1,149 @@
+#include "benchmark/benchmark.h"
+
+#include "rom.h"
+#include "system/c256/c256.h"
+#include "system/nes/nes.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+// NROM program that turns on rendering and NMIs, then loops touching RAM
+const char *kNesSource = R"(
+.NES
+SEI
+LDX #$FF
+TXS
+LDA #$1E
+STA $2001
+LDA #$80
+STA $2000
+LDA $00
+CLC
+ADC #$01
+STA $00
+STA $0300,X
+INX
+JMP $C00E
+INC $01
+RTI
+)";
+constexpr uint16_t kNesNmiHandler = 0xC01C;
+constexpr uint16_t kNesIrqHandler = 0xC01E;
+
+class NesFrameWorkload : public BenchmarkWorkload
+{
+public:
+	static constexpr uint32_t kPrgSize = 0x4000;
+	static constexpr uint32_t kChrSize = 0x2000;
+	// CPU cycles per NTSC frame
+	static constexpr uint64_t kCyclesPerFrame = 29781;
+
+	NesFrameWorkload() : BenchmarkWorkload("nes_frame") {}
+
+	bool Prepare() override
+	{
+		std::vector<uint8_t> image(16 + kPrgSize + kChrSize);
+		memcpy(image.data(), "NES\x1A", 4);
+		image[4] = 1;
+		image[5] = 1;
+
+		std::string error;
+		std::vector<uint8_t> code;
+		if(!nes.cpu.GetAssembler()->Assemble(kNesSource, error, code) || code.size() > kPrgSize - 6) {
+			printf("%s: %s\n", name.c_str(), error.c_str());
+			return false;
+		}
+		uint8_t *prg = &image[16];
+		memcpy(prg, code.data(), code.size());
+		const uint16_t vectors[3] = {kNesNmiHandler, 0xC000, kNesIrqHandler};
+		for(int i = 0; i < 3; i++) {
+			prg[kPrgSize - 6 + i * 2] = vectors[i] & 0xFF;
+			prg[kPrgSize - 5 + i * 2] = vectors[i] >> 8;
+		}
+		// Busy tile data so the PPU has something to shift
+		uint8_t *chr = prg + kPrgSize;
+		for(uint32_t i = 0; i < kChrSize; i++)
+			chr[i] = (uint8_t)(i * 37 + (i >> 4));
+
+		auto rom = Rom::LoadRom(image.data(), image.size());
+		if(!rom || !nes.LoadRom(rom))
+			return false;
+		framebuffer.assign(256 * 240, 0);
+		fb.width = 256;
+		fb.height = 240;
+		fb.stride = 256 * 4;
+		fb.video_frame = (uint8_t*)framebuffer.data();
+		fb.format = nes::kOutputXRGB8888;
+		return true;
+	}
+
+	BenchmarkCounts Run(uint64_t cycles) override
+	{
+		uint64_t start_cycle = nes.cpu.cpu_state.cycle;
+		uint64_t start_instructions = nes.cpu.num_emulated_instructions;
+		uint64_t frames = std::max<uint64_t>(1, cycles / kCyclesPerFrame);
+		for(uint64_t i = 0; i < frames; i++)
+			nes.RunForOneFrame(&fb);
+		return BenchmarkCounts{nes.cpu.num_emulated_instructions - start_instructions,
+			(nes.cpu.cpu_state.cycle - start_cycle) / nes.cpu_clock_size};
+	}
+
+private:
+	nes::Nes nes;
+	nes::Framebuffer fb;
+	std::vector<uint32_t> framebuffer;
+};
+
+// Boots the kernel given with --c256-kernel
+class C256BootWorkload : public BenchmarkWorkload
+{
+public:
+	C256BootWorkload(const std::string& kernel_path) : BenchmarkWorkload("c256_boot"), kernel_path(kernel_path) {}
+
+	bool Prepare() override
+	{
+		if(kernel_path.empty())
+			return false;
+		auto file = NativeFile::Open(kernel_path);
+		if(!file)
+			return false;
+		kernel = file->ReadToVector();
+		return !kernel.empty();
+	}
+
+	bool PrepareRun() override
+	{
+		// Every run boots from scratch so runs are comparable
+		return Boot();
+	}
+
+	BenchmarkCounts Run(uint64_t cycles) override
+	{
+		c256->RunCycles(cycles);
+		return BenchmarkCounts{c256->cpu.num_emulated_instructions, c256->cpu.cpu_state.cycle};
+	}
+
+private:
+	bool Boot()
+	{
+		c256.reset(new C256(0x400000, "", ""));
+		if(!c256->LoadIntelHex(kernel))
+			return false;
+		c256->PowerOn();
+		return true;
+	}
+
+	std::string kernel_path;
+	std::vector<uint8_t> kernel;
+	std::unique_ptr<C256> c256;
+};
+}
+
+void AddSystemWorkloads(BenchmarkWorkloadList *workloads, const std::string& c256_kernel_path)
+{
+	workloads->emplace_back(new NesFrameWorkload());
+	workloads->emplace_back(new C256BootWorkload(c256_kernel_path));
+}
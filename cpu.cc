@@ -1,6 +1,9 @@
 #include "cpu.h"
+#include "hook_bus.h"
+#include "idle_loop.h"
 
 #include <stdio.h>
+#include <string.h>
 
 bool SystemBus::QueryIo(cpuaddr_t addr)
 {
@@ -19,8 +22,12 @@ uint32_t SystemBus::ReadByte(cpuaddr_t addr, uint8_t *data)
 	addr &= mem_mask;
 	Page& p = memory.pages[addr >> memory.page_shift];
 	if((p.io_mask & addr) == p.io_eq) {
+		STATS_INC(page_stats[addr >> memory.page_shift].io);
+		if(idle_loop)
+			idle_loop->OnIoRead(addr);
 		io_devices.read(io_devices.context, addr, &open_bus, 1);
 	} else if(p.ptr) {
+		STATS_INC(page_stats[addr >> memory.page_shift].ram);
 		open_bus = p.ptr[addr & memory.page_mask];
 	}
 	*data = open_bus;
@@ -38,10 +45,17 @@ uint32_t SystemBus::WriteByte(uint32_t addr, uint8_t v)
 {
 	addr &= mem_mask;
 	Page& p = memory.pages[addr >> memory.page_shift];
+	if(p.flags & Page::kWatchWrites)
+		hooks->OnWrite(addr, v, cpu->GetCpuState()->cycle);
 	if((p.io_mask & addr) == p.io_eq) {
+		STATS_INC(page_stats[addr >> memory.page_shift].io);
+		if(idle_loop)
+			idle_loop->OnIoWrite();
 		io_devices.write(io_devices.context, addr, &v, 1);
 	} else if(!(p.flags & Page::kReadOnly) && p.ptr) {
+		STATS_INC(page_stats[addr >> memory.page_shift].ram);
 		p.ptr[addr & memory.page_mask] = v;
+		p.write_epoch = dirty_epoch;
 	}
 	open_bus = open_bus_is_data ? v : addr & 0xFF;
 	return p.cycles_per_access;
@@ -52,9 +66,91 @@ uint32_t SystemBus::WriteByteNoIo(uint32_t addr, uint8_t v)
 	Page& p = memory.pages[addr >> memory.page_shift];
 	if(!(p.flags & Page::kReadOnly)) {
 		p.ptr[addr & memory.page_mask] = v;
+		p.write_epoch = dirty_epoch;
 	}
 	return p.cycles_per_access;
 }
+
+void SystemBus::MarkDirty(cpuaddr_t addr, uint32_t len)
+{
+	if(!len)
+		return;
+	uint32_t first = (addr & mem_mask) >> memory.page_shift;
+	uint32_t last = ((addr + len - 1) & mem_mask) >> memory.page_shift;
+	for(uint32_t i = first; i <= last; i++)
+		memory.pages[i].write_epoch = dirty_epoch;
+}
+
+bool SystemBus::IsDirtySince(uint64_t mark, cpuaddr_t addr, uint32_t len) const
+{
+	if(!len)
+		return false;
+	uint32_t first = (addr & mem_mask) >> memory.page_shift;
+	uint32_t last = ((addr + len - 1) & mem_mask) >> memory.page_shift;
+	for(uint32_t i = first; i <= last; i++) {
+		if(memory.pages[i].write_epoch > mark)
+			return true;
+	}
+	return false;
+}
+
+void SystemBus::GetDirtyRanges(uint64_t mark, std::vector<std::pair<cpuaddr_t, uint32_t>> *ranges) const
+{
+	uint32_t num_pages = (mem_mask >> memory.page_shift) + 1;
+	for(uint32_t i = 0; i < num_pages; i++) {
+		if(memory.pages[i].write_epoch <= mark)
+			continue;
+		cpuaddr_t addr = i << memory.page_shift;
+		if(!ranges->empty() && ranges->back().first + ranges->back().second == addr)
+			ranges->back().second += memory.page_size;
+		else
+			ranges->emplace_back(addr, memory.page_size);
+	}
+}
+uint32_t SystemBus::PeekRange(cpuaddr_t addr, uint8_t *data, uint32_t len, bool access_io)
+{
+	uint32_t done = 0;
+	while(done < len) {
+		cpuaddr_t a = (addr + done) & mem_mask;
+		Page& p = memory.pages[a >> memory.page_shift];
+		uint32_t run = std::min(len - done, memory.page_size - (a & memory.page_mask));
+		if(!p.io_mask && p.io_eq && p.ptr) {
+			memcpy(data + done, p.ptr + (a & memory.page_mask), run);
+			done += run;
+			continue;
+		}
+		for(uint32_t i = 0; i < run; i++, done++) {
+			if(!access_io && QueryIo(a + i))
+				return done;
+			ReadByte(a + i, data + done);
+		}
+	}
+	return done;
+}
+
+uint32_t SystemBus::PokeRange(cpuaddr_t addr, const uint8_t *data, uint32_t len, bool access_io)
+{
+	uint32_t done = 0;
+	while(done < len) {
+		cpuaddr_t a = (addr + done) & mem_mask;
+		Page& p = memory.pages[a >> memory.page_shift];
+		uint32_t run = std::min(len - done, memory.page_size - (a & memory.page_mask));
+		if(!p.io_mask && p.io_eq && p.ptr && !(p.flags & (Page::kReadOnly | Page::kWatchWrites))) {
+			memcpy(p.ptr + (a & memory.page_mask), data + done, run);
+			p.write_epoch = dirty_epoch;
+			done += run;
+			continue;
+		}
+		for(uint32_t i = 0; i < run; i++, done++) {
+			bool io = (p.io_mask & (a + i)) == p.io_eq;
+			if(io ? !access_io && QueryIo(a + i) : (p.flags & Page::kReadOnly) || !p.ptr)
+				return done;
+			WriteByte(a + i, data[done]);
+		}
+	}
+	return done;
+}
+
 void SystemBus::Map(cpuaddr_t addr, uint8_t *ptr, uint32_t len, bool readonly)
 {
 	uint32_t first_page = addr / memory.page_size;
@@ -72,6 +168,32 @@ void SystemBus::Init(uint32_t size_shift, uint32_t addr_bus_bits, Page *pages)
 	memory.page_mask = memory.page_size - 1;
 	memory.pages = pages;
 	mem_mask = (1UL << addr_bus_bits) - 1;
+	page_stats.assign((mem_mask >> size_shift) + 1, PageStats{0, 0});
+}
+
+void SystemBus::GetStats(const char *prefix, StatsList *stats) const
+{
+	uint64_t ram = 0, io = 0;
+	char name[64];
+	for(size_t i = 0; i < page_stats.size(); i++) {
+		ram += page_stats[i].ram;
+		io += page_stats[i].io;
+		if(page_stats[i].ram) {
+			snprintf(name, sizeof(name), "%s.page.%06X.ram", prefix, (uint32_t)(i << memory.page_shift));
+			stats->emplace_back(name, page_stats[i].ram);
+		}
+		if(page_stats[i].io) {
+			snprintf(name, sizeof(name), "%s.page.%06X.io", prefix, (uint32_t)(i << memory.page_shift));
+			stats->emplace_back(name, page_stats[i].io);
+		}
+	}
+	stats->emplace_back(std::string(prefix) + ".ram", ram);
+	stats->emplace_back(std::string(prefix) + ".io", io);
+}
+
+void SystemBus::ResetStats()
+{
+	std::fill(page_stats.begin(), page_stats.end(), PageStats{0, 0});
 }
 
 void EmulatedCpu::SingleStep(EventQueue *events)
@@ -81,6 +203,14 @@ void EmulatedCpu::SingleStep(EventQueue *events)
 	if(events) {
 		events->Expire(state->cycle);
 	}
+	if(state->halted && !WakeHalted(state)) {
+		// A step of a halted CPU moves to the next event, or by one cycle
+		uint64_t next = events ? events->next() : ~0ULL;
+		uint64_t until = next != ~0ULL ? std::max(state->cycle + 1, next) : state->cycle + 1;
+		idle_cycles += until - state->cycle;
+		state->cycle = until;
+		return;
+	}
 	state->ip &= state->ip_mask;
 	uint32_t pending_interrupts = state->pending_interrupts.load(std::memory_order_acquire);
 	if(pending_interrupts + state->interrupts >= 3) {
@@ -93,12 +223,18 @@ void EmulatedCpu::SingleStep(EventQueue *events)
 		exec->interrupt(exec->interrupt_context, type);
 		return;
 	}
-	if(breakpoints.find(state->GetCanonicalAddress()) != breakpoints.end()) {
-		breakpoints.find(state->GetCanonicalAddress())->second(this);
-	}
+	if(has_breakpoints && MayHaveBreakpoint(state->GetCanonicalAddress()))
+		CheckBreakpoint(state->GetCanonicalAddress());
 	exec->emu(exec->emu_context);
 }
 
+namespace {
+struct NoCycleProcessing
+{
+	void PostCpuCycle() { }
+};
+}
+
 void EmulatedCpu::Emulate(EventQueue *events)
 {
 	auto exec = GetExecInfo();
@@ -106,6 +242,8 @@ void EmulatedCpu::Emulate(EventQueue *events)
 	state->event_cycle = state->cycle_stop;
 	if(events)
 		events->Start(&state->event_cycle, state->cycle_stop);
+	if(state->halted)
+		state->event_cycle = state->cycle;
 	do {
 		while(state->cycle < state->event_cycle) {
 			state->ip &= state->ip_mask;
@@ -120,27 +258,194 @@ void EmulatedCpu::Emulate(EventQueue *events)
 				exec->interrupt(exec->interrupt_context, type);
 				continue;
 			}
-			if(has_breakpoints && breakpoints.find(state->GetCanonicalAddress()) != breakpoints.end()) {
-				breakpoints.find(state->GetCanonicalAddress())->second(this);
-			}
+			if(has_breakpoints && MayHaveBreakpoint(state->GetCanonicalAddress()))
+				CheckBreakpoint(state->GetCanonicalAddress());
 			exec->emu(exec->emu_context);
 		}
-		events->Expire(state->cycle);
+		if(events)
+			events->Expire(state->cycle);
+		else
+			state->event_cycle = state->cycle_stop;
+		if(state->halted) {
+			NoCycleProcessing context;
+			RunHalted(context, events);
+		}
 	} while(state->cycle < state->cycle_stop);
 }
 
-void EventQueue::ScheduleNoLock(uint64_t t, std::function<void()> f)
+namespace {
+// Reads memory without touching I/O or the open bus. Returns false if |addr| is
+// I/O or unmapped.
+bool PeekMemory(const SystemBus *bus, cpuaddr_t addr, uint8_t *v)
+{
+	addr &= bus->mem_mask;
+	const Page& p = bus->memory.pages[addr >> bus->memory.page_shift];
+	if((p.io_mask & addr) == p.io_eq || !p.ptr)
+		return false;
+	*v = p.ptr[addr & bus->memory.page_mask];
+	return true;
+}
+}
+
+bool EmulatedCpu::AddBreakpoint(cpuaddr_t addr, Breakpoint bp)
+{
+	if(!breakpoints.emplace(addr, std::move(bp)).second)
+		return false;
+	uint32_t page = (addr >> kBreakpointPageShift) & (kBreakpointPageCount - 1);
+	breakpoint_pages[page / 64] |= 1ULL << (page % 64);
+	has_breakpoints = true;
+	return true;
+}
+
+void EmulatedCpu::RemoveBreakpoint(cpuaddr_t addr)
+{
+	if(!breakpoints.erase(addr))
+		return;
+	uint32_t page = (addr >> kBreakpointPageShift) & (kBreakpointPageCount - 1);
+	bool page_used = false;
+	for(auto& bp : breakpoints) {
+		if(((bp.first >> kBreakpointPageShift) & (kBreakpointPageCount - 1)) == page) {
+			page_used = true;
+			break;
+		}
+	}
+	if(!page_used)
+		breakpoint_pages[page / 64] &= ~(1ULL << (page % 64));
+	has_breakpoints = !breakpoints.empty();
+}
+
+void EmulatedCpu::CheckBreakpoint(cpuaddr_t addr)
+{
+	auto it = breakpoints.find(addr);
+	if(it == breakpoints.end())
+		return;
+	Breakpoint& bp = it->second;
+	for(auto& c : bp.conditions) {
+		uint64_t v;
+		if(c.source == BreakpointCondition::kRegister) {
+			v = GetRegister(c.operand);
+		} else {
+			uint8_t lo, hi = 0;
+			if(!PeekMemory(breakpoint_bus, c.operand, &lo))
+				return;
+			if(c.source == BreakpointCondition::kMemory16 && !PeekMemory(breakpoint_bus, c.operand + 1, &hi))
+				return;
+			v = lo | ((uint64_t)hi << 8);
+		}
+		v &= c.mask;
+		bool holds;
+		switch(c.compare) {
+		case BreakpointCondition::kEqual: holds = v == c.value; break;
+		case BreakpointCondition::kNotEqual: holds = v != c.value; break;
+		case BreakpointCondition::kLess: holds = v < c.value; break;
+		case BreakpointCondition::kLessEqual: holds = v <= c.value; break;
+		case BreakpointCondition::kGreater: holds = v > c.value; break;
+		case BreakpointCondition::kGreaterEqual: holds = v >= c.value; break;
+		default: holds = false; break;
+		}
+		if(!holds)
+			return;
+	}
+	if(++bp.hit_count <= bp.ignore_count || !bp.fn)
+		return;
+	// The handler may remove the breakpoint
+	auto fn = bp.fn;
+	fn(this);
+}
+
+void EventQueue::ScheduleNoLock(uint64_t t, std::function<void()> f, uint32_t tag)
 {
-	entries.emplace_back(Entry{t, std::move(f)});
+	STATS_INC(num_scheduled);
+	entries.emplace_back(Entry{t, std::move(f), tag});
 	std::push_heap(entries.begin(), entries.end(), std::greater<uint64_t>());
 
-	*cycle = std::min(stop, entries.begin()->t);
+	if(cycle)
+		*cycle = std::min(stop, entries.begin()->t);
+}
+
+void EventQueue::Schedule(uint64_t t, std::function<void()> f, uint32_t tag)
+{
+	std::unique_lock<std::mutex> l(lock);
+	ScheduleNoLock(t, std::move(f), tag);
+}
+
+void EventQueue::CancelNoLock(uint32_t tag)
+{
+	auto it = std::remove_if(entries.begin(), entries.end(), [tag](const Entry& e) {
+		return e.tag == tag;
+	});
+	if(it == entries.end())
+		return;
+	entries.erase(it, entries.end());
+	std::make_heap(entries.begin(), entries.end(), std::greater<uint64_t>());
+	if(cycle)
+		*cycle = entries.empty() ? stop : std::min(stop, entries.begin()->t);
+}
+
+void EventQueue::Cancel(uint32_t tag)
+{
+	std::unique_lock<std::mutex> l(lock);
+	CancelNoLock(tag);
+}
+
+namespace {
+struct EventSaveData
+{
+	uint64_t t;
+	uint32_t tag;
+	uint32_t padding;
+};
+}
+
+bool EventQueue::SaveState(std::vector<uint8_t> *out_data)
+{
+	std::unique_lock<std::mutex> l(lock);
+	uint32_t count = 0;
+	for(auto& e : entries) {
+		if(e.tag)
+			count++;
+	}
+	size_t size = out_data->size();
+	out_data->resize(size + sizeof(count) + count * sizeof(EventSaveData));
+	uint8_t *p = &(*out_data)[size];
+	memcpy(p, &count, sizeof(count));
+	p += sizeof(count);
+	for(auto& e : entries) {
+		if(!e.tag)
+			continue;
+		EventSaveData s = {e.t, e.tag, 0};
+		memcpy(p, &s, sizeof(s));
+		p += sizeof(s);
+	}
+	return true;
 }
 
-void EventQueue::Schedule(uint64_t t, std::function<void()> f)
+bool EventQueue::LoadState(const uint8_t **in_data, const uint8_t *end,
+	const std::function<std::function<void()>(uint32_t tag)>& resolve)
 {
+	uint32_t count;
+	if((size_t)(end - *in_data) < sizeof(count))
+		return false;
+	memcpy(&count, *in_data, sizeof(count));
+	if((size_t)(end - *in_data - sizeof(count)) / sizeof(EventSaveData) < count)
+		return false;
+	*in_data += sizeof(count);
+
 	std::unique_lock<std::mutex> l(lock);
-	ScheduleNoLock(t, std::move(f));
+	entries.erase(std::remove_if(entries.begin(), entries.end(), [](const Entry& e) {
+		return e.tag != 0;
+	}), entries.end());
+	std::make_heap(entries.begin(), entries.end(), std::greater<uint64_t>());
+	for(uint32_t i = 0; i < count; i++) {
+		EventSaveData s;
+		memcpy(&s, *in_data, sizeof(s));
+		*in_data += sizeof(s);
+		auto f = resolve(s.tag);
+		if(!f)
+			return false;
+		ScheduleNoLock(s.t, std::move(f), s.tag);
+	}
+	return true;
 }
 
 void EventQueue::Expire(uint64_t t)
@@ -150,6 +455,7 @@ void EventQueue::Expire(uint64_t t)
 		auto f = std::move(entries.front().f);
 		std::pop_heap(entries.begin(), entries.end(), std::greater<uint64_t>());
 		entries.resize(entries.size() - 1);
+		STATS_INC(num_expired);
 		f();
 	}
 	if(entries.empty())
@@ -167,6 +473,19 @@ void EventQueue::Start(uint64_t *event_cycle, uint64_t stop_cycle)
 	}
 }
 
+void EventQueue::GetStats(StatsList *stats) const
+{
+	stats->emplace_back("events.scheduled", num_scheduled);
+	stats->emplace_back("events.expired", num_expired);
+	stats->emplace_back("events.pending", entries.size());
+}
+
+void EventQueue::ResetStats()
+{
+	num_scheduled = 0;
+	num_expired = 0;
+}
+
 
 std::vector<CpuInstruction> Disassembler::Disassemble(const Config& config, uint32_t& canonical_address)
 {
@@ -10,8 +10,10 @@
 #include <algorithm>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "host_system.h"
+#include "stats.h"
 
 void DoPanic(const char *file, int line, const char *function);
 #define panic() DoPanic(__FILE__, __LINE__, PRETTY_FUNCTION);
@@ -19,6 +21,9 @@ void DoPanic(const char *file, int line, const char *function);
 typedef uint32_t cpuaddr_t;
 
 class EmulatedCpu;
+class HookBus;
+class IdleLoopDetector;
+class TraceRecorder;
 
 // State that is common to any CPU
 struct CpuState
@@ -54,8 +59,26 @@ struct CpuState
 	uint32_t carry = 0; // Tested with & 0x2
 	uint32_t other_flags = 0; // Everything else
 
+	// Set by instructions like WAI and STP. Nothing is executed while halted,
+	// emulation skips ahead to the next event instead. A CPU waiting for an
+	// interrupt runs again once one is pending, even if it is masked.
+	enum HaltState : uint32_t
+	{
+		kRunning,
+		kWaitingForInterrupt,
+		kStopped,
+	};
+	uint32_t halted = kRunning;
+
 	uint32_t GetCanonicalAddress() const { return code_segment_base + (ip & ip_mask); }
 
+	// Also ends the current run of instructions
+	void Halt(HaltState state)
+	{
+		halted = state;
+		event_cycle = cycle;
+	}
+
 	// source should be > 0
 	void SetInterruptSource(uint32_t source)
 	{
@@ -108,12 +131,16 @@ public:
 struct Page
 {
 	static constexpr uint32_t kReadOnly = 1;
+	// Writes through the bus are reported to SystemBus::hooks
+	static constexpr uint32_t kWatchWrites = 2;
 
 	uint8_t *ptr;
 	uint32_t flags;
 	cpuaddr_t io_mask;
 	cpuaddr_t io_eq;
 	uint32_t cycles_per_access;
+	// SystemBus::dirty_epoch at the last write through the bus
+	uint64_t write_epoch;
 };
 
 struct MemoryMap
@@ -133,6 +160,11 @@ struct SystemBus
 		void (*write)(void *context, cpuaddr_t addr, const uint8_t *data, uint32_t size);
 		// The system should determine whether to deassert the IRQ lines
 		void (*irq_taken)(void *context, uint32_t type);
+		// Returns the first cycle at which reading one of |reads| may return
+		// something else or have a different effect, or an interrupt may be raised
+		// other than through the event queue. Returns |cycle| if unsure. Without
+		// it idle loops are never skipped.
+		uint64_t (*quiet_until)(void *context, const cpuaddr_t *reads, uint32_t num_reads, uint64_t cycle) = nullptr;
 		void *context;
 	} io_devices;
 	MemoryMap memory;
@@ -140,6 +172,32 @@ struct SystemBus
 	uint32_t mem_mask;
 	bool open_bus_is_data = true;
 	uint8_t open_bus = 0;
+	// Stamped into every page written through the bus. 64 bits so it does not
+	// wrap, idle loop detection takes a mark per loop iteration.
+	uint64_t dirty_epoch = 1;
+	HookBus *hooks = nullptr;
+	// Told about I/O accesses while it watches a loop
+	IdleLoopDetector *idle_loop = nullptr;
+
+	// Dirty tracking per guest page. Every user keeps its own mark: pages written
+	// after MarkDirtyEpoch() returned |mark| are dirty since |mark|, and taking a
+	// new mark clears them for that user only. Mirrored memory is tracked per
+	// mirror, and writes that bypass the bus have to call MarkDirty().
+	uint64_t MarkDirtyEpoch() { return dirty_epoch++; }
+	void MarkDirty(cpuaddr_t addr, uint32_t len);
+	bool IsDirtySince(uint64_t mark, cpuaddr_t addr, uint32_t len) const;
+	// Appends merged (address, length) ranges of pages dirty since |mark|
+	void GetDirtyRanges(uint64_t mark, std::vector<std::pair<cpuaddr_t, uint32_t>> *ranges) const;
+
+	struct PageStats
+	{
+		uint64_t ram;
+		uint64_t io;
+	};
+	// Accesses through ReadByte() and WriteByte(), per page
+	std::vector<PageStats> page_stats;
+	void GetStats(const char *prefix, StatsList *stats) const;
+	void ResetStats();
 
 	void Map(cpuaddr_t addr, uint8_t *ptr, uint32_t len, bool readonly = false);
 
@@ -148,6 +206,13 @@ struct SystemBus
 	uint32_t WriteByte(cpuaddr_t addr, uint8_t v);
 	uint32_t WriteByteNoIo(cpuaddr_t addr, uint8_t v);
 	bool QueryIo(cpuaddr_t addr);
+	// Copy |len| bytes for debuggers, a memcpy per page where the page is plain
+	// memory. Stop before the first I/O device address unless |access_io|, and
+	// return the number of bytes copied.
+	uint32_t PeekRange(cpuaddr_t addr, uint8_t *data, uint32_t len, bool access_io);
+	// The same for writing, also stopping before read only memory. Watched
+	// pages are written a byte at a time so their hooks run.
+	uint32_t PokeRange(cpuaddr_t addr, const uint8_t *data, uint32_t len, bool access_io);
 	void Init(uint32_t size_shift, uint32_t addr_bus_bits, Page *pages);
 
 	uint8_t ReadByte(cpuaddr_t addr)
@@ -198,6 +263,7 @@ public:
 		page.io_mask = 0;
 		page.io_eq = 1;
 		page.cycles_per_access = 1;
+		page.write_epoch = 0;
 		Init(AddressBusBits, AddressBusBits, &page);
 
 		io_devices.context = this;
@@ -234,19 +300,77 @@ private:
 struct CpuTrace
 {
 	// A simple circular buffer. Values accessed backwards from |write|
-	// record the instruction pointer of executed instructions
+	// record the instruction pointer of executed instructions. Call
+	// EmulatedCpu::UpdateTraceState() after resizing it.
 	std::vector<cpuaddr_t> addrs;
 	uint32_t write = 0;
 };
 
+// Notified of subroutine calls, interrupts and returns. |sp| is the stack
+// pointer before the call pushed anything, and after the return popped
+// everything, so a return matches every call made at or below |sp|.
+class CallObserver
+{
+public:
+	virtual ~CallObserver() {}
+	virtual void OnCall(cpuaddr_t target, uint32_t sp) = 0;
+	virtual void OnReturn(uint32_t sp) = 0;
+};
+
+// Compared against a register or memory before a breakpoint fires. The value
+// read is masked with |mask| and then compared with |value|.
+struct BreakpointCondition
+{
+	enum Source : uint8_t
+	{
+		kRegister, // |operand| is an id from EmulatedCpu::GetRegisterId()
+		kMemory8, // |operand| is a bus address, I/O is never read
+		kMemory16,
+	};
+	enum Compare : uint8_t
+	{
+		kEqual,
+		kNotEqual,
+		kLess,
+		kLessEqual,
+		kGreater,
+		kGreaterEqual,
+	};
+	Source source = kRegister;
+	Compare compare = kEqual;
+	uint32_t operand = 0;
+	uint64_t mask = ~0ULL;
+	uint64_t value = 0;
+};
+
+struct Breakpoint
+{
+	// All have to hold for the breakpoint to count as hit
+	std::vector<BreakpointCondition> conditions;
+	// Number of hits to let pass before |fn| is called
+	uint64_t ignore_count = 0;
+	uint64_t hit_count = 0;
+	std::function<void(EmulatedCpu*)> fn;
+};
+
 class EventQueue
 {
 public:
-	void Schedule(uint64_t t, std::function<void()> f);
-	void ScheduleNoLock(uint64_t t, std::function<void()> f);
+	// Events with a nonzero |tag| are part of the saved state. They are saved as
+	// their time and tag, and recreated on load through a resolve function.
+	void Schedule(uint64_t t, std::function<void()> f, uint32_t tag = 0);
+	void ScheduleNoLock(uint64_t t, std::function<void()> f, uint32_t tag = 0);
+	// Removes all pending events with |tag|, which must not be 0
+	void Cancel(uint32_t tag);
+	void CancelNoLock(uint32_t tag);
 
 	void Expire(uint64_t t);
 
+	bool SaveState(std::vector<uint8_t> *out_data);
+	// Replaces all tagged events, untagged ones are left alone.
+	bool LoadState(const uint8_t **in_data, const uint8_t *end,
+		const std::function<std::function<void()>(uint32_t tag)>& resolve);
+
 	uint64_t next() const
 	{
 		if(entries.empty())
@@ -256,24 +380,30 @@ public:
 
 	void Start(uint64_t *event_cycle, uint64_t stop_cycle);
 
+	void GetStats(StatsList *stats) const;
+	void ResetStats();
+
 private:
 	struct Entry
 	{
 		uint64_t t;
 		std::function<void()> f;
+		uint32_t tag;
 
 		operator uint64_t() const { return t; }
 	};
 	std::mutex lock;
 	std::vector<Entry> entries;
-	uint64_t *cycle;
-	uint64_t stop;
+	uint64_t *cycle = nullptr;
+	uint64_t stop = ~0ULL;
+	uint64_t num_scheduled = 0;
+	uint64_t num_expired = 0;
 };
 
 class EmulatedCpu
 {
 public:
-	EmulatedCpu(SystemBus *sys)
+	EmulatedCpu(SystemBus *sys) : breakpoint_bus(sys)
 	{
 		sys->cpu = this;
 	}
@@ -297,7 +427,18 @@ public:
 	};
 	virtual bool GetDebugRegState(std::vector<DebugReg>& regs) { return false; }
 	virtual bool SetRegister(const char *reg, uint64_t value) { return false; }
+	// For reading registers by id on hot paths, such as breakpoint conditions
+	virtual bool GetRegisterId(const char *reg, uint32_t *id) { return false; }
+	virtual uint64_t GetRegister(uint32_t id) { return 0; }
 	virtual CpuTrace* GetDebugTraceState() { return nullptr; }
+	virtual void UpdateTraceState() {}
+	// Records every executed instruction to |recorder| until called with nullptr.
+	// Returns false if the CPU cannot be traced.
+	virtual bool SetTraceRecorder(TraceRecorder *recorder) { return false; }
+	// Returns false if the CPU does not report calls
+	virtual bool SetCallObserver(CallObserver *observer) { return false; }
+	virtual void GetStats(StatsList *stats) {}
+	virtual void ResetStats() {}
 
 	struct ExecInfo
 	{
@@ -323,11 +464,14 @@ public:
 	{
 		auto exec = GetExecInfo();
 		auto state = GetCpuState();
-		uint64_t event_cycle = state->cycle_stop;
+		// The queue keeps a pointer to the event cycle, so it has to outlive this call
+		state->event_cycle = state->cycle_stop;
 		if(events)
-			events->Start(&event_cycle, state->cycle_stop);
+			events->Start(&state->event_cycle, state->cycle_stop);
+		if(state->halted)
+			state->event_cycle = state->cycle;
 		do {
-			while(state->cycle < event_cycle) {
+			while(state->cycle < state->event_cycle) {
 				state->ip &= state->ip_mask;
 				uint32_t pending_interrupts = state->pending_interrupts.load(std::memory_order_acquire);
 				if(pending_interrupts + state->interrupts >= 3) {
@@ -338,33 +482,79 @@ public:
 						type = 0;
 					}
 					exec->interrupt(exec->interrupt_context, type);
+					// Interrupt entry takes cycles like an instruction
+					context.PostCpuCycle();
 					continue;
 				}
 				context.PreCpuCycle();
-				if(breakpoints.find(state->GetCanonicalAddress()) != breakpoints.end()) {
-					breakpoints.find(state->GetCanonicalAddress())->second(this);
-				}
+				if(has_breakpoints && MayHaveBreakpoint(state->GetCanonicalAddress()))
+					CheckBreakpoint(state->GetCanonicalAddress());
 				exec->emu(exec->emu_context);
 				context.PostCpuCycle();
 			}
 			if(events)
 				events->Expire(state->cycle);
+			else
+				state->event_cycle = state->cycle_stop;
+			if(state->halted)
+				RunHalted(context, events);
 		} while(state->cycle < state->cycle_stop);
 	}
 
+	// Called after the events up to now expired. Moves time from event to event
+	// until an interrupt wakes a waiting CPU or |cycle_stop| is reached.
+	template<typename U>
+	void RunHalted(U& context, EventQueue *events)
+	{
+		auto state = GetCpuState();
+		while(state->halted && !WakeHalted(state)) {
+			// |cycle_stop| may have been moved after the queue was started
+			uint64_t until = std::min(state->event_cycle, state->cycle_stop);
+			if(until <= state->cycle)
+				break;
+			idle_cycles += until - state->cycle;
+			state->cycle = until;
+			context.PostCpuCycle();
+			if(events)
+				events->Expire(state->cycle);
+		}
+	}
+	static bool WakeHalted(CpuState *state)
+	{
+		if(state->halted != CpuState::kWaitingForInterrupt || !state->pending_interrupts.load(std::memory_order_acquire))
+			return false;
+		state->halted = CpuState::kRunning;
+		return true;
+	}
+
 	bool AddBreakpoint(cpuaddr_t addr, std::function<void(EmulatedCpu*)> fn)
 	{
-		has_breakpoints = true;
-		return breakpoints.emplace(std::make_pair(addr, std::move(fn))).second;
+		Breakpoint bp;
+		bp.fn = std::move(fn);
+		return AddBreakpoint(addr, std::move(bp));
 	}
-	void RemoveBreakpoint(cpuaddr_t addr)
+	bool AddBreakpoint(cpuaddr_t addr, Breakpoint bp);
+	void RemoveBreakpoint(cpuaddr_t addr);
+
+	// One bit per breakpoint page. Addresses beyond the bitmap wrap around, which
+	// only costs a lookup in |breakpoints|.
+	static constexpr uint32_t kBreakpointPageShift = 8;
+	static constexpr uint32_t kBreakpointPageCount = 1U << 16;
+	bool MayHaveBreakpoint(cpuaddr_t addr) const
 	{
-		breakpoints.erase(addr);
-		has_breakpoints = !breakpoints.empty();
+		uint32_t page = (addr >> kBreakpointPageShift) & (kBreakpointPageCount - 1);
+		return (breakpoint_pages[page / 64] >> (page % 64)) & 1;
 	}
+	// Evaluates the conditions of the breakpoint at |addr|, if any, and calls it
+	void CheckBreakpoint(cpuaddr_t addr);
+
+	// Cycles skipped while halted
+	uint64_t idle_cycles = 0;
 
 	bool has_breakpoints = false;
-	std::unordered_map<cpuaddr_t, std::function<void(EmulatedCpu*)>> breakpoints;
+	std::unordered_map<cpuaddr_t, Breakpoint> breakpoints;
+	uint64_t breakpoint_pages[kBreakpointPageCount / 64] = {};
+	SystemBus *breakpoint_bus;
 };
 
 
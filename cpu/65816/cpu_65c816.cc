@@ -3,6 +3,7 @@
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers" // Shut GCC up
 
 #include "cpu_65c816.h"
+#include "trace_recorder.h"
 
 #include "cpu_65c816_instructions.inl"
 
@@ -51,8 +52,11 @@ struct SaveData
 {
 	uint64_t cycle;
 	uint64_t num_instructions;
+	uint32_t pending_interrupts;
 	uint16_t a, x, y, d, sp, pc;
 	uint8_t dbr, pbr, flags, emulation, native6502;
+	// Fits in what was padding, older states load as running
+	uint8_t halted;
 };
 
 class WDC65816Assembler : public Assembler
@@ -196,6 +200,7 @@ bool WDC65816Assembler::Assemble(const char*& p, std::string& error, std::vector
 			// Directive
 			if(token == ".LONGI") {
 				token.resize(0);
+				SkipWhitespace(p);
 				GetToken(token, p);
 				if(token == "ON") long_xy = true;
 				else if(token == "OFF") long_xy = false;
@@ -208,6 +213,7 @@ bool WDC65816Assembler::Assemble(const char*& p, std::string& error, std::vector
 			}
 			if(token == ".LONGA") {
 				token.resize(0);
+				SkipWhitespace(p);
 				GetToken(token, p);
 				if(token == "ON") long_a = true;
 				else if(token == "OFF") long_a = false;
@@ -282,7 +288,7 @@ bool WDC65816Assembler::Assemble(const char*& p, std::string& error, std::vector
 
 }
 
-WDC65C816::WDC65C816(SystemBus *sys) : EmulatedCpu(sys), sys(sys)
+WDC65C816::WDC65C816(SystemBus *sys) : EmulatedCpu(sys), sys(sys), idle_loops(sys)
 {
 	mode_native_6502 = false;
 	mode_emulation = true;
@@ -372,13 +378,19 @@ void WDC65C816::SetStatusRegister(uint8_t v)
 
 void WDC65C816::WAI()
 {
+	// An interrupt that is already pending ends the wait right away
+	if(!cpu_state.pending_interrupts.load(std::memory_order_acquire))
+		cpu_state.Halt(CpuState::kWaitingForInterrupt);
 }
 void WDC65C816::STP()
 {
+	// Only a reset starts the CPU again
+	cpu_state.Halt(CpuState::kStopped);
 }
 
 void WDC65C816::DoInterrupt(InterruptType type)
 {
+	uint16_t sp = cpu_state.regs.sp.u16;
 	if(!mode_emulation) {
 		uint8_t bank = cpu_state.code_segment_base >> 16;
 		Push(bank);
@@ -412,6 +424,8 @@ void WDC65C816::DoInterrupt(InterruptType type)
 	ReadRaw(vector, pc);
 	cpu_state.ip = pc;
 	cpu_state.code_segment_base = 0;
+	if(call_observer)
+		call_observer->OnCall(pc, sp);
 
 	cpu_state.interrupts = 0;
 	if(!mode_native_6502)
@@ -422,6 +436,17 @@ void WDC65C816::DoInterrupt(InterruptType type)
 }
 
 void WDC65C816::EmulateInstruction(void *context)
+{
+	WDC65C816 *self = (WDC65C816*)context;
+	cpuaddr_t addr = self->cpu_state.GetCanonicalAddress();
+	uint8_t instruction;
+	self->ReadU8(addr, instruction);
+	STATS_INC(self->instruction_counts[self->cpu_state.mode][instruction]);
+	self->current_instruction_set[instruction](self);
+	self->num_emulated_instructions++;
+}
+
+void WDC65C816::EmulateInstructionTraced(void *context)
 {
 	WDC65C816 *self = (WDC65C816*)context;
 	cpuaddr_t addr = self->cpu_state.GetCanonicalAddress();
@@ -430,10 +455,81 @@ void WDC65C816::EmulateInstruction(void *context)
 		if(self->tracing.write == self->tracing.addrs.size())
 			self->tracing.write = 0;
 	}
+	TraceRecorder *recorder = self->trace_recorder;
+	uint32_t slot = 0;
+	if(recorder) {
+		// Operands are peeked without side effects, the opcode byte is filled in
+		// from the real fetch below
+		uint32_t bytes = 0;
+		for(uint32_t i = 1; i < 4; i++) {
+			cpuaddr_t a = (self->cpu_state.code_segment_base |
+				((self->cpu_state.ip + i) & 0xFFFF)) & self->sys->mem_mask;
+			const Page& p = self->sys->memory.pages[a >> self->sys->memory.page_shift];
+			if((p.io_mask & a) != p.io_eq && p.ptr)
+				bytes |= (uint32_t)p.ptr[a & self->sys->memory.page_mask] << (8 * i);
+		}
+		auto& regs = self->cpu_state.regs;
+		slot = recorder->Record(self->cpu_state.cycle, addr, bytes, regs.a.u16, regs.x.u16,
+			regs.y.u16, regs.sp.u16, self->GetStatusRegister());
+	}
 	uint8_t instruction;
 	self->ReadU8(addr, instruction);
+	if(recorder)
+		recorder->SetOpcode(slot, instruction);
+	STATS_INC(self->instruction_counts[self->cpu_state.mode][instruction]);
 	self->current_instruction_set[instruction](self);
 	self->num_emulated_instructions++;
+	if(recorder) {
+		recorder->SetEffectiveAddress(slot, self->last_access);
+		recorder->Commit();
+	}
+}
+
+void WDC65C816::UpdateTraceState()
+{
+	if(trace_recorder || !tracing.addrs.empty())
+		exec_info.emu = &EmulateInstructionTraced;
+	else
+		exec_info.emu = &EmulateInstruction;
+}
+
+bool WDC65C816::SetTraceRecorder(TraceRecorder *recorder)
+{
+	trace_recorder = recorder;
+	UpdateTraceState();
+	return true;
+}
+
+void WDC65C816::GetStats(StatsList *stats)
+{
+	static const char *const kModeNames[kNumModes] = {
+		"native8a8xy", "native16a8xy", "native8a16xy", "native16a16xy", "emulation", "6502"
+	};
+	uint64_t per_opcode[256] = {};
+	char name[32];
+	stats->emplace_back("cpu.instructions", num_emulated_instructions);
+	stats->emplace_back("cpu.idle_cycles", idle_cycles);
+	idle_loops.GetStats(stats);
+	for(uint32_t m = 0; m < kNumModes; m++) {
+		uint64_t total = 0;
+		for(uint32_t op = 0; op < 256; op++) {
+			total += instruction_counts[m][op];
+			per_opcode[op] += instruction_counts[m][op];
+		}
+		stats->emplace_back(std::string("cpu.mode.") + kModeNames[m], total);
+	}
+	for(uint32_t op = 0; op < 256; op++) {
+		if(!per_opcode[op])
+			continue;
+		snprintf(name, sizeof(name), "cpu.opcode.%02X", op);
+		stats->emplace_back(name, per_opcode[op]);
+	}
+}
+
+void WDC65C816::ResetStats()
+{
+	memset(instruction_counts, 0, sizeof(instruction_counts));
+	idle_loops.ResetStats();
 }
 
 void WDC65C816::Interrupt(void *context, uint32_t param)
@@ -458,6 +554,8 @@ void WDC65C816::PowerOn()
 
 void WDC65C816::Reset()
 {
+	cpu_state.halted = CpuState::kRunning;
+	idle_loops.Forget();
 	cpu_state.data_segment_base = 0;
 	cpu_state.code_segment_base = 0;
 	cpu_state.regs.sp.u8[0] -= 3;
@@ -505,7 +603,7 @@ bool WDC65C816::SaveState(std::vector<uint8_t> *out_data)
 {
 	size_t size = out_data->size();
 	out_data->resize(size + sizeof(SaveData));
-	SaveData *s = reinterpret_cast<SaveData*>((*out_data)[size]);
+	SaveData *s = reinterpret_cast<SaveData*>(&(*out_data)[size]);
 	s->a = cpu_state.regs.a.u16;
 	s->x = cpu_state.regs.x.u16;
 	s->y = cpu_state.regs.y.u16;
@@ -519,6 +617,8 @@ bool WDC65C816::SaveState(std::vector<uint8_t> *out_data)
 	s->native6502 = mode_native_6502 ? 1 : 0;
 	s->num_instructions = num_emulated_instructions;
 	s->cycle = cpu_state.cycle;
+	s->pending_interrupts = cpu_state.pending_interrupts.load(std::memory_order_relaxed);
+	s->halted = (uint8_t)cpu_state.halted;
 
 	return true;
 }
@@ -547,6 +647,9 @@ bool WDC65C816::LoadState(const uint8_t **in_data, const uint8_t *end)
 	cpu_state.code_segment_base = (uint32_t)s.pbr << 16;
 	cpu_state.data_segment_base = (uint32_t)s.dbr << 16;
 	cpu_state.cycle = s.cycle;
+	cpu_state.pending_interrupts.store(s.pending_interrupts, std::memory_order_release);
+	cpu_state.halted = s.halted <= CpuState::kStopped ? s.halted : CpuState::kRunning;
+	idle_loops.Forget();
 	num_emulated_instructions = s.num_instructions;
 
 	// Any trace history is now garbage
@@ -649,6 +752,58 @@ bool WDC65C816::SetRegister(const char *reg, uint64_t value)
 	return true;
 }
 
+namespace {
+// Register ids for GetRegister(), in the order of kRegisterNames
+enum RegisterId : uint32_t
+{
+	kRegA,
+	kRegX,
+	kRegY,
+	kRegSP,
+	kRegP,
+	kRegC,
+	kRegD,
+	kRegPB,
+	kRegDB,
+	kRegPC,
+};
+const char *kRegisterNames[] = {"a", "x", "y", "sp", "p", "c", "d", "pb", "db", "pc"};
+}
+
+bool WDC65C816::GetRegisterId(const char *reg, uint32_t *id)
+{
+	for(uint32_t i = 0; i < sizeof(kRegisterNames) / sizeof(kRegisterNames[0]); i++) {
+		if(!_stricmp(reg, kRegisterNames[i])) {
+			if(mode_native_6502 && i >= kRegC && i <= kRegDB)
+				return false;
+			*id = i;
+			return true;
+		}
+	}
+	if(!_stricmp(reg, "ip")) {
+		*id = kRegPC;
+		return true;
+	}
+	return false;
+}
+
+uint64_t WDC65C816::GetRegister(uint32_t id)
+{
+	switch(id) {
+	case kRegA: return mode_long_a ? cpu_state.regs.a.u16 : cpu_state.regs.a.u8[0];
+	case kRegX: return mode_long_xy ? cpu_state.regs.x.u16 : cpu_state.regs.x.u8[0];
+	case kRegY: return mode_long_xy ? cpu_state.regs.y.u16 : cpu_state.regs.y.u8[0];
+	case kRegSP: return cpu_state.regs.sp.u16;
+	case kRegP: return GetStatusRegister();
+	case kRegC: return cpu_state.regs.a.u16;
+	case kRegD: return cpu_state.regs.d.u16;
+	case kRegPB: return cpu_state.code_segment_base >> 16;
+	case kRegDB: return cpu_state.data_segment_base >> 16;
+	case kRegPC: return cpu_state.GetCanonicalAddress();
+	}
+	return 0;
+}
+
 bool WDC65C816::GetDebugRegState(std::vector<DebugReg>& regs)
 {
 	regs.emplace_back(DebugReg{"A", cpu_state.regs.a.u16, mode_long_a ? 2U : 1U, 0});
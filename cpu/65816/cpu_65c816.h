@@ -2,11 +2,9 @@
 #define CPU_65C816_H_
 
 #include "cpu.h"
+#include "idle_loop.h"
 #include "jit.h"
 
-// Execute for |cycles| and return number of milliseconds taken.
-uint64_t WDC65C816PerfTest(uint64_t cycles);
-
 class WDC65C816 : public EmulatedCpu, public JittableCpu, public Disassembler
 {
 public:
@@ -30,9 +28,18 @@ public:
 	bool DisassembleOneInstruction(const Config& config, uint32_t& canonical_address, CpuInstruction& insn) override;
 	bool GetDebugRegState(std::vector<DebugReg>& regs) override;
 	CpuTrace* GetDebugTraceState() override { return &tracing; }
+	void UpdateTraceState() override;
+	bool SetTraceRecorder(TraceRecorder *recorder) override;
+	bool SetCallObserver(CallObserver *observer) override { call_observer = observer; return true; }
+	void GetStats(StatsList *stats) override;
+	void ResetStats() override;
 	bool SetRegister(const char *reg, uint64_t value) override;
+	bool GetRegisterId(const char *reg, uint32_t *id) override;
+	uint64_t GetRegister(uint32_t id) override;
 
 	static void EmulateInstruction(void *context);
+	// Used instead of EmulateInstruction() while tracing
+	static void EmulateInstructionTraced(void *context);
 	static void Interrupt(void *context, uint32_t param);
 
 	void SetNZ(uint8_t v);
@@ -49,6 +56,13 @@ public:
 	uint16_t x() const { return cpu_state.regs.x.u16; }
 	uint16_t y() const { return cpu_state.regs.y.u16; }
 
+	// Called after a taken branch or jump from |from| to an address at or before it
+	void OnBackwardBranch(uint16_t from)
+	{
+		if(idle_loops.enabled())
+			idle_loops.OnBackwardBranch(&cpu_state, cpu_state.code_segment_base | from, cpu_state.data_segment_base);
+	}
+
 	void InternalOp(uint32_t n)
 	{
 		cpu_state.cycle += internal_cycle_timing * n;
@@ -83,10 +97,12 @@ public:
 	}
 	void ReadU8(uint32_t addr, uint8_t& v)
 	{
+		last_access = addr;
 		cpu_state.cycle += sys->ReadByte(addr, &v);
 	}
 	void WriteU8(uint32_t addr, uint8_t v)
 	{
+		last_access = addr;
 		cpu_state.cycle += sys->WriteByte(addr, v);
 	}
 	void ReadU16NoCrossBank(uint32_t base, uint32_t addr, uint16_t& v)
@@ -308,10 +324,17 @@ public:
 	ExecInfo exec_info;
 
 	uint64_t num_emulated_instructions = 0;
+	uint64_t instruction_counts[kNumModes][256] = {};
 
 	uint32_t internal_cycle_timing = 1;
 
 	CpuTrace tracing;
+	TraceRecorder *trace_recorder = nullptr;
+	CallObserver *call_observer = nullptr;
+	// Skips polling loops when enabled
+	IdleLoopDetector idle_loops;
+	// Traced as the effective address of the instruction
+	cpuaddr_t last_access = 0;
 };
 
 
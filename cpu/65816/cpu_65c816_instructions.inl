@@ -1679,7 +1679,9 @@ struct OpJmp
 
 	static void Exec(WDC65C816 *cpu)
 	{
+		uint16_t from = cpu->cpu_state.ip;
 		auto addr = AddrMode::CalcEffectiveAddress(cpu);
+		uint16_t sp = cpu->cpu_state.regs.sp.u16;
 		if constexpr(Impl::push_pc) {
 			if constexpr(is_long_jump) {
 				cpu->Push((uint8_t)(cpu->cpu_state.code_segment_base >> 16));
@@ -1691,6 +1693,13 @@ struct OpJmp
 		}
 		cpu->InternalOp(Impl::kInternalCycles);
 		cpu->cpu_state.ip = addr;
+		if constexpr(Impl::push_pc) {
+			if(cpu->call_observer)
+				cpu->call_observer->OnCall(cpu->cpu_state.GetCanonicalAddress(), sp);
+		} else if constexpr(!is_long_jump) {
+			if((uint16_t)addr <= from)
+				cpu->OnBackwardBranch(from);
+		}
 	}
 	static void Disassemble(WDC65C816 *cpu, uint32_t& addr, const char **str, char *formatted_str)
 	{
@@ -1740,6 +1749,8 @@ struct OpRts
 			cpu->cpu_state.code_segment_base = ((uint32_t)p) << 16;
 		}
 		cpu->InternalOp(Impl::kInternalCycles);
+		if(cpu->call_observer)
+			cpu->call_observer->OnReturn(cpu->cpu_state.regs.sp.u16);
 	}
 	static void Disassemble(WDC65C816 *cpu, uint32_t& addr, const char **str, char *formatted_str)
 	{
@@ -1851,6 +1862,8 @@ struct RTI
 			cpu->Pop(bank);
 			cpu->cpu_state.code_segment_base = (uint32_t)bank << 16;
 		}
+		if(cpu->call_observer)
+			cpu->call_observer->OnReturn(cpu->cpu_state.regs.sp.u16);
 	}
 	static void Disassemble(WDC65C816 *cpu, uint32_t& addr, const char **str, char *formatted_str)
 	{
@@ -1881,11 +1894,15 @@ struct CondBranch
 	static void Exec(WDC65C816 *cpu)
 	{
 		uint8_t offset;
+		uint16_t from = cpu->cpu_state.ip;
 		cpu->ReadPBR(cpu->cpu_state.ip + 1, offset);
 		if(Impl::DoBranch(cpu)) {
 			uint16_t offset16 = GetOffset(offset);
 			cpu->InternalOp();
-			cpu->cpu_state.ip += offset16;
+			cpu->cpu_state.ip += offset16 + kBytes;
+			if(offset & 0x80)
+				cpu->OnBackwardBranch(from);
+			return;
 		}
 		cpu->cpu_state.ip += kBytes;
 	}
@@ -2983,7 +3000,7 @@ struct WAI
 };
 struct STP
 {
-	static constexpr uint8_t opcode = 0xCB;
+	static constexpr uint8_t opcode = 0xDB;
 
 	static constexpr size_t kBytes = 1;
 	static constexpr const char kMnemonic[] = "STP";
@@ -1,52 +1,239 @@
 #include "cpu_65c816.h"
+#include "benchmark/benchmark.h"
 
+#include <stdio.h>
 #include <string.h>
 
-const char *source = R"(
+#include <chrono>
+
+namespace {
+// Branch offsets are written out by hand since the assembler has no labels.
+// Every program starts at 00:0000.
+
+const char *kAluSource = R"(
 .65816
+.LONGA OFF
+.LONGI OFF
 CLC
 XCE
-INA
-DEX
+LDA #$00
+LDY #$00
+ADC #$35
+EOR #$5A
+ASL A
+ROR A
+AND #$7F
+ORA #$01
+INX
+DEY
+CMP #$40
+BNE $F0
+SBC #$11
+BRA $EC
+)";
+
+const char *kMemorySource = R"(
+.65816
+.LONGA ON
+.LONGI ON
+CLC
+XCE
+REP #$30
+LDX #$0000
+LDA $2000,X
+ADC $4000,X
+STA $6000,X
+LDA $012000,X
+STA $016000,X
+INX
+INX
+CPX #$1000
+BNE $E8
+LDX #$0000
+BRA $E3
+)";
+
+const char *kNative16Source = R"(
+.65816
+.LONGA ON
+.LONGI ON
+CLC
+XCE
+REP #$30
+LDA #$0000
+CLC
+ADC #$1234
+EOR #$5555
+STA $80
+ASL A
+ADC $80
 TAX
-LDX $1234, Y
-LDY $1234, X
-LDA $1234
-ADC #1
-STA $1234
 INY
-SBC #2
-LDA ($3), Y
-JMP $0
+DEX
+STX $82
+SBC $82
+BRA $EB
+)";
+
+const char *kEmulationSource = R"(
+.6502
+LDX #$00
+LDA $0200,X
+CLC
+ADC #$03
+STA $0300,X
+LDA $80
+ADC #$01
+STA $80
+INX
+BNE $EE
+JMP $0000
+)";
+
+const char *kBlockMoveSource = R"(
+.65816
+.LONGA ON
+.LONGI ON
+CLC
+XCE
+REP #$30
+LDA #$0FFF
+LDX #$2000
+LDY #$8000
+MVN $00,$00
+BRA $F2
+)";
+
+// The IRQ handler is placed at 00:0010
+const char *kInterruptSource = R"(
+.65816
+.LONGA OFF
+.LONGI OFF
+CLC
+XCE
+CLI
+INX
+INY
+BRA $FC
+)";
+const char *kInterruptHandlerSource = R"(
+.65816
+.LONGA OFF
+.LONGI OFF
+INC $20
+RTI
 )";
 
-uint64_t WDC65C816PerfTest(uint64_t cycles)
+// A 65C816 with 16 MB of RAM and nothing else. With |cycle_processing| it
+// runs through EmulateWithCycleProcessing with empty hooks, which measures
+// the overhead of that loop over Emulate.
+class FlatRamWorkload : public BenchmarkWorkload
 {
-	std::string error;
-	std::vector<uint8_t> bytes;
+public:
+	FlatRamWorkload(const char *name, const char *source, bool cycle_processing = false)
+		: BenchmarkWorkload(name), cpu(&bus), source(source), cycle_processing(cycle_processing) {}
+
+	bool Prepare() override
+	{
+		ram.assign(16 * 1024 * 1024, 0);
+		if(!Assemble(source, 0))
+			return false;
+		memset(&page, 0, sizeof(page));
+		page.io_mask = 0;
+		page.io_eq = 1;
+		page.ptr = ram.data();
+		page.cycles_per_access = 1;
+		bus.Init(24, 24, &page);
+		bus.io_devices.context = this;
+		bus.io_devices.irq_taken = [](void*, uint32_t) {};
+		if(!Setup())
+			return false;
+		cpu.cpu_state.cycle = 0;
+		cpu.PowerOn();
+		return true;
+	}
+
+	BenchmarkCounts Run(uint64_t cycles) override
+	{
+		uint64_t start_cycle = cpu.cpu_state.cycle;
+		uint64_t start_instructions = cpu.num_emulated_instructions;
+		cpu.cpu_state.cycle_stop = start_cycle + cycles;
+		if(cycle_processing)
+			cpu.EmulateWithCycleProcessing(*this, &events);
+		else
+			cpu.Emulate(&events);
+		return BenchmarkCounts{cpu.num_emulated_instructions - start_instructions, cpu.cpu_state.cycle - start_cycle};
+	}
+
+	void PreCpuCycle() {}
+	void PostCpuCycle() {}
+
+protected:
+	virtual bool Setup() { return true; }
+
+	bool Assemble(const char *text, uint32_t addr)
+	{
+		std::string error;
+		std::vector<uint8_t> bytes;
+		if(!cpu.GetAssembler()->Assemble(text, error, bytes)) {
+			printf("%s: %s\n", name.c_str(), error.c_str());
+			return false;
+		}
+		memcpy(&ram[addr], bytes.data(), bytes.size());
+		return true;
+	}
 
 	SystemBus bus;
-	WDC65C816 cpu(&bus);
-	cpu.GetAssembler()->Assemble(source, error, bytes);
-	Page p;
+	WDC65C816 cpu;
+	EventQueue events;
+	Page page;
 	std::vector<uint8_t> ram;
-	ram.resize(16*1024*1024);
-	p.io_eq = 1;
-	p.io_mask = 0;
-	p.ptr = ram.data();
-	memcpy(ram.data(), bytes.data(), bytes.size());
-	ram[0xFFFC] = 0;
-	ram[0xFFFD] = 0;
-	bus.Init(24, 24, &p);
-	p.cycles_per_access = 1;
-	cpu.cpu_state.cycle = 0;
-	cpu.PowerOn();
+	const char *source;
+	bool cycle_processing;
+};
 
-	EventQueue events;
-	auto t = std::chrono::high_resolution_clock::now();
-	cpu.cpu_state.cycle_stop = cycles;
-	cpu.Emulate(&events);
-	auto diff = std::chrono::high_resolution_clock::now() - t;
+// IRQs raised every |kIrqInterval| cycles and acknowledged by the handler
+class InterruptWorkload : public FlatRamWorkload
+{
+public:
+	static constexpr uint64_t kIrqInterval = 64;
 
-	return std::chrono::duration_cast<std::chrono::milliseconds>(diff).count();
+	InterruptWorkload() : FlatRamWorkload("interrupts", kInterruptSource) {}
+
+protected:
+	bool Setup() override
+	{
+		if(!Assemble(kInterruptHandlerSource, 0x10))
+			return false;
+		// Native IRQ vector
+		ram[0xFFEE] = 0x10;
+		ram[0xFFEF] = 0;
+		bus.io_devices.irq_taken = [](void *context, uint32_t type) {
+			auto self = (InterruptWorkload*)context;
+			self->cpu.cpu_state.ClearInterruptSource(1);
+		};
+		ScheduleIrq(kIrqInterval);
+		return true;
+	}
+
+	void ScheduleIrq(uint64_t t)
+	{
+		events.ScheduleNoLock(t, [this, t]() {
+			cpu.cpu_state.SetInterruptSource(1);
+			ScheduleIrq(t + kIrqInterval);
+		});
+	}
+};
+}
+
+void AddWDC65C816Workloads(BenchmarkWorkloadList *workloads)
+{
+	workloads->emplace_back(new FlatRamWorkload("alu", kAluSource));
+	workloads->emplace_back(new FlatRamWorkload("memory", kMemorySource));
+	workloads->emplace_back(new FlatRamWorkload("native16", kNative16Source));
+	workloads->emplace_back(new FlatRamWorkload("emulation", kEmulationSource));
+	workloads->emplace_back(new FlatRamWorkload("block_move", kBlockMoveSource));
+	workloads->emplace_back(new InterruptWorkload());
+	workloads->emplace_back(new FlatRamWorkload("alu_cycle_hooks", kAluSource, true));
+	workloads->emplace_back(new FlatRamWorkload("memory_cycle_hooks", kMemorySource, true));
 }
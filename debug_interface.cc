@@ -55,6 +55,33 @@ void DebugInterface::Resume()
 	}
 }
 
+void DebugInterface::RunAtSafePoint(std::function<void()> fn, bool wait)
+{
+	std::unique_lock<std::mutex> l(pause_lock);
+	if(pause) {
+		l.unlock();
+		fn();
+		return;
+	}
+	if(!wait) {
+		l.unlock();
+		events->Schedule(0, std::move(fn));
+		return;
+	}
+	uint64_t id = ++safe_point_calls;
+	// The event runs with the queue locked, so do not hold pause_lock here
+	l.unlock();
+	events->Schedule(0, [this, id, moved_fn{std::move(fn)}]() {
+		moved_fn();
+		std::unique_lock<std::mutex> l(pause_lock);
+		safe_point_done = std::max(safe_point_done, id);
+		safe_point_var.notify_all();
+	});
+	l.lock();
+	while(safe_point_done < id)
+		safe_point_var.wait(l);
+}
+
 void DebugInterface::SingleStep(uint32_t n_clocks)
 {
 	// The CPU is paused here
@@ -74,31 +101,38 @@ void DebugInterface::SingleStep(uint32_t n_clocks)
 
 void DebugInterface::SetBreakpoint(cpuaddr_t addr, std::function<void(EmulatedCpu*)> fn, bool pause_on_hit)
 {
-	std::function<void(EmulatedCpu*)> bp_fn = 
-		[this, pause_on_hit, moved_fn{std::move(fn)}](EmulatedCpu *cpu) {
-			bool was_stepping;
-			{
-				std::unique_lock<std::mutex> l(pause_lock);
-				was_stepping = step_pending;
-				if(breakpoints_pause && !was_stepping)
-					++pause;
-			}
-			if(moved_fn)
-				moved_fn(cpu);
-			// Note: if the client called Resume() prematurely, this will result in a no-op because
-			// Resume will set pause to 0, see pause_response == false and return, and PausedFunc
-			// will see pause == 0 and return
-			if(pause_on_hit && breakpoints_pause && !was_stepping) {
-				PausedFunc();
-			} else {
-				std::unique_lock<std::mutex> l(pause_lock);
-				--pause;
-			}
-		};
+	Breakpoint bp;
+	bp.fn = std::move(fn);
+	SetBreakpoint(addr, std::move(bp), pause_on_hit);
+}
+
+void DebugInterface::SetBreakpoint(cpuaddr_t addr, Breakpoint bp, bool pause_on_hit)
+{
+	// Conditions are checked by the CPU, so this only runs on real hits
+	bp.fn = [this, pause_on_hit, moved_fn{std::move(bp.fn)}](EmulatedCpu *cpu) {
+		bool was_stepping;
+		{
+			std::unique_lock<std::mutex> l(pause_lock);
+			was_stepping = step_pending;
+			if(breakpoints_pause && !was_stepping)
+				++pause;
+		}
+		if(moved_fn)
+			moved_fn(cpu);
+		// Note: if the client called Resume() prematurely, this will result in a no-op because
+		// Resume will set pause to 0, see pause_response == false and return, and PausedFunc
+		// will see pause == 0 and return
+		if(pause_on_hit && breakpoints_pause && !was_stepping) {
+			PausedFunc();
+		} else {
+			std::unique_lock<std::mutex> l(pause_lock);
+			--pause;
+		}
+	};
 	if(pause)
-		cpu->AddBreakpoint(addr, std::move(bp_fn));
+		cpu->AddBreakpoint(addr, std::move(bp));
 	else
-		events->Schedule(0, std::bind(&EmulatedCpu::AddBreakpoint, cpu, addr, std::move(bp_fn)));
+		events->Schedule(0, [this, addr, bp]() { cpu->AddBreakpoint(addr, bp); });
 }
 
 void DebugInterface::ClearBreakpoint(cpuaddr_t addr)
@@ -106,5 +140,33 @@ void DebugInterface::ClearBreakpoint(cpuaddr_t addr)
 	if(pause)
 		cpu->RemoveBreakpoint(addr);
 	else
-		events->Schedule(0, std::bind(&EmulatedCpu::RemoveBreakpoint, cpu, (cpuaddr_t)addr));
+		events->Schedule(0, [this, addr]() { cpu->RemoveBreakpoint(addr); });
+}
+
+void DebugInterface::SetStatsSource(std::function<void(StatsList*)> get, std::function<void()> reset)
+{
+	get_stats = std::move(get);
+	reset_stats = std::move(reset);
+}
+
+void DebugInterface::GetStats(StatsList *stats)
+{
+	if(get_stats) {
+		get_stats(stats);
+		return;
+	}
+	cpu->GetStats(stats);
+	bus->GetStats("bus", stats);
+	events->GetStats(stats);
+}
+
+void DebugInterface::ResetStats()
+{
+	if(reset_stats) {
+		reset_stats();
+		return;
+	}
+	cpu->ResetStats();
+	bus->ResetStats();
+	events->ResetStats();
 }
@@ -12,16 +12,32 @@ public:
 	~DebugInterface();
 
 	void SetBreakpoint(cpuaddr_t addr, std::function<void(EmulatedCpu*)> fn, bool pause_on_hit = true);
+	// |bp.fn| is called when the conditions hold, before pausing
+	void SetBreakpoint(cpuaddr_t addr, Breakpoint bp, bool pause_on_hit = true);
 	void ClearBreakpoint(cpuaddr_t addr);
 
 	void SingleStep(uint32_t n_clocks = 1);
 
 	void Pause(bool schedule_event = true);
 	void Resume();
+	// Runs |fn| on the emulation thread between instructions and waits for it,
+	// unless |wait| is false. Cheaper than Pause() and Resume() for short
+	// accesses, as the emulation thread never blocks. Runs |fn| directly when
+	// already paused.
+	void RunAtSafePoint(std::function<void()> fn, bool wait = true);
 
 	EmulatedCpu* GetCpu() { return cpu; }
 	SystemBus* GetBus() { return bus; }
 	EventQueue* GetEventQueue() { return events; }
+	// Set by systems that raise hook events
+	void SetHookBus(HookBus *hooks) { hook_bus = hooks; }
+	HookBus* GetHookBus() { return hook_bus; }
+
+	// By default the counters of the CPU, bus and event queue. Systems with more
+	// components can provide their own.
+	void SetStatsSource(std::function<void(StatsList*)> get, std::function<void()> reset);
+	void GetStats(StatsList *stats);
+	void ResetStats();
 
 	bool paused() const { return pause != 0; }
 	bool recursively_paused() const { return pause > 1; }
@@ -33,6 +49,7 @@ protected:
 	SystemBus *bus;
 	EventQueue *events;
 	EmulatedCpu *cpu;
+	HookBus *hook_bus = nullptr;
 
 	int pause = 0;
 	bool pause_response = false;
@@ -41,4 +58,9 @@ protected:
 	std::condition_variable pause_var;
 	std::condition_variable pause_wait_var;
 	std::mutex pause_lock;
+	uint64_t safe_point_calls = 0;
+	uint64_t safe_point_done = 0;
+	std::condition_variable safe_point_var;
+	std::function<void(StatsList*)> get_stats;
+	std::function<void()> reset_stats;
 };
@@ -0,0 +1,62 @@
+#include "hook_bus.h"
+
+HookBus::HookBus(size_t capacity) : events(capacity)
+{
+}
+
+void HookBus::OnWrite(cpuaddr_t addr, uint8_t v, uint64_t cycle)
+{
+	for(auto& w : write_watches) {
+		if(addr - w.first < w.second) {
+			Post(kMemoryWrite, cycle, addr, v);
+			return;
+		}
+	}
+}
+
+void HookBus::Dispatch()
+{
+	bool any_dropped = false;
+	for(uint64_t n : dropped)
+		any_dropped |= n != 0;
+	if(!count && !any_dropped)
+		return;
+	if(sink)
+		sink(events.data(), count, dropped);
+	count = 0;
+	for(uint64_t& n : dropped)
+		n = 0;
+}
+
+void HookBus::SetSink(Sink new_sink)
+{
+	sink = std::move(new_sink);
+}
+
+void HookBus::Enable(Type type, bool enable)
+{
+	if(enable)
+		enabled_mask |= 1U << type;
+	else
+		enabled_mask &= ~(1U << type);
+}
+
+void HookBus::WatchWrites(SystemBus *bus, cpuaddr_t addr, uint32_t len)
+{
+	if(!len)
+		return;
+	write_watches.emplace_back(addr, len);
+	bus->hooks = this;
+	uint32_t first = (addr & bus->mem_mask) >> bus->memory.page_shift;
+	uint32_t last = ((addr + len - 1) & bus->mem_mask) >> bus->memory.page_shift;
+	for(uint32_t i = first; i <= last; i++)
+		bus->memory.pages[i].flags |= Page::kWatchWrites;
+}
+
+void HookBus::ClearWriteWatches(SystemBus *bus)
+{
+	write_watches.clear();
+	uint32_t num_pages = (bus->mem_mask >> bus->memory.page_shift) + 1;
+	for(uint32_t i = 0; i < num_pages; i++)
+		bus->memory.pages[i].flags &= ~Page::kWatchWrites;
+}
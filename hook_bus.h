@@ -0,0 +1,72 @@
+#ifndef HOOK_BUS_H_
+#define HOOK_BUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "cpu.h"
+
+// Events raised by a system on its emulation thread. They are queued without
+// allocating and handed to the sink in one batch at a safe point the system
+// chooses, usually the end of a frame. Only enabled types are queued.
+class HookBus
+{
+public:
+	enum Type : uint32_t
+	{
+		kFrameEnd, // a = frame number
+		kScanline, // a = scanline
+		kInterrupt, // a = interrupt source
+		kMemoryWrite, // a = address, b = value
+		kNumTypes,
+	};
+	struct Event
+	{
+		uint64_t cycle;
+		Type type;
+		uint32_t a;
+		uint32_t b;
+	};
+	// |dropped| holds, per type, the events lost because the queue was full
+	typedef std::function<void(const Event *events, size_t count, const uint64_t *dropped)> Sink;
+
+	explicit HookBus(size_t capacity = 65536);
+
+	bool enabled(Type type) const { return (enabled_mask >> type) & 1; }
+	void Post(Type type, uint64_t cycle, uint32_t a, uint32_t b = 0)
+	{
+		if(!enabled(type))
+			return;
+		if(count == events.size()) {
+			dropped[type]++;
+			return;
+		}
+		events[count++] = Event{cycle, type, a, b};
+	}
+	// Called by SystemBus for writes to pages flagged Page::kWatchWrites
+	void OnWrite(cpuaddr_t addr, uint8_t v, uint64_t cycle);
+
+	// Hands the queued events to the sink and empties the queue
+	void Dispatch();
+
+	// The rest is called on the emulation thread, or while it is paused
+	void SetSink(Sink sink);
+	void Enable(Type type, bool enable);
+	// Watched writes are reported as kMemoryWrite
+	void WatchWrites(SystemBus *bus, cpuaddr_t addr, uint32_t len);
+	void ClearWriteWatches(SystemBus *bus);
+
+private:
+	uint32_t enabled_mask = 0;
+	std::vector<Event> events;
+	size_t count = 0;
+	uint64_t dropped[kNumTypes] = {};
+	Sink sink;
+	std::vector<std::pair<cpuaddr_t, uint32_t>> write_watches;
+};
+
+#endif
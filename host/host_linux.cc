@@ -3,6 +3,7 @@
 #include <memory>
 
 #include <fcntl.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -13,10 +14,12 @@ namespace {
 class Mmap : public NativeMemory
 {
 public:
-	Mmap(uint8_t *pointer, size_t size) : ptr(pointer), size(size) {}
+	Mmap(uint8_t *pointer, size_t size, int fd = -1) : ptr(pointer), size(size), fd(fd) {}
 	~Mmap()
 	{
 		munmap(ptr, size);
+		if(fd >= 0)
+			close(fd);
 	}
 	uint8_t* Pointer() override { return ptr; }
 	size_t GetSize() override { return size; }
@@ -45,9 +48,53 @@ public:
 		mprotect(ptr, size, PROT_READ|PROT_EXEC);
 	}
 
+	std::unique_ptr<NativeMemory> Fork(bool modified) override
+	{
+		if(fd < 0 || modified) {
+			// Freeze the current contents in a memfd and continue copy on write
+			// from it, at the same address
+			int new_fd = memfd_create("retro_cpu", MFD_CLOEXEC);
+			if(new_fd < 0)
+				return NativeMemory::Fork(modified);
+			if(ftruncate(new_fd, size) || !WriteAll(new_fd)) {
+				close(new_fd);
+				return NativeMemory::Fork(modified);
+			}
+			int prot = executable ? PROT_READ|PROT_EXEC : writable ? PROT_READ|PROT_WRITE : PROT_READ;
+			if(mmap(ptr, size, prot, MAP_PRIVATE|MAP_FIXED, new_fd, 0) == MAP_FAILED)
+				abort();
+			if(fd >= 0)
+				close(fd);
+			fd = new_fd;
+		}
+		int child_fd = dup(fd);
+		if(child_fd < 0)
+			return NativeMemory::Fork(modified);
+		void *mem = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, child_fd, 0);
+		if(mem == MAP_FAILED) {
+			close(child_fd);
+			return nullptr;
+		}
+		return std::make_unique<Mmap>((uint8_t*)mem, size, child_fd);
+	}
+
 private:
+	bool WriteAll(int to)
+	{
+		size_t done = 0;
+		while(done < size) {
+			ssize_t n = pwrite(to, ptr + done, size - done, done);
+			if(n <= 0)
+				return false;
+			done += n;
+		}
+		return true;
+	}
+
 	uint8_t *ptr;
 	size_t size;
+	// The memfd backing the mapping after a fork
+	int fd;
 	bool writable = true;
 	bool executable = false;
 };
@@ -69,6 +116,25 @@ public:
 		read(fd_, ret.data(), s.st_size);
 		return ret;
 	}
+	size_t GetSize() override
+	{
+		struct stat s;
+		if(fstat(fd_, &s))
+			return 0;
+		return s.st_size;
+	}
+	bool Write(const void *data, size_t size) override
+	{
+		const uint8_t *p = static_cast<const uint8_t*>(data);
+		while(size) {
+			ssize_t n = write(fd_, p, size);
+			if(n <= 0)
+				return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
 
 private:
 	int fd_;
@@ -85,6 +151,13 @@ std::unique_ptr<NativeMemory> NativeMemory::Create(size_t size)
 
 std::unique_ptr<NativeMemory> NativeMemory::Create(NativeFile *file, size_t offset, size_t size)
 {
+	// Like on Windows, a size of 0 maps the rest of the file
+	if(size == 0) {
+		size_t file_size = file->GetSize();
+		if(file_size <= offset)
+			return nullptr;
+		size = file_size - offset;
+	}
 	void *mem = mmap(nullptr, size, PROT_WRITE|PROT_READ, MAP_PRIVATE,
 		static_cast<File*>(file)->fd(), offset);
 	if(mem == (void*)-1LL)
@@ -97,4 +170,20 @@ size_t NativeMemory::GetNativeSize()
 	return 0x1000;
 }
 
+std::shared_ptr<NativeFile> NativeFile::Open(const std::string& string)
+{
+	int fd = open(string.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return nullptr;
+	return std::make_shared<File>(fd);
+}
+
+std::shared_ptr<NativeFile> NativeFile::Create(const std::string& string)
+{
+	int fd = open(string.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0)
+		return nullptr;
+	return std::make_shared<File>(fd);
+}
+
 #endif
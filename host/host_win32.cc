@@ -3,6 +3,7 @@
 
 #include <Windows.h>
 
+#include <algorithm>
 #include <filesystem>
 
 namespace {
@@ -58,8 +59,9 @@ public:
 	{
 		uint32_t high = 0;
 		if constexpr(sizeof(offset) > 4)
-			high >>= 32;
-		ptr = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, high, offset & 0xFFFFFFFF, size);
+			high = (uint32_t)((uint64_t)offset >> 32);
+		// Copy on write, like MAP_PRIVATE
+		ptr = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_COPY, high, offset & 0xFFFFFFFF, size);
 	}
 	~FileMap()
 	{
@@ -103,6 +105,26 @@ public:
 
 		return data;
 	}
+	size_t GetSize() override
+	{
+		LARGE_INTEGER size;
+		if(!GetFileSizeEx(fd_, &size))
+			return 0;
+		return (size_t)size.QuadPart;
+	}
+	bool Write(const void *data, size_t size) override
+	{
+		const uint8_t *p = static_cast<const uint8_t*>(data);
+		while(size) {
+			DWORD n;
+			DWORD chunk = (DWORD)std::min<size_t>(size, 0x40000000);
+			if(!WriteFile(fd_, p, chunk, &n, nullptr) || !n)
+				return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
 
 private:
 	HANDLE fd_;
@@ -147,4 +169,15 @@ std::shared_ptr<NativeFile> NativeFile::Open(const std::string& string)
 	return std::make_unique<File>(file);
 }
 
+std::shared_ptr<NativeFile> NativeFile::Create(const std::string& string)
+{
+	std::experimental::filesystem::path p(string);
+	auto winstr = p.native().c_str();
+
+	HANDLE file = CreateFileW(winstr, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return nullptr;
+	return std::make_unique<File>(file);
+}
+
 #endif
@@ -15,6 +15,7 @@
 #define PRETTY_FUNCTION __PRETTY_FUNCTION__
 #include <strings.h>
 #define _stricmp strcasecmp
+#define _strnicmp strncasecmp
 
 
 #ifdef  __x86_64__ 
@@ -31,6 +32,7 @@
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 class NativeFile
 {
@@ -38,8 +40,13 @@ public:
 	virtual ~NativeFile() {}
 
 	virtual std::vector<uint8_t> ReadToVector() = 0;
+	virtual size_t GetSize() = 0;
+	// Appends to files opened with Create()
+	virtual bool Write(const void *data, size_t size) = 0;
 
 	static std::shared_ptr<NativeFile> Open(const std::string& string);
+	// Creates or truncates a file for writing
+	static std::shared_ptr<NativeFile> Create(const std::string& string);
 };
 
 // mmap() on linux, VirtualAlloc() on Windows, etc
@@ -54,6 +61,16 @@ public:
 	virtual void MapForWrite() = 0;
 	virtual void MapForExecute() = 0;
 
+	// Returns a copy on write clone. When |modified| is false the contents did
+	// not change since the last Fork() and hosts can reuse the frozen copy.
+	virtual std::unique_ptr<NativeMemory> Fork(bool modified = true)
+	{
+		auto mem = Create(GetSize());
+		if(mem)
+			memcpy(mem->Pointer(), Pointer(), GetSize());
+		return mem;
+	}
+
 	static std::unique_ptr<NativeMemory> Create(size_t size);
 	static std::unique_ptr<NativeMemory> Create(NativeFile *file, size_t offset, size_t size);
 
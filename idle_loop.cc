@@ -0,0 +1,99 @@
+#include "idle_loop.h"
+
+#include <string.h>
+
+bool IdleLoopDetector::Fingerprint::operator==(const Fingerprint& o) const
+{
+	return !memcmp(registers, o.registers, sizeof(registers)) && extra == o.extra &&
+		!memcmp(flags, o.flags, sizeof(flags)) && mode == o.mode &&
+		code_segment_base == o.code_segment_base && open_bus == o.open_bus;
+}
+
+IdleLoopDetector::Fingerprint IdleLoopDetector::Take(const CpuState *state, uint64_t extra) const
+{
+	Fingerprint fp = {};
+	uint64_t mask = state->reg_size_bytes >= 8 ? ~0ULL : (1ULL << (state->reg_size_bytes * 8)) - 1;
+	for(uint32_t i = 0; i < state->reg_count && i < 8; i++)
+		fp.registers[i] = state->registers[i] & mask;
+	fp.extra = extra;
+	fp.flags[0] = state->zero;
+	fp.flags[1] = state->negative;
+	fp.flags[2] = state->carry;
+	fp.flags[3] = state->other_flags;
+	fp.flags[4] = state->interrupts;
+	fp.mode = state->mode;
+	fp.code_segment_base = state->code_segment_base;
+	fp.open_bus = bus->open_bus;
+	return fp;
+}
+
+void IdleLoopDetector::SetEnabled(bool enable)
+{
+	is_enabled = enable;
+	Forget();
+}
+
+void IdleLoopDetector::Forget()
+{
+	head = ~0U;
+	quiet_limit = 0;
+	Watch(false);
+}
+
+void IdleLoopDetector::Watch(bool watch)
+{
+	watching = watch;
+	bus->idle_loop = watch ? this : nullptr;
+}
+
+void IdleLoopDetector::OnBackwardBranch(CpuState *state, cpuaddr_t from, uint64_t extra)
+{
+	cpuaddr_t addr = state->GetCanonicalAddress();
+	Fingerprint fp = Take(state, extra);
+	if(addr != head || from - addr >= kMaxLoopBytes || !(fp == fingerprint)) {
+		// Another loop, or this one changed something in the last iteration
+		head = addr;
+		fingerprint = fp;
+		quiet_limit = 0;
+		Watch(false);
+		return;
+	}
+	if(watching && !io_written && num_reads <= kMaxReads && bus->io_devices.quiet_until &&
+			state->pending_interrupts.load(std::memory_order_acquire) + state->interrupts < 3 &&
+			!bus->IsDirtySince(dirty_mark, 0, bus->mem_mask + 1)) {
+		uint64_t limit = bus->io_devices.quiet_until(bus->io_devices.context, reads, num_reads, state->cycle);
+		// A device may have changed after the last iteration read it, so the
+		// limit from the start of that iteration has to hold too. Until then the
+		// iteration repeats exactly.
+		if(quiet_limit > state->cycle) {
+			uint64_t until = std::min({limit, quiet_limit, state->event_cycle, state->cycle_stop});
+			uint64_t period = state->cycle - start_cycle;
+			uint64_t skip = until > state->cycle ? (until - state->cycle) / period * period : 0;
+			if(skip) {
+				state->cycle += skip;
+				skipped_cycles += skip;
+				num_skips++;
+			}
+		}
+		quiet_limit = limit;
+	} else {
+		quiet_limit = 0;
+	}
+	Watch(true);
+	start_cycle = state->cycle;
+	dirty_mark = bus->MarkDirtyEpoch();
+	num_reads = 0;
+	io_written = false;
+}
+
+void IdleLoopDetector::GetStats(StatsList *stats) const
+{
+	stats->emplace_back("cpu.idle_loop_skips", num_skips);
+	stats->emplace_back("cpu.idle_loop_cycles", skipped_cycles);
+}
+
+void IdleLoopDetector::ResetStats()
+{
+	num_skips = 0;
+	skipped_cycles = 0;
+}
@@ -0,0 +1,86 @@
+#ifndef IDLE_LOOP_H_
+#define IDLE_LOOP_H_
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Finds short loops that only wait, like polling a status register or a flag
+// set by an interrupt handler, and skips the iterations that cannot see a
+// change. A loop qualifies when two iterations in a row start with the same
+// registers and flags, write nothing, and only read I/O addresses the system
+// reports as quiet through SystemBus::IODevices::quiet_until. Whole iterations
+// are skipped, so the cycle count is the same as when running them.
+//
+// Off by default. Devices that are caught up lazily see one long gap instead
+// of many short ones, which only shows in the cycle stamps of their hooks.
+class IdleLoopDetector
+{
+public:
+	// Loop bodies longer than this are not considered
+	static constexpr uint32_t kMaxLoopBytes = 32;
+	static constexpr uint32_t kMaxReads = 4;
+
+	explicit IdleLoopDetector(SystemBus *bus) : bus(bus) {}
+
+	void SetEnabled(bool enable);
+	bool enabled() const { return is_enabled; }
+	// Drop what was learned, e.g. after memory was replaced
+	void Forget();
+
+	// Called after a taken branch or jump from |from| to the current address,
+	// which is at or before |from|. |extra| is CPU state that is not part of
+	// CpuState, like a data bank. May move |state->cycle| forward.
+	void OnBackwardBranch(CpuState *state, cpuaddr_t from, uint64_t extra);
+
+	// Called by SystemBus while a loop is watched
+	void OnIoRead(cpuaddr_t addr)
+	{
+		for(uint32_t i = 0; i < num_reads && i < kMaxReads; i++) {
+			if(reads[i] == addr)
+				return;
+		}
+		if(num_reads < kMaxReads)
+			reads[num_reads] = addr;
+		num_reads++;
+	}
+	void OnIoWrite() { io_written = true; }
+
+	void GetStats(StatsList *stats) const;
+	void ResetStats();
+
+private:
+	struct Fingerprint
+	{
+		uint64_t registers[8];
+		uint64_t extra;
+		uint32_t flags[5];
+		uint32_t mode;
+		cpuaddr_t code_segment_base;
+		uint8_t open_bus;
+
+		bool operator==(const Fingerprint& o) const;
+	};
+	Fingerprint Take(const CpuState *state, uint64_t extra) const;
+	void Watch(bool watch);
+
+	SystemBus *bus;
+	bool is_enabled = false;
+
+	// The loop seen last, and whether one iteration of it is being watched
+	cpuaddr_t head = ~0U;
+	Fingerprint fingerprint = {};
+	bool watching = false;
+	uint64_t start_cycle = 0;
+	// From SystemBus::IODevices::quiet_until at the start of the iteration
+	uint64_t quiet_limit = 0;
+	uint64_t dirty_mark = 0;
+	cpuaddr_t reads[kMaxReads];
+	uint32_t num_reads = 0;
+	bool io_written = false;
+
+	uint64_t num_skips = 0;
+	uint64_t skipped_cycles = 0;
+};
+
+#endif
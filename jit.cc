@@ -9,6 +9,23 @@ JitCoreImpl::JitCoreImpl(JittableCpu *cpu, SystemBus *system) : cpu(cpu), system
 	memory_pages = system->memory.pages;
 }
 
+void JitCoreImpl::GetStats(StatsList *stats)
+{
+	stats->emplace_back("jit.lookups", num_lookups);
+	stats->emplace_back("jit.cache_hits", num_cache_hits);
+	stats->emplace_back("jit.hit_rate_percent", num_lookups ? num_cache_hits * 100 / num_lookups : 0);
+	stats->emplace_back("jit.compiles", num_compiles);
+	stats->emplace_back("jit.invalidations", num_invalidations);
+}
+
+void JitCoreImpl::ResetStats()
+{
+	num_cache_hits = 0;
+	num_lookups = 0;
+	num_compiles = 0;
+	num_invalidations = 0;
+}
+
 #if PLATFORM_UNKNOWN
 JitCoreFactory* JitCoreFactory::Get()
 {
@@ -66,6 +66,9 @@ public:
 	virtual void InvalidateJit(uint32_t page) = 0;
 
 	virtual void JitInvalidateForWrite(uint32_t addr) = 0;
+
+	virtual void GetStats(StatsList *stats) {}
+	virtual void ResetStats() {}
 };
 
 class JittableCpu
@@ -81,7 +84,16 @@ class JitCoreImpl : public JitCore
 public:
 	JitCoreImpl(JittableCpu *cpu, SystemBus *system);
 
+	void GetStats(StatsList *stats) override;
+	void ResetStats() override;
+
 protected:
+	// Execute() calls that found compiled code, and all Execute() calls
+	uint64_t num_cache_hits = 0;
+	uint64_t num_lookups = 0;
+	uint64_t num_compiles = 0;
+	uint64_t num_invalidations = 0;
+
 	JittableCpu *cpu;
 	SystemBus *system;
 	CpuState *state;
@@ -64,7 +64,9 @@ void JitX64::Execute()
 	cpuaddr_t ip = (state->ip & state->ip_mask) + state->code_segment_base;
 
 	auto page = FindPage(state->mode, ip, false);
+	STATS_INC(num_lookups);
 	if(page) {
+		STATS_INC(num_cache_hits);
 		EnterJit(page->entrypoints[ip & page_mask]);
 	} else {
 		JitNewPageAt(ip);
@@ -89,6 +91,7 @@ void JitX64::JitUnjitted()
 
 void JitX64::JitDoJitAt(JitPage *page, uint32_t ip)
 {
+	STATS_INC(num_compiles);
 	if(page->memory_list.empty() || page->memory_list.back()->write_bytes_left() < 256) {
 		page->memory_list.emplace_back(std::make_unique<JitPage::Memory>(
 			NativeMemory::Create(NativeMemory::GetNativeSize())));
@@ -179,7 +182,7 @@ void JitX64::EnterJit(uintptr_t entry)
 
 void JitX64::InvalidateJit(uint32_t page)
 {
-
+	STATS_INC(num_invalidations);
 }
 void JitX64::JitInvalidateForWrite(uint32_t addr)
 {
@@ -2,8 +2,11 @@
 #include "libretro_interface.h"
 
 #include "host_system.h"
+#include "pixel_format.h"
 
 #include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Implemented by the embedder. retro_set_* will be called
 namespace {
@@ -21,6 +24,77 @@ struct CoreInfo {
 	std::string ext_list;
 	std::vector<LibRetroSystem::load_fn> load_fns;
 } *reg_info;
+
+const retro_variable core_variables[] = {
+	{"retrocpu_threaded", "Run emulation on a separate thread; disabled|enabled"},
+	{"retrocpu_indexed_output", "Render palette indices and convert presented frames; enabled|disabled"},
+	{"retrocpu_pixel_format", "Pixel format (restart); xrgb8888|rgb565|0rgb1555"},
+	{"retrocpu_run_ahead", "Frames to run ahead; 0|1|2|3|4"},
+	{"retrocpu_rewind", "Rewind buffer in MB, hold L2 to rewind; 0|16|64|256"},
+	{nullptr, nullptr},
+};
+
+bool GetBoolVariable(const char *key, bool default_value)
+{
+	retro_variable var = {key, nullptr};
+	if(!g_env(RETRO_ENVIRONMENT_GET_VARIABLE, &var) || !var.value)
+		return default_value;
+	return !strcmp(var.value, "enabled");
+}
+
+void UpdateCoreOptions(LibretroInterface *itf, bool force)
+{
+	bool updated = false;
+	if(!g_env(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated))
+		updated = false;
+	if(!updated && !force)
+		return;
+	itf->SetThreadedEmulation(GetBoolVariable("retrocpu_threaded", false));
+	itf->SetIndexedOutput(GetBoolVariable("retrocpu_indexed_output", true));
+	retro_variable var = {"retrocpu_run_ahead", nullptr};
+	if(g_env(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+		itf->SetRunAheadFrames(strtoul(var.value, nullptr, 10));
+	var = {"retrocpu_rewind", nullptr};
+	if(g_env(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+		itf->SetRewindBudget((size_t)strtoul(var.value, nullptr, 10) << 20);
+	if(force) {
+		// The frontend only accepts a pixel format while loading
+		retro_variable var = {"retrocpu_pixel_format", nullptr};
+		if(g_env(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value) {
+			if(!strcmp(var.value, "rgb565"))
+				itf->SetPixelFormat(LibretroInterface::RGB_565);
+			else if(!strcmp(var.value, "0rgb1555"))
+				itf->SetPixelFormat(LibretroInterface::XRGB_1555);
+			else
+				itf->SetPixelFormat(LibretroInterface::XRGB_8888);
+		}
+	}
+}
+
+bool VideoEnabled()
+{
+	int av = 0;
+	// Frontends that do not know the call always want video
+	if(!g_env(RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE, &av))
+		return true;
+	return (av & 1) != 0;
+}
+
+template<typename Pixel>
+void ConvertIndexedLine(Pixel *out, const uint8_t *in, const Pixel *palette, uint32_t width)
+{
+	uint32_t x = 0;
+	for(; x + 8 <= width; x += 8) {
+		Pixel p0 = palette[in[x + 0]], p1 = palette[in[x + 1]];
+		Pixel p2 = palette[in[x + 2]], p3 = palette[in[x + 3]];
+		Pixel p4 = palette[in[x + 4]], p5 = palette[in[x + 5]];
+		Pixel p6 = palette[in[x + 6]], p7 = palette[in[x + 7]];
+		out[x + 0] = p0; out[x + 1] = p1; out[x + 2] = p2; out[x + 3] = p3;
+		out[x + 4] = p4; out[x + 5] = p5; out[x + 6] = p6; out[x + 7] = p7;
+	}
+	for(; x < width; x++)
+		out[x] = palette[in[x]];
+}
 }
 
 void retro_set_environment(retro_environment_t e)
@@ -28,6 +102,7 @@ void retro_set_environment(retro_environment_t e)
 	bool v = true;
 	g_env = e;
 	g_env(RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME, &v);
+	g_env(RETRO_ENVIRONMENT_SET_VARIABLES, const_cast<retro_variable*>(core_variables));
 }
 void retro_set_video_refresh(retro_video_refresh_t e) { g_refresh = e; }
 void retro_set_audio_sample(retro_audio_sample_t e) { g_sample = e; }
@@ -61,9 +136,7 @@ void retro_get_system_av_info(struct retro_system_av_info *info)
 {
 	if(!g_itf)
 		return;
-	retro_pixel_format format = g_itf->pixel_format();
-	g_env(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &format);
-
+	g_itf->NegotiatePixelFormat();
 	g_itf->FillAvInfo(info);
 }
 
@@ -74,7 +147,7 @@ void retro_set_controller_port_device(unsigned port, unsigned device)
 
 void retro_reset()
 {
-	g_sys->Reset();
+	g_itf->Reset();
 }
 
 void retro_run()
@@ -84,12 +157,18 @@ void retro_run()
 
 size_t retro_serialize_size()
 {
-	return 0;
+	return g_itf ? g_itf->SerializeSize() : 0;
 }
 
-bool retro_serialize(void *data, size_t size) { return false; }
+bool retro_serialize(void *data, size_t size)
+{
+	return g_itf && g_itf->Serialize(data, size);
+}
 
-bool retro_unserialize(const void *data, size_t size) { return false; }
+bool retro_unserialize(const void *data, size_t size)
+{
+	return g_itf && g_itf->Unserialize(data, size);
+}
 
 void retro_cheat_reset() {}
 void retro_cheat_set(unsigned index, bool enabled, const char *code) {}
@@ -101,7 +180,7 @@ bool retro_load_game(const struct retro_game_info *game)
 		return false;
 
 	for(auto& fn : reg_info->load_fns) {
-		auto sys = fn(game->data, game->size);
+		auto sys = fn(game->data, game->size, game->path);
 		if(sys) {
 			g_sys = sys;
 			g_itf = new LibretroInterface(sys);
@@ -113,6 +192,7 @@ bool retro_load_game(const struct retro_game_info *game)
 				g_itf = nullptr;
 				continue;
 			}
+			UpdateCoreOptions(g_itf, true);
 			return true;
 		}
 	}
@@ -126,8 +206,9 @@ bool retro_load_game_special(unsigned game_type, const struct retro_game_info *i
 
 void retro_unload_game()
 {
-	delete g_sys;
+	// The interface owns the emulation thread, so it has to go before the system
 	delete g_itf;
+	delete g_sys;
 	g_sys = nullptr;
 	g_itf = nullptr;
 }
@@ -161,29 +242,126 @@ void LibRetroSystem::Register(std::vector<std::string> extensions, load_fn fn)
 
 LibretroInterface::LibretroInterface(LibRetroSystem *sys) : sys(sys)
 {
-	current_framebuffer.data = nullptr;
+	for(uint32_t i = 0; i < kNumFramebuffers; i++) {
+		framebuffers[i].data = nullptr;
+		framebuffers[i].width = framebuffers[i].height = framebuffers[i].pitch = 0;
+		framebuffers[i].line_palette_bank = line_palette_banks[i];
+	}
+	if(!g_env(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe))
+		can_dupe = false;
+}
+
+LibretroInterface::~LibretroInterface()
+{
+	StopEmulationThread();
 }
 
 void LibretroInterface::SetPixelFormat(PixelFormat pf)
 {
 	switch(pf) {
 	case XRGB_8888:
-		current_pf = RETRO_PIXEL_FORMAT_XRGB8888;
+		requested_pf = RETRO_PIXEL_FORMAT_XRGB8888;
+		break;
+	case RGB_565:
+		requested_pf = RETRO_PIXEL_FORMAT_RGB565;
+		break;
+	case XRGB_1555:
+		requested_pf = RETRO_PIXEL_FORMAT_0RGB1555;
 		break;
 	default:
 		break;
 	}
 }
 
+void LibretroInterface::NegotiatePixelFormat()
+{
+	// 0RGB1555 is the libretro default and needs no negotiation
+	retro_pixel_format candidates[] = {requested_pf, RETRO_PIXEL_FORMAT_XRGB8888};
+	retro_pixel_format pf = RETRO_PIXEL_FORMAT_0RGB1555;
+	for(auto candidate : candidates) {
+		retro_pixel_format format = candidate;
+		if(g_env(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &format)) {
+			pf = candidate;
+			break;
+		}
+	}
+	if(pf == current_pf)
+		return;
+	current_pf = pf;
+	UpdateIndexedPalette();
+	if(framebuffers[0].width)
+		UpdateFramebufferLayout();
+}
+
+void LibretroInterface::UpdateIndexedPalette()
+{
+	indexed_palette16.clear();
+	if(!indexed_palette || current_pf == RETRO_PIXEL_FORMAT_XRGB8888)
+		return;
+	indexed_palette16.resize(palette_bank_size * num_palette_banks);
+	for(size_t i = 0; i < indexed_palette16.size(); i++)
+		indexed_palette16[i] = current_pf == RETRO_PIXEL_FORMAT_RGB565 ?
+			PackRgb565(indexed_palette[i]) : PackXrgb1555(indexed_palette[i]);
+}
+
+void LibretroInterface::SetThreadedEmulation(bool enable)
+{
+	if(threaded == enable)
+		return;
+	if(!enable)
+		StopEmulationThread();
+	threaded = enable;
+}
+
+void LibretroInterface::SetIndexedOutput(bool enable)
+{
+	if(enable) {
+		indexed_palette = sys->GetIndexedPalette(&palette_bank_size, &num_palette_banks);
+		enable = indexed_palette != nullptr;
+	}
+	if(indexed == enable)
+		return;
+	indexed = enable;
+	UpdateIndexedPalette();
+	if(framebuffers[0].width)
+		UpdateFramebufferLayout();
+}
+
+void LibretroInterface::UpdateFramebufferLayout()
+{
+	for(auto& fb : framebuffers) {
+		fb.indexed = indexed;
+		fb.format = current_pf;
+		fb.pitch = fb.width * GetBytesPerPixel();
+	}
+	AllocateFramebuffer();
+}
+
 void LibretroInterface::AllocateFramebuffer()
 {
-	fb_memory = NativeMemory::Create(240 * current_framebuffer.pitch);
-	current_framebuffer.data = fb_memory->Pointer();
+	StopEmulationThread();
+	if(indexed) {
+		convert_pitch = framebuffers[0].width * GetOutputBytesPerPixel();
+		convert_memory = NativeMemory::Create(convert_pitch * framebuffers[0].height);
+	} else {
+		convert_memory.reset();
+	}
+	size_t fb_size = kMaxLines * framebuffers[0].pitch;
+	fb_memory = NativeMemory::Create(fb_size * kNumFramebuffers);
+	for(uint32_t i = 0; i < kNumFramebuffers; i++)
+		framebuffers[i].data = fb_memory->Pointer() + i * fb_size;
+	presented_index = -1;
+	ready_index = -1;
+}
+
+uint32_t LibretroInterface::GetOutputBytesPerPixel()
+{
+	return (current_pf == RETRO_PIXEL_FORMAT_XRGB8888) ? 4 : 2;
 }
 
 uint32_t LibretroInterface::GetBytesPerPixel()
 {
-	return 4;
+	return indexed ? 1 : GetOutputBytesPerPixel();
 }
 
 void LibretroInterface::FillAvInfo(retro_system_av_info *av)
@@ -198,29 +376,323 @@ void LibretroInterface::FillAvInfo(retro_system_av_info *av)
 	av->geometry.max_width = mw;
 	av->geometry.aspect_ratio = 0.0f;
 
-	current_framebuffer.width = w;
-	current_framebuffer.height = h;
-	current_framebuffer.pitch = w * GetBytesPerPixel();
-	AllocateFramebuffer();
+	for(auto& fb : framebuffers) {
+		fb.width = w;
+		fb.height = h;
+	}
+	UpdateFramebufferLayout();
 }
 
 int16_t LibretroInterface::GetInput(uint32_t port, uint32_t device, uint32_t index, uint32_t id)
 {
+	if(thread_running) {
+		// Called from the emulation thread, which may not talk to the frontend
+		if(device != RETRO_DEVICE_JOYPAD || index != 0 || port >= kNumInputPorts || id >= kNumJoypadButtons)
+			return 0;
+		return thread_input[port][id];
+	}
 	return g_input_state(port, device, index, id);
 }
 
 void LibretroInterface::PollInput()
 {
 	queried_input = true;
+	if(!thread_running)
+		g_input_poll();
+}
+
+void LibretroInterface::SnapshotInput()
+{
+	int16_t state[kNumInputPorts][kNumJoypadButtons];
 	g_input_poll();
+	for(uint32_t port = 0; port < kNumInputPorts; port++) {
+		for(uint32_t id = 0; id < kNumJoypadButtons; id++)
+			state[port][id] = g_input_state(port, RETRO_DEVICE_JOYPAD, 0, id);
+	}
+	std::unique_lock<std::mutex> l(frame_lock);
+	memcpy(input_snapshot, state, sizeof(input_snapshot));
+}
+
+uint32_t LibretroInterface::NextFreeFramebuffer() const
+{
+	for(uint32_t i = 0; i < kNumFramebuffers; i++) {
+		if((int)i != presented_index && (int)i != ready_index)
+			return i;
+	}
+	// Unreachable with three buffers: at most two are ever held
+	return 0;
+}
+
+const uint8_t* LibretroInterface::ConvertFramebuffer(const LibretroFramebuffer& fb)
+{
+	uint8_t *out = convert_memory->Pointer();
+	for(uint32_t y = 0; y < fb.height; y++) {
+		uint32_t line = y + kOverscanLines;
+		uint32_t bank = fb.line_palette_bank[line] * palette_bank_size;
+		if(indexed_palette16.empty()) {
+			ConvertIndexedLine(reinterpret_cast<uint32_t*>(out + y * convert_pitch),
+				fb.data + line * fb.pitch, indexed_palette + bank, fb.width);
+		} else {
+			ConvertIndexedLine(reinterpret_cast<uint16_t*>(out + y * convert_pitch),
+				fb.data + line * fb.pitch, indexed_palette16.data() + bank, fb.width);
+		}
+	}
+	return out;
+}
+
+void LibretroInterface::Present(int index)
+{
+	auto& fb = framebuffers[index];
+	if(can_dupe && !VideoEnabled()) {
+		// The frontend drops this frame anyway, e.g. while running ahead
+		g_refresh(nullptr, fb.width, fb.height, 0);
+		return;
+	}
+	if(fb.indexed) {
+		g_refresh(ConvertFramebuffer(fb), fb.width, fb.height, convert_pitch);
+		return;
+	}
+	g_refresh(fb.data + fb.pitch * kOverscanLines, fb.width, fb.height, fb.pitch);
+}
+
+void LibretroInterface::StartEmulationThread()
+{
+	if(thread_running)
+		return;
+	thread_quit = false;
+	thread_running = true;
+	// Start the thread one frame ahead of the frontend
+	frames_started = 0;
+	frames_requested = (ready_index < 0) ? 1 : 0;
+	memcpy(thread_input, input_snapshot, sizeof(thread_input));
+	emulation_thread = std::thread(&LibretroInterface::EmulationThreadFunc, this);
+}
+
+void LibretroInterface::StopEmulationThread()
+{
+	if(!thread_running)
+		return;
+	{
+		std::unique_lock<std::mutex> l(frame_lock);
+		thread_quit = true;
+		frame_var.notify_all();
+	}
+	emulation_thread.join();
+	thread_running = false;
+}
+
+void LibretroInterface::EmulationThreadFunc()
+{
+	std::unique_lock<std::mutex> l(frame_lock);
+	for(;;) {
+		while(!thread_quit && frames_started == frames_requested)
+			frame_var.wait(l);
+		if(thread_quit)
+			break;
+		frames_started++;
+		uint32_t index = NextFreeFramebuffer();
+		memcpy(thread_input, input_snapshot, sizeof(thread_input));
+		l.unlock();
+
+		sys->Tick(&framebuffers[index]);
+
+		l.lock();
+		ready_index = index;
+		frame_var.notify_all();
+	}
+}
+
+void LibretroInterface::SetRunAheadFrames(uint32_t frames)
+{
+	if(frames) {
+		// Check once that the system can snapshot, this also sizes the buffer
+		StopEmulationThread();
+		state_buffer.clear();
+		if(!sys->SaveState(&state_buffer))
+			frames = 0;
+	}
+	run_ahead = frames;
+}
+
+size_t LibretroInterface::SerializeSize()
+{
+	// Frontends need a fixed size, leave room for event queue entries
+	static constexpr size_t kSlack = 256;
+	StopEmulationThread();
+	state_buffer.clear();
+	if(!sys->SaveState(&state_buffer))
+		return 0;
+	return state_buffer.size() + kSlack;
+}
+
+bool LibretroInterface::Serialize(void *data, size_t size)
+{
+	// A frame rendered ahead by the thread is part of the state, it is
+	// presented by the next Run()
+	StopEmulationThread();
+	state_buffer.clear();
+	if(!sys->SaveState(&state_buffer) || state_buffer.size() > size)
+		return false;
+	memcpy(data, state_buffer.data(), state_buffer.size());
+	memset(static_cast<uint8_t*>(data) + state_buffer.size(), 0, size - state_buffer.size());
+	return true;
+}
+
+bool LibretroInterface::Unserialize(const void *data, size_t size)
+{
+	StopEmulationThread();
+	ready_index = -1;
+	ClearRewind();
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	return sys->LoadState(&p, p + size);
+}
+
+void LibretroInterface::RunAhead()
+{
+	LibretroFramebuffer hidden = framebuffers[0];
+	hidden.data = nullptr;
+	hidden.indexed = false;
+	hidden.line_palette_bank = nullptr;
+
+	queried_input = false;
+	sys->Tick(&hidden);
+	if(!queried_input)
+		g_input_poll();
+
+	state_buffer.clear();
+	sys->SaveState(&state_buffer);
+	for(uint32_t i = 1; i < run_ahead; i++)
+		sys->Tick(&hidden);
+	uint32_t index = NextFreeFramebuffer();
+	sys->Tick(&framebuffers[index]);
+	presented_index = index;
+	Present(index);
+
+	const uint8_t *p = state_buffer.data();
+	sys->LoadState(&p, p + state_buffer.size());
+}
+
+void LibretroInterface::SetRewindBudget(size_t bytes)
+{
+	if(!bytes) {
+		rewind.reset();
+		rewind_capture.clear();
+		return;
+	}
+	if(rewind) {
+		rewind->SetBudget(bytes);
+		return;
+	}
+	// Only capture when the system can snapshot
+	StopEmulationThread();
+	state_buffer.clear();
+	if(!sys->SaveState(&state_buffer))
+		return;
+	rewind = std::make_unique<RewindBuffer>(bytes, kRewindKeyframeInterval);
+	rewind_capture.clear();
+}
+
+void LibretroInterface::Reset()
+{
+	// Any frame rendered ahead is from before the reset
+	StopEmulationThread();
+	ready_index = -1;
+	sys->Reset();
+	ClearRewind();
+}
+
+void LibretroInterface::ClearRewind()
+{
+	// Rewinding must not cross a reset or a loaded state
+	if(rewind)
+		rewind->Clear();
+	rewind_capture.clear();
+	rewinding = false;
 }
 
 void LibretroInterface::Run()
 {
+	UpdateCoreOptions(this, false);
+
+	if(threaded) {
+		SnapshotInput();
+		StartEmulationThread();
+
+		int index;
+		{
+			std::unique_lock<std::mutex> l(frame_lock);
+			while(ready_index < 0)
+				frame_var.wait(l);
+			index = ready_index;
+			ready_index = -1;
+			// Let the thread start on the next frame while this one is presented
+			presented_index = index;
+			frames_requested++;
+			frame_var.notify_all();
+		}
+		Present(index);
+		return;
+	}
+
+	if(ready_index >= 0) {
+		// Left over from threaded mode, it has already been emulated
+		int index = ready_index;
+		ready_index = -1;
+		g_input_poll();
+		presented_index = index;
+		Present(index);
+		return;
+	}
+
+	if(rewind) {
+		g_input_poll();
+		bool held = g_input_state(0, RETRO_DEVICE_JOYPAD, 0, kRewindButton) != 0;
+		// The newest snapshot is the frame on screen
+		if(held && !rewinding)
+			rewind->Pop(nullptr);
+		rewinding = held && rewind->Pop(&rewind_state);
+		if(rewinding) {
+			rewind_capture.clear();
+			const uint8_t *p = rewind_state.data();
+			if(sys->LoadState(&p, p + rewind_state.size())) {
+				RunFrame();
+				return;
+			}
+			rewinding = false;
+		}
+	}
+
+	if(run_ahead) {
+		// Leaves the state after the real frame in |state_buffer|
+		RunAhead();
+		if(rewind) {
+			rewind->Push(state_buffer.data(), state_buffer.size());
+			rewind_capture.clear();
+		}
+		return;
+	}
+
+	RunFrame();
+	if(rewind)
+		CaptureRewindState();
+}
+
+void LibretroInterface::CaptureRewindState()
+{
+	rewind_changed.clear();
+	if(sys->UpdateState(&rewind_capture, &rewind_changed))
+		rewind->Push(rewind_capture.data(), rewind_capture.size(), rewind_changed);
+	else
+		rewind_capture.clear();
+}
+
+void LibretroInterface::RunFrame()
+{
+	uint32_t index = NextFreeFramebuffer();
 	queried_input = false;
-	sys->Tick(&current_framebuffer);
+	sys->Tick(&framebuffers[index]);
 	if(!queried_input)
 		g_input_poll();
-	g_refresh(current_framebuffer.data + current_framebuffer.pitch * 8,
-		current_framebuffer.width, current_framebuffer.height, current_framebuffer.pitch);
+	presented_index = index;
+	Present(index);
 }
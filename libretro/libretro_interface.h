@@ -2,12 +2,16 @@
 #define LIBRETRO_INTERFACE_H_
 
 #include <stdint.h>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 
 #include "host_system.h"
 #include "libretro.h"
+#include "rewind.h"
 
 // Libretro is an interface that allows an embedder to run many embedded systems.
 
@@ -16,8 +20,15 @@ class LibRetroSystem;
 
 struct LibretroFramebuffer
 {
+	// Null when the frame is not shown and does not need to be rendered
 	uint8_t *data;
 	uint32_t width, height, pitch;
+	// Pixel format of |data| unless |indexed| is set
+	retro_pixel_format format = RETRO_PIXEL_FORMAT_XRGB8888;
+	// When set |data| holds one palette index per pixel, and every line selects a
+	// bank of the palette from LibRetroSystem::GetIndexedPalette().
+	bool indexed = false;
+	uint8_t *line_palette_bank = nullptr;
 };
 
 class LibRetroSystem
@@ -33,15 +44,33 @@ public:
 	virtual bool IsNtsc() = 0;
 	virtual void Reset() = 0;
 	virtual void UpdateController(uint32_t port, uint32_t device) = 0;
+	// Systems that can render palette indices return their XRGB8888 palette, made of
+	// |num_banks| banks of |bank_size| colors. Returns nullptr when not supported.
+	virtual const uint32_t* GetIndexedPalette(uint32_t *bank_size, uint32_t *num_banks) { return nullptr; }
+	virtual bool SaveState(std::vector<uint8_t> *out_data) { return false; }
+	virtual bool LoadState(const uint8_t **in_data, const uint8_t *end) { return false; }
+	// Like SaveState(), for taking one every frame. |state| holds what the last
+	// call left in it, or is empty. Systems that track writes only save again
+	// what may have changed, and append its (offset, size) ranges to |changed|.
+	virtual bool UpdateState(std::vector<uint8_t> *state, std::vector<std::pair<size_t, size_t>> *changed)
+	{
+		state->clear();
+		if(!SaveState(state))
+			return false;
+		changed->emplace_back(0, state->size());
+		return true;
+	}
 
-	typedef LibRetroSystem* (*load_fn)(const void *data, size_t size);
+	// |path| is the file |data| was loaded from, if the frontend knows it. |data|
+	// is only valid during the call.
+	typedef LibRetroSystem* (*load_fn)(const void *data, size_t size, const char *path);
 	static void Register(std::vector<std::string> extensions, load_fn fn);
 
 	template<typename T>
 	static bool RegisterType(std::vector<std::string> extensions)
 	{
-		Register(std::move(extensions), [](const void *data, size_t size) -> LibRetroSystem* {
-			return T::Load(static_cast<const uint8_t*>(data), size);
+		Register(std::move(extensions), [](const void *data, size_t size, const char *path) -> LibRetroSystem* {
+			return T::Load(static_cast<const uint8_t*>(data), size, path);
 		});
 		return true;
 	}
@@ -51,34 +80,127 @@ class LibretroInterface
 {
 public:
 	LibretroInterface(LibRetroSystem *sys);
+	~LibretroInterface();
 
 	void PollInput();
-	static int16_t GetInput(uint32_t port, uint32_t device, uint32_t index, uint32_t id);
+	int16_t GetInput(uint32_t port, uint32_t device, uint32_t index, uint32_t id);
 
 	enum PixelFormat
 	{
 		XRGB_8888,
+		RGB_565,
+		XRGB_1555,
 	};
+	// Takes effect when the frontend is next asked for the AV info
 	void SetPixelFormat(PixelFormat pf);
 
 	void ProduceAudioSample(int16_t l, int16_t r);
 
 	retro_pixel_format pixel_format() const { return current_pf; }
 
+	// When enabled the system is ticked on a dedicated thread that stays one frame
+	// ahead of the frontend, and Run() only publishes the last completed frame.
+	// Input is sampled by Run() and handed to the thread with the frame request.
+	void SetThreadedEmulation(bool enable);
+	bool threaded_emulation() const { return threaded; }
+
+	// When enabled the system renders palette indices, and only frames that are
+	// presented to the frontend get converted to the output pixel format.
+	void SetIndexedOutput(bool enable);
+	bool indexed_output() const { return indexed; }
+
+	// Emulate |frames| extra frames with video off every Run(), present the last
+	// one and restore the state from before. Needs save state support, and is
+	// not used together with threaded emulation.
+	void SetRunAheadFrames(uint32_t frames);
+	uint32_t run_ahead_frames() const { return run_ahead; }
+
+	// Keeps up to |bytes| of history that is played back while the rewind button
+	// is held, 0 disables it. Not used together with threaded emulation.
+	void SetRewindBudget(size_t bytes);
 
 	// Do not call, used by the system implementation
 	void Run();
+	void Reset();
 	void FillAvInfo(retro_system_av_info *av);
+	size_t SerializeSize();
+	bool Serialize(void *data, size_t size);
+	bool Unserialize(const void *data, size_t size);
+	void NegotiatePixelFormat();
 
 private:
+	static constexpr uint32_t kNumFramebuffers = 3;
+	static constexpr uint32_t kNumInputPorts = 2;
+	static constexpr uint32_t kNumJoypadButtons = 16;
+	static constexpr uint32_t kMaxLines = 240;
+	// Lines at the top of the framebuffer that are not presented
+	static constexpr uint32_t kOverscanLines = 8;
+	static constexpr uint32_t kRewindButton = RETRO_DEVICE_ID_JOYPAD_L2;
+	static constexpr uint32_t kRewindKeyframeInterval = 60;
+
+	void UpdateFramebufferLayout();
 	void AllocateFramebuffer();
 	uint32_t GetBytesPerPixel();
+	uint32_t GetOutputBytesPerPixel();
+	uint32_t NextFreeFramebuffer() const;
+	void Present(int index);
+	const uint8_t* ConvertFramebuffer(const LibretroFramebuffer& fb);
+	void UpdateIndexedPalette();
+	void SnapshotInput();
+	void RunAhead();
+	void RunFrame();
+	void CaptureRewindState();
+	void ClearRewind();
+
+	void StartEmulationThread();
+	void StopEmulationThread();
+	void EmulationThreadFunc();
 
 	LibRetroSystem *sys = nullptr;
+	retro_pixel_format requested_pf = RETRO_PIXEL_FORMAT_XRGB8888;
 	retro_pixel_format current_pf = RETRO_PIXEL_FORMAT_XRGB8888;
 	bool queried_input = false;
-	LibretroFramebuffer current_framebuffer;
+	bool can_dupe = false;
+
+	// Ring of framebuffers. |presented_index| is owned by the frontend until the next
+	// Run(), |ready_index| has been rendered but not yet presented.
+	LibretroFramebuffer framebuffers[kNumFramebuffers];
 	std::unique_ptr<NativeMemory> fb_memory;
+	int presented_index = -1;
+	int ready_index = -1;
+
+	bool indexed = false;
+	const uint32_t *indexed_palette = nullptr;
+	uint32_t palette_bank_size = 0;
+	uint32_t num_palette_banks = 0;
+	// |indexed_palette| converted to 16 bit pixel formats
+	std::vector<uint16_t> indexed_palette16;
+	uint8_t line_palette_banks[kNumFramebuffers][kMaxLines] = {};
+	std::unique_ptr<NativeMemory> convert_memory;
+	uint32_t convert_pitch = 0;
+
+	bool threaded = false;
+	bool thread_running = false;
+	bool thread_quit = false;
+	uint64_t frames_requested = 0;
+	uint64_t frames_started = 0;
+	int16_t input_snapshot[kNumInputPorts][kNumJoypadButtons] = {};
+	int16_t thread_input[kNumInputPorts][kNumJoypadButtons] = {};
+	uint32_t run_ahead = 0;
+	// Preallocated so snapshots do not allocate per frame
+	std::vector<uint8_t> state_buffer;
+	std::unique_ptr<RewindBuffer> rewind;
+	std::vector<uint8_t> rewind_state;
+	// Set while the rewind button is held and there was history to go back to
+	bool rewinding = false;
+	// Same as the newest state in |rewind| unless empty, brought up to date
+	// every frame with LibRetroSystem::UpdateState()
+	std::vector<uint8_t> rewind_capture;
+	RewindBuffer::Ranges rewind_changed;
+
+	std::thread emulation_thread;
+	std::mutex frame_lock;
+	std::condition_variable frame_var;
 };
 
 #endif
@@ -2,12 +2,27 @@
 
 #include "lua.hpp"
 
+#include <string.h>
+
 LuaCpu::LuaCpu(DebugInterface *debug) : debug(debug)
 {
 }
 
 LuaCpu::~LuaCpu()
 {
+	if(profiler || hook_owner) {
+		PauseImpl();
+		profiler.reset();
+		if(hook_owner) {
+			// Hook changes still queued see the owner gone
+			hook_owner.reset();
+			HookBus *hooks = debug->GetHookBus();
+			hooks->SetSink(nullptr);
+			for(uint32_t type = 0; type < HookBus::kNumTypes; type++)
+				hooks->Enable((HookBus::Type)type, false);
+		}
+		ResumeImpl();
+	}
 }
 
 void LuaCpu::Push(lua_State *L)
@@ -24,6 +39,10 @@ void LuaCpu::Push(lua_State *L)
 	lua_setfield(L, -2, "peek");
 	lua_pushcfunction(L, Poke);
 	lua_setfield(L, -2, "poke");
+	lua_pushcfunction(L, PeekRange);
+	lua_setfield(L, -2, "peek_range");
+	lua_pushcfunction(L, PokeRange);
+	lua_setfield(L, -2, "poke_range");
 	lua_pushcfunction(L, Pause);
 	lua_setfield(L, -2, "pause");
 	lua_pushcfunction(L, Resume);
@@ -38,6 +57,24 @@ void LuaCpu::Push(lua_State *L)
 	lua_setfield(L, -2, "assemble");
 	lua_pushcfunction(L, SetRegister);
 	lua_setfield(L, -2, "set_reg");
+	lua_pushcfunction(L, ProfileStart);
+	lua_setfield(L, -2, "profile_start");
+	lua_pushcfunction(L, ProfileStop);
+	lua_setfield(L, -2, "profile_stop");
+	lua_pushcfunction(L, ProfileClear);
+	lua_setfield(L, -2, "profile_clear");
+	lua_pushcfunction(L, ProfileReport);
+	lua_setfield(L, -2, "profile_report");
+	lua_pushcfunction(L, GetStats);
+	lua_setfield(L, -2, "get_stats");
+	lua_pushcfunction(L, SetHook);
+	lua_setfield(L, -2, "set_hook");
+	lua_pushcfunction(L, WatchWrites);
+	lua_setfield(L, -2, "watch_writes");
+	lua_pushcfunction(L, ClearWriteWatches);
+	lua_setfield(L, -2, "clear_write_watches");
+	lua_pushcfunction(L, ResetStats);
+	lua_setfield(L, -2, "reset_stats");
 
 	lua_setfield(L, -2, "__index");
 	lua_pushboolean(L, 1);
@@ -45,47 +82,55 @@ void LuaCpu::Push(lua_State *L)
 	lua_setmetatable(L, -2);
 }
 
-void LuaCpu::SetBreakpointImpl(ptrdiff_t addr, std::function<void(EmulatedCpu*)> fn)
+void LuaCpu::SetBreakpointImpl(ptrdiff_t addr, Breakpoint bp)
 {
-	debug->SetBreakpoint((cpuaddr_t)addr, std::move(fn));
+	debug->SetBreakpoint((cpuaddr_t)addr, std::move(bp));
 }
 void LuaCpu::ClearBreakpointImpl(ptrdiff_t addr)
 {
 	debug->ClearBreakpoint((cpuaddr_t)addr);
 }
 
-bool LuaCpu::PeekImpl(ptrdiff_t addr, uint32_t nbytes, bool access_io, uint8_t& v)
+uint32_t LuaCpu::PeekImpl(ptrdiff_t addr, uint32_t nbytes, bool access_io, uint8_t *data)
 {
-	bool ok = false;
-	PauseImpl();
-	if(access_io || !debug->GetBus()->QueryIo((cpuaddr_t)addr)) {
-		debug->GetBus()->ReadByte((cpuaddr_t)addr, &v);
-		ok = true;
-	}
-	ResumeImpl();
-	return ok;
+	uint32_t n = 0;
+	WaitForEmulation([&]() {
+		debug->RunAtSafePoint([&]() {
+			n = debug->GetBus()->PeekRange((cpuaddr_t)addr, data, nbytes, access_io);
+		});
+	});
+	return n;
 }
 
-bool LuaCpu::PokeImpl(ptrdiff_t addr, uint32_t nbytes, bool access_io, uint8_t value)
+uint32_t LuaCpu::PokeImpl(ptrdiff_t addr, uint32_t nbytes, bool access_io, const uint8_t *data)
 {
-	bool ok = false;
-	PauseImpl();
-	if(access_io || !debug->GetBus()->QueryIo((cpuaddr_t)addr)) {
-		debug->GetBus()->WriteByte((cpuaddr_t)addr, value);
-		ok = true;
-	}
-	ResumeImpl();
-	return ok;
+	uint32_t n = 0;
+	WaitForEmulation([&]() {
+		debug->RunAtSafePoint([&]() {
+			n = debug->GetBus()->PokeRange((cpuaddr_t)addr, data, nbytes, access_io);
+		});
+	});
+	return n;
 }
 
 void LuaCpu::PauseImpl(bool schedule_event)
 {
-	debug->Pause(schedule_event);
+	WaitForEmulation([&]() { debug->Pause(schedule_event); });
 }
 
 void LuaCpu::ResumeImpl()
 {
-	debug->Resume();
+	WaitForEmulation([&]() { debug->Resume(); });
+}
+
+// Hooks run on the emulation thread and need the Lua state, so it is let go
+// of while waiting for that thread
+void LuaCpu::WaitForEmulation(const std::function<void()>& fn)
+{
+	if(LuaState::current())
+		LuaState::current()->ReleaseWhile(fn);
+	else
+		fn();
 }
 
 void LuaCpu::OnBreakpoint(LuaState *L, int refid)
@@ -139,6 +184,63 @@ int LuaCpu::ClearBreakpoint(lua_State *L)
 	self->ClearBreakpointImpl(addr);
 	return 0;
 }
+namespace {
+// Reads one entry of the conditions list at the top of the stack
+bool ParseCondition(lua_State *L, EmulatedCpu *cpu, BreakpointCondition *c)
+{
+	static const struct { const char *name; BreakpointCondition::Compare compare; } kCompares[] = {
+		{"==", BreakpointCondition::kEqual},
+		{"~=", BreakpointCondition::kNotEqual},
+		{"!=", BreakpointCondition::kNotEqual},
+		{"<", BreakpointCondition::kLess},
+		{"<=", BreakpointCondition::kLessEqual},
+		{">", BreakpointCondition::kGreater},
+		{">=", BreakpointCondition::kGreaterEqual},
+	};
+	if(!lua_istable(L, -1))
+		return false;
+	lua_getfield(L, -1, "reg");
+	lua_getfield(L, -2, "mem");
+	if(lua_isstring(L, -2)) {
+		c->source = BreakpointCondition::kRegister;
+		if(!cpu->GetRegisterId(lua_tostring(L, -2), &c->operand)) {
+			lua_pop(L, 2);
+			return false;
+		}
+	} else if(lua_isnumber(L, -1)) {
+		c->operand = (uint32_t)lua_tointeger(L, -1);
+		lua_getfield(L, -3, "size");
+		c->source = lua_tointeger(L, -1) == 2 ? BreakpointCondition::kMemory16 : BreakpointCondition::kMemory8;
+		lua_pop(L, 1);
+	} else {
+		lua_pop(L, 2);
+		return false;
+	}
+	lua_pop(L, 2);
+
+	lua_getfield(L, -1, "op");
+	const char *op = lua_isstring(L, -1) ? lua_tostring(L, -1) : "==";
+	bool found = false;
+	for(auto& e : kCompares) {
+		if(!strcmp(op, e.name)) {
+			c->compare = e.compare;
+			found = true;
+		}
+	}
+	lua_pop(L, 1);
+	lua_getfield(L, -1, "value");
+	c->value = (uint64_t)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	lua_getfield(L, -1, "mask");
+	if(lua_isnumber(L, -1))
+		c->mask = (uint64_t)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return found;
+}
+}
+
+// set_breakpoint(addr, [fn], [{ignore = n, conditions = {{reg = "a", op = "==", value = 1},
+// {mem = addr, size = 2, op = ">=", value = 0x100, mask = 0xFF00}}}])
 int LuaCpu::SetBreakpoint(lua_State *L)
 {
 	if(!lua_isuserdata(L, 1))
@@ -146,15 +248,37 @@ int LuaCpu::SetBreakpoint(lua_State *L)
 	auto self = *(LuaCpu**)lua_touserdata(L, 1);
 	luaL_checkint(L, 2);
 	auto addr = lua_tointeger(L, 2);
+	Breakpoint bp;
+	if(lua_istable(L, 4)) {
+		lua_getfield(L, 4, "ignore");
+		bp.ignore_count = (uint64_t)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "conditions");
+		if(lua_istable(L, -1)) {
+			for(int i = 1; ; i++) {
+				lua_rawgeti(L, -1, i);
+				if(lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					break;
+				}
+				BreakpointCondition c;
+				if(!ParseCondition(L, self->debug->GetCpu(), &c))
+					return luaL_error(L, "SetBreakpoint bad condition %d", i);
+				bp.conditions.push_back(c);
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
 	if(lua_isfunction(L, 3)) {
-		int ref = luaL_ref(L, 3);
-		self->SetBreakpointImpl(addr, std::bind(&LuaCpu::OnBreakpoint, self, LuaState::current(), ref));
-		return 0;
+		lua_pushvalue(L, 3);
+		int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		bp.fn = std::bind(&LuaCpu::OnBreakpoint, self, LuaState::current(), ref);
 	} else {
-		self->SetBreakpointImpl(addr, std::bind(&LuaCpu::OnBreakpoint, self, nullptr, 0));
-		return 0;
+		bp.fn = std::bind(&LuaCpu::OnBreakpoint, self, nullptr, 0);
 	}
-	return luaL_error(L, "SetBreakpoint bad args");
+	self->SetBreakpointImpl(addr, std::move(bp));
+	return 0;
 }
 
 int LuaCpu::Peek(lua_State *L)
@@ -165,7 +289,7 @@ int LuaCpu::Peek(lua_State *L)
 	auto addr = lua_tointeger(L, 2);
 	bool access_io = lua_toboolean(L, 3);
 	uint8_t result;
-	if(!self->PeekImpl(addr, 1, access_io, result)) {
+	if(!self->PeekImpl(addr, 1, access_io, &result)) {
 		lua_pushnil(L);
 		lua_pushliteral(L, "LuaCpu: Would access I/O");
 		return 2;
@@ -174,34 +298,91 @@ int LuaCpu::Peek(lua_State *L)
 	return 1;
 }
 
-int LuaCpu::Poke(lua_State *L)
+// peek_range(addr, len, [access_io], [as_table]) returns a string, or a table
+// of bytes. Stops before I/O, returning what was read and an error.
+int LuaCpu::PeekRange(lua_State *L)
 {
 	if(!lua_isuserdata(L, 1))
 		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
 	auto self = *(LuaCpu**)lua_touserdata(L, 1);
 	auto addr = lua_tointeger(L, 2);
-	const uint8_t *data;
-	size_t n;
-	uint8_t v;
-	if(lua_isnumber(L, 3)) {
-		v = (uint8_t)lua_tonumber(L, 3);
-		n = 1;
-		data = &v;
-	} else if(lua_isstring(L, 3)) {
-		data = (const uint8_t*)lua_tolstring(L, 3, &n);
-	}
+	auto len = luaL_checkinteger(L, 3);
 	bool access_io = lua_toboolean(L, 4);
-	for(size_t i = 0; i < n; i++) {
-		if(!self->PokeImpl(addr + i, 1, access_io, data[i])) {
-			lua_pushnil(L);
-			lua_pushliteral(L, "LuaCpu: Would access I/O");
-			return 2;
+	bool as_table = lua_toboolean(L, 5);
+	if(len < 0 || len > (1 << 24))
+		return luaL_error(L, "peek_range bad length");
+	std::vector<uint8_t> data(len);
+	uint32_t n = self->PeekImpl(addr, (uint32_t)len, access_io, data.data());
+	if(as_table) {
+		lua_createtable(L, n, 0);
+		for(uint32_t i = 0; i < n; i++) {
+			lua_pushinteger(L, data[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+	} else {
+		lua_pushlstring(L, (const char*)data.data(), n);
+	}
+	if(n < len) {
+		lua_pushliteral(L, "LuaCpu: Would access I/O");
+		return 2;
+	}
+	return 1;
+}
+
+namespace {
+// Reads the data argument of poke and poke_range: a byte, a string or a table of bytes
+void GetPokeData(lua_State *L, int index, std::vector<uint8_t> *data)
+{
+	if(lua_isnumber(L, index)) {
+		data->push_back((uint8_t)lua_tointeger(L, index));
+	} else if(lua_isstring(L, index)) {
+		size_t n;
+		const char *s = lua_tolstring(L, index, &n);
+		data->assign(s, s + n);
+	} else if(lua_istable(L, index)) {
+		size_t n = lua_objlen(L, index);
+		data->resize(n);
+		for(size_t i = 0; i < n; i++) {
+			lua_rawgeti(L, index, (int)i + 1);
+			(*data)[i] = (uint8_t)lua_tointeger(L, -1);
+			lua_pop(L, 1);
 		}
 	}
+}
+}
+
+int LuaCpu::Poke(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	auto addr = lua_tointeger(L, 2);
+	std::vector<uint8_t> data;
+	GetPokeData(L, 3, &data);
+	bool access_io = lua_toboolean(L, 4);
+	if(self->PokeImpl(addr, (uint32_t)data.size(), access_io, data.data()) < data.size()) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "LuaCpu: Would access I/O");
+		return 2;
+	}
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
+// poke_range(addr, data, [access_io]) returns the number of bytes written
+int LuaCpu::PokeRange(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	auto addr = lua_tointeger(L, 2);
+	std::vector<uint8_t> data;
+	GetPokeData(L, 3, &data);
+	bool access_io = lua_toboolean(L, 4);
+	lua_pushinteger(L, self->PokeImpl(addr, (uint32_t)data.size(), access_io, data.data()));
+	return 1;
+}
+
 int LuaCpu::Pause(lua_State *L)
 {
 	if(!lua_isuserdata(L, 1))
@@ -240,7 +421,7 @@ int LuaCpu::SingleStep(lua_State *L)
 		return luaL_error(L, "LuaCpu: cannot singlestep unless paused");
 	if(self->debug->recursively_paused())
 		return luaL_error(L, "LuaCpu: recursively paused");
-	self->debug->SingleStep();
+	self->WaitForEmulation([self]() { self->debug->SingleStep(); });
 	self->PushState(L);
 	return 1;
 }
@@ -318,3 +499,252 @@ int LuaCpu::SetRegister(lua_State *L)
 
 	return 1;
 }
+
+int LuaCpu::ProfileStart(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	uint32_t interval = lua_isnumber(L, 2) ? (uint32_t)lua_tointeger(L, 2) : 1000;
+	self->PauseImpl();
+	if(!self->profiler)
+		self->profiler.reset(new GuestProfiler(self->debug->GetCpu(), self->debug->GetEventQueue()));
+	bool ok = self->profiler->Start(interval);
+	self->ResumeImpl();
+	lua_pushboolean(L, ok);
+	return 1;
+}
+
+int LuaCpu::ProfileStop(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	if(self->profiler) {
+		self->PauseImpl();
+		self->profiler->Stop();
+		self->ResumeImpl();
+	}
+	return 0;
+}
+
+int LuaCpu::ProfileClear(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	if(self->profiler) {
+		self->PauseImpl();
+		self->profiler->Clear();
+		self->ResumeImpl();
+	}
+	return 0;
+}
+
+// profile_report("flat" [, max_entries]) or profile_report("tree" [, min_percent])
+int LuaCpu::ProfileReport(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	if(!self->profiler)
+		return luaL_error(L, "LuaCpu: profiler was never started");
+	const char *kind = lua_isstring(L, 2) ? lua_tostring(L, 2) : "flat";
+	std::string report;
+	self->PauseImpl();
+	if(!strcmp(kind, "tree"))
+		report = self->profiler->CallTree(lua_isnumber(L, 3) ? lua_tonumber(L, 3) : 0.5);
+	else
+		report = self->profiler->FlatProfile(lua_isnumber(L, 3) ? (size_t)lua_tointeger(L, 3) : 32);
+	self->ResumeImpl();
+	lua_pushlstring(L, report.c_str(), report.size());
+	return 1;
+}
+
+// Returns a table of counter name to value. The hot path counters stay at zero
+// unless built with RETRO_CPU_STATS=1.
+int LuaCpu::GetStats(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	StatsList stats;
+	self->PauseImpl();
+	self->debug->GetStats(&stats);
+	self->ResumeImpl();
+	lua_newtable(L);
+	for(auto& s : stats) {
+		lua_pushinteger(L, (lua_Integer)s.second);
+		lua_setfield(L, -2, s.first.c_str());
+	}
+	return 1;
+}
+
+int LuaCpu::ResetStats(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	self->PauseImpl();
+	self->debug->ResetStats();
+	self->ResumeImpl();
+	return 0;
+}
+
+namespace {
+const char *kHookNames[HookBus::kNumTypes] = {"frame_end", "scanline", "interrupt", "memory_write"};
+// Payload columns per hook type, besides "cycle". The first one is Event::a.
+const char *kHookColumns[HookBus::kNumTypes][2] = {
+	{"frame", nullptr},
+	{"line", nullptr},
+	{"source", nullptr},
+	{"addr", "value"},
+};
+}
+
+// Runs on the emulation thread from HookBus::Dispatch(). The payload tables
+// are created once per hook and refilled, so dispatching allocates nothing
+// once they have grown to the batch size. Entries past the new count are
+// cleared so a smaller batch leaves nothing behind from an earlier one.
+void LuaCpu::DispatchHooks(const HookBus::Event *events, size_t count, const uint64_t *dropped)
+{
+	hook_state->Execute([&](lua_State *L) {
+		for(uint32_t type = 0; type < HookBus::kNumTypes; type++) {
+			if(!hook_refs[type])
+				continue;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, payload_refs[type]);
+			int payload = lua_gettop(L);
+			lua_getfield(L, payload, "cycle");
+			lua_getfield(L, payload, kHookColumns[type][0]);
+			if(kHookColumns[type][1])
+				lua_getfield(L, payload, kHookColumns[type][1]);
+			else
+				lua_pushnil(L);
+			int n = 0;
+			for(size_t i = 0; i < count; i++) {
+				if(events[i].type != type)
+					continue;
+				n++;
+				lua_pushnumber(L, (lua_Number)events[i].cycle);
+				lua_rawseti(L, payload + 1, n);
+				lua_pushinteger(L, events[i].a);
+				lua_rawseti(L, payload + 2, n);
+				if(kHookColumns[type][1]) {
+					lua_pushinteger(L, events[i].b);
+					lua_rawseti(L, payload + 3, n);
+				}
+			}
+			int columns = kHookColumns[type][1] ? 3 : 2;
+			for(int i = n + 1; i <= payload_counts[type]; i++) {
+				for(int column = 1; column <= columns; column++) {
+					lua_pushnil(L);
+					lua_rawseti(L, payload + column, i);
+				}
+			}
+			payload_counts[type] = n;
+			lua_settop(L, payload);
+			if(!n && !dropped[type]) {
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_pushinteger(L, n);
+			lua_setfield(L, payload, "count");
+			lua_pushnumber(L, (lua_Number)dropped[type]);
+			lua_setfield(L, payload, "dropped");
+			lua_rawgeti(L, LUA_REGISTRYINDEX, hook_refs[type]);
+			lua_insert(L, payload);
+			if(lua_pcall(L, 1, 0, 0)) {
+				fprintf(stderr, "%s hook: %s\n", kHookNames[type], lua_tostring(L, -1));
+				lua_pop(L, 1);
+			}
+		}
+	});
+}
+
+// set_hook(name, fn) calls fn(payload) once per dispatch, usually every frame,
+// with the events of that type since the last one. payload.count is the number
+// of events, payload.dropped the number of them lost to a full queue, and
+// payload.cycle[i] plus the per type columns describe event i. Names and
+// columns: frame_end (frame), scanline (line), interrupt (source),
+// memory_write (addr, value).
+// Passing nil for fn removes the hook.
+int LuaCpu::SetHook(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	HookBus *hooks = self->debug->GetHookBus();
+	if(!hooks)
+		return luaL_error(L, "set_hook: the system has no hooks");
+	uint32_t type = 0;
+	while(type < HookBus::kNumTypes && strcmp(name, kHookNames[type]))
+		type++;
+	if(type == HookBus::kNumTypes)
+		return luaL_error(L, "set_hook: unknown hook %s", name);
+
+	// Dispatching holds the Lua state, so the refs can be changed here
+	if(self->hook_refs[type])
+		luaL_unref(L, LUA_REGISTRYINDEX, self->hook_refs[type]);
+	self->hook_refs[type] = 0;
+	bool enable = lua_isfunction(L, 3);
+	if(enable) {
+		if(!self->payload_refs[type]) {
+			lua_newtable(L);
+			lua_newtable(L);
+			lua_setfield(L, -2, "cycle");
+			for(const char *column : kHookColumns[type]) {
+				if(column) {
+					lua_newtable(L);
+					lua_setfield(L, -2, column);
+				}
+			}
+			self->payload_refs[type] = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+		lua_pushvalue(L, 3);
+		self->hook_refs[type] = luaL_ref(L, LUA_REGISTRYINDEX);
+		self->hook_state = LuaState::current();
+	}
+	if(!self->hook_owner)
+		self->hook_owner = std::make_shared<LuaCpu*>(self);
+	// Does not wait, the emulation thread may be waiting for the Lua state
+	std::weak_ptr<LuaCpu*> owner = self->hook_owner;
+	self->debug->RunAtSafePoint([owner, hooks, type, enable]() {
+		auto self = owner.lock();
+		if(!self)
+			return;
+		hooks->SetSink(std::bind(&LuaCpu::DispatchHooks, *self,
+			std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+		hooks->Enable((HookBus::Type)type, enable);
+	}, false);
+	return 0;
+}
+
+// watch_writes(addr, len) reports writes to the range to the memory_write hook
+int LuaCpu::WatchWrites(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	auto addr = (cpuaddr_t)luaL_checkinteger(L, 2);
+	auto len = (uint32_t)luaL_checkinteger(L, 3);
+	HookBus *hooks = self->debug->GetHookBus();
+	if(!hooks)
+		return luaL_error(L, "watch_writes: the system has no hooks");
+	SystemBus *bus = self->debug->GetBus();
+	self->debug->RunAtSafePoint([hooks, bus, addr, len]() { hooks->WatchWrites(bus, addr, len); }, false);
+	return 0;
+}
+
+int LuaCpu::ClearWriteWatches(lua_State *L)
+{
+	if(!lua_isuserdata(L, 1))
+		return luaL_error(L, "LuaCpu: must pass userdata pointer as arg #1");
+	auto self = *(LuaCpu**)lua_touserdata(L, 1);
+	HookBus *hooks = self->debug->GetHookBus();
+	if(!hooks)
+		return 0;
+	SystemBus *bus = self->debug->GetBus();
+	self->debug->RunAtSafePoint([hooks, bus]() { hooks->ClearWriteWatches(bus); }, false);
+	return 0;
+}
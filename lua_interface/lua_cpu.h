@@ -3,7 +3,10 @@
 #include "cpu.h"
 #include "lua_state.h"
 #include "debug_interface.h"
+#include "hook_bus.h"
+#include "profiler.h"
 
+#include <memory>
 #include <mutex>
 
 class LuaCpu
@@ -16,30 +19,54 @@ public:
 
 
 private:
-	void SetBreakpointImpl(ptrdiff_t addr, std::function<void(EmulatedCpu*)> fn);
+	void SetBreakpointImpl(ptrdiff_t addr, Breakpoint bp);
 	void ClearBreakpointImpl(ptrdiff_t addr);
-	bool PeekImpl(ptrdiff_t addr, uint32_t nbytes, bool access_io, uint8_t& v);
-	bool PokeImpl(ptrdiff_t addr, uint32_t nbytes, bool access_io, uint8_t value);
+	// Return the number of bytes copied
+	uint32_t PeekImpl(ptrdiff_t addr, uint32_t nbytes, bool access_io, uint8_t *data);
+	uint32_t PokeImpl(ptrdiff_t addr, uint32_t nbytes, bool access_io, const uint8_t *data);
 
 	void PauseImpl(bool schedule_event = true);
 	void ResumeImpl();
+	void WaitForEmulation(const std::function<void()>& fn);
 
 	void PushState(lua_State *L);
 
 	void OnBreakpoint(LuaState *L, int refid);
+	void DispatchHooks(const HookBus::Event *events, size_t count, const uint64_t *dropped);
 
 	static int GetState(lua_State *L);
 	static int SetBreakpoint(lua_State *L);
 	static int ClearBreakpoint(lua_State *L);
 	static int Peek(lua_State *L);
 	static int Poke(lua_State *L);
+	static int PeekRange(lua_State *L);
+	static int PokeRange(lua_State *L);
 	static int Pause(lua_State *L);
 	static int Resume(lua_State *L);
 	static int SingleStep(lua_State *L);
 	static int Disassemble(lua_State *L);
 	static int Assemble(lua_State *L);
 	static int SetRegister(lua_State *L);
+	static int ProfileStart(lua_State *L);
+	static int ProfileStop(lua_State *L);
+	static int ProfileClear(lua_State *L);
+	static int ProfileReport(lua_State *L);
+	static int GetStats(lua_State *L);
+	static int ResetStats(lua_State *L);
+	static int SetHook(lua_State *L);
+	static int WatchWrites(lua_State *L);
+	static int ClearWriteWatches(lua_State *L);
 
 	DebugInterface *debug;
+	std::unique_ptr<GuestProfiler> profiler;
+
+	// Registry refs of the hook functions and their payload tables, 0 if unset
+	LuaState *hook_state = nullptr;
+	int hook_refs[HookBus::kNumTypes] = {};
+	int payload_refs[HookBus::kNumTypes] = {};
+	// Entries filled in each payload table by the last dispatch
+	int payload_counts[HookBus::kNumTypes] = {};
+	// Guards hook changes that are queued for the emulation thread
+	std::shared_ptr<LuaCpu*> hook_owner;
 
 };
@@ -242,6 +242,27 @@ void LuaState::CallRefFunction(int ref)
 		ReleaseOwnership();
 }
 
+void LuaState::Execute(const std::function<void(lua_State *L)>& fn)
+{
+	bool was_owner = GainOwnership();
+	fn(L);
+	if(!was_owner)
+		ReleaseOwnership();
+}
+
+void LuaState::ReleaseWhile(const std::function<void()>& fn)
+{
+	if(owning_thread != std::this_thread::get_id()) {
+		fn();
+		return;
+	}
+	ReleaseOwnership();
+	fn();
+	exec_lock.lock();
+	owning_thread = std::this_thread::get_id();
+	current_state = this;
+}
+
 bool LuaState::GainOwnership()
 {
 	auto this_thread = std::this_thread::get_id();
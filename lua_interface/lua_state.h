@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <string>
@@ -17,6 +18,11 @@ public:
 
 	void ExecFile(const std::string& path);
 	void CallRefFunction(int ref);
+	// Runs |fn| with the state owned by the calling thread
+	void Execute(const std::function<void(lua_State *L)>& fn);
+	// Lets other threads use the state while |fn| waits on them, for example
+	// for the emulation thread to reach a safe point
+	void ReleaseWhile(const std::function<void()>& fn);
 
 	void DoInteractiveConsole();
 
@@ -0,0 +1,19 @@
+#ifndef PIXEL_FORMAT_H_
+#define PIXEL_FORMAT_H_
+
+#include <stdint.h>
+
+// Packs an XRGB8888 color into 16 bits, dropping the low bits of each channel
+inline uint16_t PackRgb565(uint32_t xrgb)
+{
+	uint32_t r = (xrgb >> 16) & 0xFF, g = (xrgb >> 8) & 0xFF, b = xrgb & 0xFF;
+	return (uint16_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+inline uint16_t PackXrgb1555(uint32_t xrgb)
+{
+	uint32_t r = (xrgb >> 16) & 0xFF, g = (xrgb >> 8) & 0xFF, b = xrgb & 0xFF;
+	return (uint16_t)(((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3));
+}
+
+#endif
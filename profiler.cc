@@ -0,0 +1,226 @@
+#include "profiler.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+GuestProfiler::GuestProfiler(EmulatedCpu *cpu, EventQueue *events)
+	: cpu(cpu), events(events)
+{
+	Clear();
+}
+
+GuestProfiler::~GuestProfiler()
+{
+	Stop();
+}
+
+bool GuestProfiler::Start(uint32_t interval_cycles)
+{
+	if(!interval_cycles)
+		return false;
+	Stop();
+	// Without call reporting everything ends up in the root node
+	cpu->SetCallObserver(this);
+	interval = interval_cycles;
+	session = std::make_shared<uint32_t>(0);
+	ScheduleSample(cpu->GetCpuState()->cycle + interval);
+	return true;
+}
+
+void GuestProfiler::Stop()
+{
+	if(!session)
+		return;
+	cpu->SetCallObserver(nullptr);
+	session.reset();
+	frames.clear();
+}
+
+void GuestProfiler::Clear()
+{
+	total_samples = 0;
+	pc_hist.clear();
+	routines.clear();
+	node_index.clear();
+	nodes.clear();
+	nodes.emplace_back(Node{kRoot, 0, 0, {}});
+	frames.clear();
+}
+
+void GuestProfiler::ScheduleSample(uint64_t t)
+{
+	std::weak_ptr<uint32_t> s = session;
+	events->ScheduleNoLock(t, [this, s, t]() {
+		if(!s.expired())
+			Sample(t);
+	});
+}
+
+void GuestProfiler::Sample(uint64_t t)
+{
+	total_samples++;
+	pc_hist[cpu->GetCpuState()->GetCanonicalAddress()]++;
+
+	uint32_t node = frames.empty() ? 0 : frames.back().node;
+	nodes[node].self++;
+	routines[nodes[node].routine].self++;
+	// Recursive routines count once per sample
+	for(uint32_t n = node;; n = nodes[n].parent) {
+		cpuaddr_t routine = nodes[n].routine;
+		bool seen = false;
+		for(uint32_t m = node; m != n; m = nodes[m].parent) {
+			if(nodes[m].routine == routine) {
+				seen = true;
+				break;
+			}
+		}
+		if(!seen)
+			routines[routine].total++;
+		if(!n)
+			break;
+	}
+
+	// Events can expire late, do not sample the same spot twice
+	uint64_t next = t + interval;
+	uint64_t now = cpu->GetCpuState()->cycle;
+	if(next <= now)
+		next = now + interval;
+	ScheduleSample(next);
+}
+
+uint32_t GuestProfiler::GetChild(uint32_t parent, cpuaddr_t routine)
+{
+	uint64_t key = ((uint64_t)parent << 32) | routine;
+	auto it = node_index.find(key);
+	if(it != node_index.end())
+		return it->second;
+	uint32_t n = (uint32_t)nodes.size();
+	nodes.emplace_back(Node{routine, parent, 0, {}});
+	nodes[parent].children.push_back(n);
+	node_index.emplace(key, n);
+	return n;
+}
+
+void GuestProfiler::OnCall(cpuaddr_t target, uint32_t sp)
+{
+	// Runaway stacks keep attributing to the deepest tracked frame
+	if(frames.size() >= kMaxDepth)
+		return;
+	uint32_t parent = frames.empty() ? 0 : frames.back().node;
+	frames.emplace_back(Frame{sp, GetChild(parent, target)});
+}
+
+void GuestProfiler::OnReturn(uint32_t sp)
+{
+	// Also unwinds frames that were abandoned by resetting the stack pointer
+	while(!frames.empty() && frames.back().sp <= sp)
+		frames.pop_back();
+}
+
+std::string GuestProfiler::Describe(cpuaddr_t addr)
+{
+	char buf[32];
+	if(addr == kRoot)
+		return "(root)";
+	auto disas = cpu->GetDisassembler();
+	if(disas) {
+		Disassembler::Config config;
+		config.max_instruction_count = 1;
+		config.include_bytes = false;
+		uint32_t a = addr;
+		auto insn = disas->Disassemble(config, a);
+		if(!insn.empty())
+			return insn[0].asm_string.c_str();
+	}
+	snprintf(buf, sizeof(buf), "%06X", addr);
+	return buf;
+}
+
+std::string GuestProfiler::FlatProfile(size_t max_entries)
+{
+	std::string out;
+	char buf[96];
+	snprintf(buf, sizeof(buf), "%llu samples, one every %u cycles\n",
+		(unsigned long long)total_samples, interval);
+	out += buf;
+	if(!total_samples)
+		return out;
+	double scale = 100.0 / total_samples;
+
+	std::vector<std::pair<cpuaddr_t, RoutineStats>> by_routine(routines.begin(), routines.end());
+	std::sort(by_routine.begin(), by_routine.end(), [](const auto& a, const auto& b) {
+		return a.second.self > b.second.self;
+	});
+	out += "  self%  total%        cycles  routine\n";
+	for(size_t i = 0; i < by_routine.size() && i < max_entries; i++) {
+		auto& r = by_routine[i];
+		snprintf(buf, sizeof(buf), "%7.2f %7.2f %13llu  ", r.second.self * scale, r.second.total * scale,
+			(unsigned long long)(r.second.self * interval));
+		out += buf;
+		out += Describe(r.first);
+		out += '\n';
+	}
+
+	std::vector<std::pair<cpuaddr_t, uint64_t>> by_pc(pc_hist.begin(), pc_hist.end());
+	std::sort(by_pc.begin(), by_pc.end(), [](const auto& a, const auto& b) {
+		return a.second > b.second;
+	});
+	out += "\n      %       samples  instruction\n";
+	for(size_t i = 0; i < by_pc.size() && i < max_entries; i++) {
+		snprintf(buf, sizeof(buf), "%7.2f %13llu  ", by_pc[i].second * scale,
+			(unsigned long long)by_pc[i].second);
+		out += buf;
+		out += Describe(by_pc[i].first);
+		out += '\n';
+	}
+	return out;
+}
+
+uint64_t GuestProfiler::Inclusive(uint32_t node, std::vector<uint64_t>& inclusive)
+{
+	uint64_t v = nodes[node].self;
+	for(uint32_t c : nodes[node].children)
+		v += Inclusive(c, inclusive);
+	inclusive[node] = v;
+	return v;
+}
+
+void GuestProfiler::PrintNode(std::string& out, uint32_t node, uint32_t depth, uint64_t threshold,
+	const std::vector<uint64_t>& inclusive)
+{
+	char buf[64];
+	double scale = 100.0 / total_samples;
+	snprintf(buf, sizeof(buf), "%7.2f %7.2f  ", inclusive[node] * scale, nodes[node].self * scale);
+	out += buf;
+	out.append(depth * 2, ' ');
+	out += Describe(nodes[node].routine);
+	out += '\n';
+
+	std::vector<uint32_t> children = nodes[node].children;
+	std::sort(children.begin(), children.end(), [&inclusive](uint32_t a, uint32_t b) {
+		return inclusive[a] > inclusive[b];
+	});
+	for(uint32_t c : children) {
+		if(inclusive[c] >= threshold)
+			PrintNode(out, c, depth + 1, threshold, inclusive);
+	}
+}
+
+std::string GuestProfiler::CallTree(double min_percent)
+{
+	std::string out;
+	char buf[96];
+	snprintf(buf, sizeof(buf), "%llu samples, one every %u cycles\n",
+		(unsigned long long)total_samples, interval);
+	out += buf;
+	if(!total_samples)
+		return out;
+
+	std::vector<uint64_t> inclusive(nodes.size());
+	Inclusive(0, inclusive);
+	uint64_t threshold = std::max<uint64_t>(1, (uint64_t)(total_samples * min_percent / 100.0));
+	out += " total%   self%  routine\n";
+	PrintNode(out, 0, 0, threshold, inclusive);
+	return out;
+}
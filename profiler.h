@@ -0,0 +1,89 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cpu.h"
+
+// Statistical profiler for guest code. The program counter is sampled from an
+// EventQueue entry every |interval| cycles, so nothing is added to the
+// instruction loop. Calls and returns reported by the CPU maintain a guest call
+// stack that samples are attributed to.
+//
+// Start(), Stop() and Clear() schedule events without taking the queue lock,
+// so they must be called from the emulation thread or while it is paused. The
+// same goes for reading the results.
+class GuestProfiler : public CallObserver
+{
+public:
+	GuestProfiler(EmulatedCpu *cpu, EventQueue *events);
+	~GuestProfiler();
+
+	bool Start(uint32_t interval_cycles);
+	void Stop();
+	void Clear();
+
+	bool running() const { return session != nullptr; }
+	uint64_t num_samples() const { return total_samples; }
+	const std::unordered_map<cpuaddr_t, uint64_t>& pc_samples() const { return pc_hist; }
+
+	// Routines sorted by self time, then the hottest instructions
+	std::string FlatProfile(size_t max_entries = 32);
+	// Call tree with inclusive and self time, omitting nodes below |min_percent|
+	std::string CallTree(double min_percent = 0.5);
+
+	void OnCall(cpuaddr_t target, uint32_t sp) override;
+	void OnReturn(uint32_t sp) override;
+
+	// Samples taken outside of any known call
+	static constexpr cpuaddr_t kRoot = ~0U;
+
+private:
+	static constexpr size_t kMaxDepth = 256;
+
+	struct Node
+	{
+		cpuaddr_t routine;
+		uint32_t parent;
+		uint64_t self;
+		std::vector<uint32_t> children;
+	};
+	struct Frame
+	{
+		uint32_t sp;
+		uint32_t node;
+	};
+	struct RoutineStats
+	{
+		uint64_t self = 0;
+		uint64_t total = 0;
+	};
+
+	void ScheduleSample(uint64_t t);
+	void Sample(uint64_t t);
+	uint32_t GetChild(uint32_t parent, cpuaddr_t routine);
+	uint64_t Inclusive(uint32_t node, std::vector<uint64_t>& inclusive);
+	void PrintNode(std::string& out, uint32_t node, uint32_t depth, uint64_t threshold,
+		const std::vector<uint64_t>& inclusive);
+	std::string Describe(cpuaddr_t addr);
+
+	EmulatedCpu *cpu;
+	EventQueue *events;
+	uint32_t interval = 0;
+	// Pending samples of a stopped session find this expired and do nothing
+	std::shared_ptr<uint32_t> session;
+
+	uint64_t total_samples = 0;
+	std::unordered_map<cpuaddr_t, uint64_t> pc_hist;
+	std::unordered_map<cpuaddr_t, RoutineStats> routines;
+	std::vector<Node> nodes;
+	std::unordered_map<uint64_t, uint32_t> node_index;
+	std::vector<Frame> frames;
+};
+
+#endif
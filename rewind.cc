@@ -0,0 +1,221 @@
+#include "rewind.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+inline uint64_t Load64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+struct RunHeader
+{
+	// Bytes that did not change, followed by |literal| XORed bytes
+	uint32_t zero;
+	uint32_t literal;
+};
+}
+
+RewindBuffer::RewindBuffer(size_t budget_bytes, uint32_t keyframe_interval)
+	: budget(budget_bytes), keyframe_interval(keyframe_interval ? keyframe_interval : 1)
+{
+}
+
+void RewindBuffer::SetBudget(size_t budget_bytes)
+{
+	budget = budget_bytes;
+	Evict();
+}
+
+void RewindBuffer::Clear()
+{
+	while(!entries.empty()) {
+		Recycle(std::move(entries.back().data));
+		entries.pop_back();
+	}
+	current.clear();
+	since_keyframe = 0;
+	num_keyframes = 0;
+	used_bytes = 0;
+}
+
+std::vector<uint8_t> RewindBuffer::TakeSpare()
+{
+	if(spares.empty())
+		return std::vector<uint8_t>();
+	std::vector<uint8_t> v = std::move(spares.back());
+	spares.pop_back();
+	return v;
+}
+
+void RewindBuffer::Recycle(std::vector<uint8_t> data)
+{
+	// A few buffers are enough to cover the entries evicted per push
+	if(spares.size() < 8)
+		spares.emplace_back(std::move(data));
+}
+
+void RewindBuffer::Encode(const uint8_t *state)
+{
+	// Literals inside a range are separated by at least 8 unchanged bytes, so
+	// there is at most one header more than there are ranges per 8 bytes
+	size_t total = 0;
+	for(auto& r : ranges)
+		total += r.second;
+	scratch.resize(total * 2 + (ranges.size() + 1) * sizeof(RunHeader));
+	const uint8_t *prev = current.data();
+	uint8_t *out = scratch.data();
+	// End of the last literal
+	size_t pos = 0;
+	for(auto& r : ranges) {
+		size_t i = r.first;
+		size_t end = r.first + r.second;
+		while(i < end) {
+			while(i + 8 <= end && Load64(state + i) == Load64(prev + i))
+				i += 8;
+			while(i < end && state[i] == prev[i])
+				i++;
+			if(i == end)
+				break;
+			size_t start = i;
+			while(i < end && !(i + 8 <= end && Load64(state + i) == Load64(prev + i)))
+				i++;
+			RunHeader h;
+			h.zero = (uint32_t)(start - pos);
+			h.literal = (uint32_t)(i - start);
+			memcpy(out, &h, sizeof(h));
+			out += sizeof(h);
+			for(size_t j = start; j < i; j++)
+				*out++ = state[j] ^ prev[j];
+			pos = i;
+		}
+	}
+	scratch.resize(out - scratch.data());
+}
+
+void RewindBuffer::ApplyDelta(uint8_t *state, size_t size, const std::vector<uint8_t>& delta)
+{
+	const uint8_t *p = delta.data();
+	const uint8_t *end = p + delta.size();
+	size_t pos = 0;
+	while(p + sizeof(RunHeader) <= end) {
+		RunHeader h;
+		memcpy(&h, p, sizeof(h));
+		p += sizeof(h);
+		pos += h.zero;
+		if(pos + h.literal > size || h.literal > (size_t)(end - p))
+			return;
+		for(uint32_t j = 0; j < h.literal; j++)
+			state[pos + j] ^= p[j];
+		pos += h.literal;
+		p += h.literal;
+	}
+}
+
+void RewindBuffer::Push(const uint8_t *state, size_t size)
+{
+	ranges.assign(1, std::make_pair((size_t)0, size));
+	PushRanges(state, size);
+}
+
+void RewindBuffer::Push(const uint8_t *state, size_t size, const Ranges& changed)
+{
+	ranges.assign(changed.begin(), changed.end());
+	std::sort(ranges.begin(), ranges.end());
+	size_t n = 0;
+	for(auto& r : ranges) {
+		size_t begin = std::min(r.first, size);
+		size_t end = std::min(r.first + r.second, size);
+		if(n && begin <= ranges[n - 1].first + ranges[n - 1].second)
+			ranges[n - 1].second = std::max(end, ranges[n - 1].first + ranges[n - 1].second) - ranges[n - 1].first;
+		else if(begin < end)
+			ranges[n++] = std::make_pair(begin, end - begin);
+	}
+	ranges.resize(n);
+	PushRanges(state, size);
+}
+
+void RewindBuffer::PushRanges(const uint8_t *state, size_t size)
+{
+	Entry e;
+	e.data = TakeSpare();
+	e.keyframe = entries.empty() || size != current.size() || since_keyframe + 1 >= keyframe_interval;
+	if(!e.keyframe) {
+		Encode(state);
+		// Not worth it when almost everything changed
+		if(scratch.size() >= size)
+			e.keyframe = true;
+		else
+			e.data.assign(scratch.begin(), scratch.end());
+	}
+	if(e.keyframe) {
+		e.data.assign(state, state + size);
+		since_keyframe = 0;
+		num_keyframes++;
+	} else {
+		since_keyframe++;
+	}
+	used_bytes += e.data.size();
+	entries.emplace_back(std::move(e));
+	if(current.size() != size) {
+		current.assign(state, state + size);
+	} else {
+		for(auto& r : ranges)
+			memcpy(current.data() + r.first, state + r.first, r.second);
+	}
+	Evict();
+}
+
+void RewindBuffer::RebuildCurrent()
+{
+	if(entries.empty()) {
+		current.clear();
+		since_keyframe = 0;
+		return;
+	}
+	size_t k = entries.size() - 1;
+	while(!entries[k].keyframe)
+		k--;
+	current.assign(entries[k].data.begin(), entries[k].data.end());
+	for(size_t i = k + 1; i < entries.size(); i++)
+		ApplyDelta(current.data(), current.size(), entries[i].data);
+	since_keyframe = (uint32_t)(entries.size() - 1 - k);
+}
+
+bool RewindBuffer::Pop(std::vector<uint8_t> *out)
+{
+	if(entries.empty())
+		return false;
+	if(out)
+		out->assign(current.begin(), current.end());
+
+	Entry e = std::move(entries.back());
+	entries.pop_back();
+	used_bytes -= e.data.size();
+	if(e.keyframe) {
+		num_keyframes--;
+		RebuildCurrent();
+	} else {
+		ApplyDelta(current.data(), current.size(), e.data);
+		since_keyframe--;
+	}
+	Recycle(std::move(e.data));
+	return true;
+}
+
+void RewindBuffer::Evict()
+{
+	// Whole keyframe groups are dropped so the oldest entry is always a keyframe
+	while(memory_used() > budget && num_keyframes > 1) {
+		do {
+			used_bytes -= entries.front().data.size();
+			Recycle(std::move(entries.front().data));
+			entries.pop_front();
+		} while(!entries.front().keyframe);
+		num_keyframes--;
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef REWIND_H_
+#define REWIND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+// A bounded history of save states for rewinding. Every |keyframe_interval|
+// snapshots a full copy is kept, the ones in between are stored as the XOR
+// against the previous snapshot with runs of zeroes removed. Since XOR is
+// symmetric the newest state can be walked backwards one delta at a time.
+class RewindBuffer
+{
+public:
+	// (offset, size) byte ranges of a snapshot
+	typedef std::vector<std::pair<size_t, size_t>> Ranges;
+
+	RewindBuffer(size_t budget_bytes, uint32_t keyframe_interval);
+
+	void Push(const uint8_t *state, size_t size);
+	// Outside of |changed| |state| has to match the previous Push(), only the
+	// ranges are compared and copied. Ranges may overlap.
+	void Push(const uint8_t *state, size_t size, const Ranges& changed);
+	// Removes the newest snapshot and copies it to |out| unless it is null.
+	bool Pop(std::vector<uint8_t> *out);
+	void Clear();
+
+	void SetBudget(size_t budget_bytes);
+
+	size_t size() const { return entries.size(); }
+	bool empty() const { return entries.empty(); }
+	size_t memory_used() const { return used_bytes + current.size(); }
+
+private:
+	struct Entry
+	{
+		bool keyframe;
+		std::vector<uint8_t> data;
+	};
+
+	void PushRanges(const uint8_t *state, size_t size);
+	void Encode(const uint8_t *state);
+	static void ApplyDelta(uint8_t *state, size_t size, const std::vector<uint8_t>& delta);
+	void RebuildCurrent();
+	void Evict();
+	std::vector<uint8_t> TakeSpare();
+	void Recycle(std::vector<uint8_t> data);
+
+	size_t budget;
+	uint32_t keyframe_interval;
+	uint32_t since_keyframe = 0;
+	uint32_t num_keyframes = 0;
+	size_t used_bytes = 0;
+
+	std::deque<Entry> entries;
+	// The state of the newest entry
+	std::vector<uint8_t> current;
+	std::vector<uint8_t> scratch;
+	// Sorted and merged ranges of the snapshot being pushed
+	Ranges ranges;
+	// Storage of evicted entries, reused to avoid allocating every frame
+	std::vector<std::vector<uint8_t>> spares;
+};
+
+#endif
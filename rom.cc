@@ -1,27 +1,61 @@
 #include "rom.h"
 
+#include <mutex>
+#include <unordered_map>
+
+#include "rom_db.h"
 #include "rom_ines.h"
+#include "unpack.h"
 
-std::shared_ptr<Rom> Rom::ReadRom(std::shared_ptr<NativeFile> file)
-{
-	auto mmap = NativeMemory::Create(file.get(), 0, 0);
-	mmap->MakeReadonly();
-	return LoadRom(std::move(mmap));
-}
+namespace {
+const char *const kConfigNames[Rom::kNumConfigs] = {
+	"MAPPER", "DISPLAY", "VRAM CONFIG", "PRG RAM SIZE", "PRG NVRAM SIZE", "CHR RAM SIZE", "CHR NVRAM SIZE"
+};
 
-std::shared_ptr<Rom> Rom::LoadRom(const uint8_t *data, size_t size)
+// Loaded ROMs by HashRomData() of the whole image. Entries do not keep ROMs
+// alive.
+class RomCache
 {
-	auto mem = NativeMemory::Create(size);
-	memcpy(mem->Pointer(), data, size);
-	return LoadRom(std::move(mem));
-}
+public:
+	std::shared_ptr<Rom> Find(uint64_t hash, const uint8_t *data, size_t size)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = roms.find(hash);
+		if(it == roms.end())
+			return nullptr;
+		auto rom = it->second.lock();
+		if(!rom || rom->GetSize() != size || memcmp(rom->GetData(), data, size))
+			return nullptr;
+		return rom;
+	}
+	void Insert(uint64_t hash, const std::shared_ptr<Rom>& rom)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(roms.size() >= prune_size) {
+			for(auto it = roms.begin(); it != roms.end();) {
+				if(it->second.expired())
+					it = roms.erase(it);
+				else
+					++it;
+			}
+			prune_size = roms.size() * 2 + 64;
+		}
+		roms[hash] = rom;
+	}
 
-std::shared_ptr<Rom> Rom::LoadRom(std::unique_ptr<NativeMemory> memory)
+private:
+	std::mutex lock;
+	std::unordered_map<uint64_t, std::weak_ptr<Rom>> roms;
+	size_t prune_size = 64;
+};
+RomCache cache;
+
+std::shared_ptr<Rom> ParseImage(std::unique_ptr<NativeMemory> memory)
 {
 	uint8_t *data = memory->Pointer();
 	size_t size = memory->GetSize();
 
-	if(data[0] == 0x4E && data[1] == 0x45 && data[2] == 0x53 && data[3] == 0x1A) {
+	if(size >= 4 && data[0] == 0x4E && data[1] == 0x45 && data[2] == 0x53 && data[3] == 0x1A) {
 		auto ines = std::make_shared<RomInes>(std::move(memory));
 		if(!ines->Parse())
 			return nullptr;
@@ -29,3 +63,116 @@ std::shared_ptr<Rom> Rom::LoadRom(std::unique_ptr<NativeMemory> memory)
 	}
 	return nullptr;
 }
+
+// |hash| is HashRomData() of |memory|, which was not found in the cache
+std::shared_ptr<Rom> ParseAndCache(uint64_t hash, std::unique_ptr<NativeMemory> memory)
+{
+	auto rom = ParseImage(std::move(memory));
+	if(rom)
+		cache.Insert(hash, rom);
+	return rom;
+}
+
+std::shared_ptr<Rom> LoadImage(std::unique_ptr<NativeMemory> memory)
+{
+	uint64_t hash = HashRomData(memory->Pointer(), memory->GetSize());
+	if(auto rom = cache.Find(hash, memory->Pointer(), memory->GetSize()))
+		return rom;
+	return ParseAndCache(hash, std::move(memory));
+}
+
+std::shared_ptr<Rom> LoadPacked(const uint8_t *data, size_t size)
+{
+	auto mem = Unpack(data, size);
+	if(!mem)
+		return nullptr;
+	return LoadImage(std::move(mem));
+}
+
+std::unique_ptr<NativeMemory> CopyImage(const uint8_t *data, size_t size)
+{
+	auto mem = NativeMemory::Create(size);
+	if(!mem)
+		return nullptr;
+	memcpy(mem->Pointer(), data, size);
+	mem->MakeReadonly();
+	return mem;
+}
+}
+
+bool Rom::GetConfig(const char *type, uint32_t *value) const
+{
+	for(uint32_t i = 0; i < kNumConfigs; i++) {
+		if(!strcmp(type, kConfigNames[i]))
+			return GetConfig((Config)i, value);
+	}
+	return false;
+}
+
+std::shared_ptr<Rom> Rom::ReadRom(std::shared_ptr<NativeFile> file)
+{
+	if(!file)
+		return nullptr;
+	size_t size = file->GetSize();
+	if(!size)
+		return nullptr;
+	auto mmap = NativeMemory::Create(file.get(), 0, size);
+	if(!mmap)
+		return nullptr;
+	mmap->MakeReadonly();
+	return LoadRom(std::move(mmap));
+}
+
+std::shared_ptr<Rom> Rom::LoadRom(const uint8_t *data, size_t size)
+{
+	if(!size)
+		return nullptr;
+	if(IsPacked(data, size))
+		return LoadPacked(data, size);
+	uint64_t hash = HashRomData(data, size);
+	if(auto rom = cache.Find(hash, data, size))
+		return rom;
+	auto mem = CopyImage(data, size);
+	if(!mem)
+		return nullptr;
+	return ParseAndCache(hash, std::move(mem));
+}
+
+std::shared_ptr<Rom> Rom::LoadRomUnowned(const uint8_t *data, size_t size)
+{
+	if(IsPacked(data, size))
+		return LoadPacked(data, size);
+	return ParseImage(std::make_unique<UnownedMemory>(data, size));
+}
+
+std::shared_ptr<Rom> Rom::LoadRom(const uint8_t *data, size_t size, const char *path)
+{
+	if(!size)
+		return nullptr;
+	if(IsPacked(data, size))
+		return LoadPacked(data, size);
+	uint64_t hash = HashRomData(data, size);
+	if(auto rom = cache.Find(hash, data, size))
+		return rom;
+	std::shared_ptr<NativeFile> file;
+	if(path && *path)
+		file = NativeFile::Open(path);
+	if(file && file->GetSize() == size) {
+		auto mmap = NativeMemory::Create(file.get(), 0, size);
+		if(mmap && !memcmp(mmap->Pointer(), data, size)) {
+			mmap->MakeReadonly();
+			return ParseAndCache(hash, std::move(mmap));
+		}
+	}
+	auto mem = CopyImage(data, size);
+	if(!mem)
+		return nullptr;
+	return ParseAndCache(hash, std::move(mem));
+}
+
+std::shared_ptr<Rom> Rom::LoadRom(std::unique_ptr<NativeMemory> memory)
+{
+	if(IsPacked(memory->Pointer(), memory->GetSize()))
+		return LoadPacked(memory->Pointer(), memory->GetSize());
+	return LoadImage(std::move(memory));
+}
@@ -9,17 +9,65 @@
 class Rom
 {
 public:
+	enum Config : uint32_t
+	{
+		kConfigMapper, // mapper << 8 | submapper
+		kConfigDisplay, // 0 NTSC, 1 PAL
+		kConfigVramConfig,
+		kConfigPrgRamSize,
+		kConfigPrgNvramSize,
+		kConfigChrRamSize,
+		kConfigChrNvramSize,
+		kNumConfigs,
+	};
+
 	virtual ~Rom() {}
 
 	virtual std::string GetType() = 0;
 	virtual size_t GetSize() = 0;
+	// The whole image as loaded
+	virtual const uint8_t* GetData() = 0;
 	virtual const uint8_t* GetRegion(const char *type, uint32_t *size) = 0;
-	virtual bool HasConfig(const char *type) = 0;
-	virtual bool GetConfig(const char *type, uint32_t *value) = 0;
 
+	bool HasConfig(Config type) const { return (config_mask >> type) & 1; }
+	bool GetConfig(Config type, uint32_t *value) const
+	{
+		if(!HasConfig(type))
+			return false;
+		*value = config[type];
+		return true;
+	}
+	// By name, e.g. "MAPPER" or "VRAM CONFIG", for scripts
+	bool GetConfig(const char *type, uint32_t *value) const;
+
+	// Images with the same contents are parsed once and share their memory for
+	// as long as any of them is in use, except for LoadRomUnowned().
+	// Zip and gzip files are decompressed on load, see Unpack().
+
+	// Maps |file| read only. Regions point into the mapping, so every Rom read
+	// from the same file shares its pages.
 	static std::shared_ptr<Rom> ReadRom(std::shared_ptr<NativeFile> file);
+	// Copies |data|
 	static std::shared_ptr<Rom> LoadRom(const uint8_t *data, size_t size);
+	// Uses |data| in place. It has to stay valid and unchanged while the Rom
+	// exists. Not shared with other loads, unless |data| is compressed.
+	static std::shared_ptr<Rom> LoadRomUnowned(const uint8_t *data, size_t size);
+	// Like ReadRom() when the file at |path| holds exactly |data|, otherwise
+	// copies |data|. For frontends that pass a buffer that does not outlive
+	// loading, and may have patched it.
+	static std::shared_ptr<Rom> LoadRom(const uint8_t *data, size_t size, const char *path);
 	static std::shared_ptr<Rom> LoadRom(std::unique_ptr<NativeMemory> memory);
+
+protected:
+	void SetConfig(Config type, uint32_t value)
+	{
+		config[type] = value;
+		config_mask |= 1U << type;
+	}
+
+private:
+	uint32_t config[kNumConfigs] = {};
+	uint32_t config_mask = 0;
 };
 
 #endif
@@ -0,0 +1,138 @@
+#include "rom_db.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "host_system.h"
+
+namespace {
+constexpr uint64_t kPrime1 = 11400714785074694791ULL;
+constexpr uint64_t kPrime2 = 14029467366897019727ULL;
+constexpr uint64_t kPrime3 = 1609587929392839161ULL;
+constexpr uint64_t kPrime4 = 9650029242287828579ULL;
+constexpr uint64_t kPrime5 = 2870177450012600261ULL;
+
+uint64_t Rotl(uint64_t v, int n)
+{
+	return (v << n) | (v >> (64 - n));
+}
+uint64_t Read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+uint32_t Read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+uint64_t Round(uint64_t acc, uint64_t input)
+{
+	return Rotl(acc + input * kPrime2, 31) * kPrime1;
+}
+uint64_t MergeRound(uint64_t acc, uint64_t v)
+{
+	return (acc ^ Round(0, v)) * kPrime1 + kPrime4;
+}
+}
+
+uint64_t HashRomData(const uint8_t *data, size_t size)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = data + size;
+	uint64_t h;
+	if(size >= 32) {
+		uint64_t v[4] = {kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1};
+		for(; end - p >= 32; p += 32) {
+			for(int i = 0; i < 4; i++)
+				v[i] = Round(v[i], Read64(p + i * 8));
+		}
+		h = Rotl(v[0], 1) + Rotl(v[1], 7) + Rotl(v[2], 12) + Rotl(v[3], 18);
+		for(int i = 0; i < 4; i++)
+			h = MergeRound(h, v[i]);
+	} else {
+		h = kPrime5;
+	}
+	h += size;
+	for(; end - p >= 8; p += 8)
+		h = Rotl(h ^ Round(0, Read64(p)), 27) * kPrime1 + kPrime4;
+	if(end - p >= 4) {
+		h = Rotl(h ^ (Read32(p) * kPrime1), 23) * kPrime2 + kPrime3;
+		p += 4;
+	}
+	for(; p < end; p++)
+		h = Rotl(h ^ (*p * kPrime5), 11) * kPrime1;
+	h ^= h >> 33;
+	h *= kPrime2;
+	h ^= h >> 29;
+	h *= kPrime3;
+	h ^= h >> 32;
+	return h;
+}
+
+RomDatabase* RomDatabase::Get()
+{
+	static RomDatabase db;
+	return &db;
+}
+
+void RomDatabase::Add(const RomDbEntry& entry)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	entries[entry.hash] = entry;
+}
+
+bool RomDatabase::Find(uint64_t hash, RomDbEntry *entry)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = entries.find(hash);
+	if(it == entries.end())
+		return false;
+	*entry = it->second;
+	return true;
+}
+
+bool RomDatabase::Parse(const char *text, size_t size)
+{
+	const char *end = text + size;
+	while(text < end) {
+		const char *eol = (const char*)memchr(text, '\n', end - text);
+		if(!eol)
+			eol = end;
+		std::string line(text, eol);
+		text = eol + 1;
+
+		size_t start = line.find_first_not_of(" \t\r");
+		if(start == std::string::npos || line[start] == '#')
+			continue;
+		unsigned long long hash;
+		uint32_t mapper, submapper;
+		char mirroring[4], region[8];
+		if(sscanf(line.c_str(), "%llx %u %u %3s %7s", &hash, &mapper, &submapper, mirroring, region) != 5)
+			return false;
+
+		RomDbEntry entry;
+		entry.hash = hash;
+		entry.mapper = (mapper << 8) | (submapper & 0xFF);
+		if(!_stricmp(mirroring, "V"))
+			entry.vram_config = 0;
+		else if(!_stricmp(mirroring, "H"))
+			entry.vram_config = 1;
+		else if(!strcmp(mirroring, "4"))
+			entry.vram_config = 2;
+		else
+			return false;
+		if(!_stricmp(region, "NTSC"))
+			entry.display = 0;
+		else if(!_stricmp(region, "PAL"))
+			entry.display = 1;
+		else
+			return false;
+		Add(entry);
+	}
+	return true;
+}
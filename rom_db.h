@@ -0,0 +1,45 @@
+#ifndef ROM_DB_H_
+#define ROM_DB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <unordered_map>
+
+// 64 bit hash for ROM contents, four independent lanes of 8 bytes so it runs
+// at memory speed. Matches XXH64 with seed 0.
+uint64_t HashRomData(const uint8_t *data, size_t size);
+
+// Settings that replace what a ROM header says, for dumps with wrong headers.
+// Keyed by HashRomData() of the PRG ROM followed by the CHR ROM, so the header
+// itself does not matter.
+struct RomDbEntry
+{
+	uint64_t hash;
+	uint32_t mapper; // mapper << 8 | submapper
+	uint32_t vram_config; // RomInes::VramConfig
+	uint32_t display; // 0 NTSC, 1 PAL
+};
+
+class RomDatabase
+{
+public:
+	static RomDatabase* Get();
+
+	// ROMs already loaded keep their settings until they are loaded again after
+	// all users let go of them
+	void Add(const RomDbEntry& entry);
+	bool Find(uint64_t hash, RomDbEntry *entry);
+
+	// One entry per line: hash in hex, mapper, submapper, mirroring (H, V or 4)
+	// and region (NTSC or PAL). Empty lines and lines starting with # are
+	// skipped. Returns false on the first bad line, entries before it are kept.
+	bool Parse(const char *text, size_t size);
+
+private:
+	std::mutex lock;
+	std::unordered_map<uint64_t, RomDbEntry> entries;
+};
+
+#endif
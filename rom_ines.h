@@ -2,6 +2,7 @@
 #define ROM_INES_H_
 
 #include "rom.h"
+#include "rom_db.h"
 
 struct INES
 {
@@ -27,14 +28,13 @@ public:
 
 	bool Parse()
 	{
-		uint8_t *data = memory->Pointer();
-		INES *hdr = (INES*)data;
+		const uint8_t *data = memory->Pointer();
+		size_t size = memory->GetSize();
+		if(size < 16)
+			return false;
+		const INES *hdr = (const INES*)data;
 		data += 16;
 		has_trainer = !!(hdr->flags6 & 4);
-		if(has_trainer) {
-			memcpy(trainer, data, 512);
-			data += 512;
-		}
 		bool ines2 = (hdr->flags7 & 0xC) == 8;
 		mapper_num = (hdr->flags7 & 0xF0) | (hdr->flags6 >> 4);
 		submapper = 0;
@@ -42,7 +42,7 @@ public:
 		chr_rom_size = hdr->n_chr_rom;
 		prg_rom_size = hdr->n_prg_rom;
 		if(ines2) {
-			mapper_num = ((uint16_t)(hdr->flags8 & 0xF) << 8);
+			mapper_num |= (uint16_t)(hdr->flags8 & 0xF) << 8;
 			submapper = hdr->flags8 >> 4;
 
 			prg_rom_size |= (uint16_t)(hdr->flags9 & 0xF) << 8;
@@ -77,16 +77,40 @@ public:
 			vram_config = HORIZONTAL_MIRROR;
 		}
 
+		// The regions point into |memory|, which may be a read only file mapping
+		if(16 + (has_trainer ? 512 : 0) + (size_t)prg_rom_size + chr_rom_size > size)
+			return false;
+		if(has_trainer) {
+			trainer = data;
+			data += 512;
+		}
 		prg_rom = data;
 		data += prg_rom_size;
 		chr_rom = data;
 		data += chr_rom_size;
 
+		// CHR ROM follows PRG ROM, so both are hashed in one go
+		RomDbEntry entry;
+		if(RomDatabase::Get()->Find(HashRomData(prg_rom, prg_rom_size + chr_rom_size), &entry)) {
+			mapper_num = entry.mapper >> 8;
+			submapper = entry.mapper & 0xFF;
+			vram_config = (VramConfig)entry.vram_config;
+			system = entry.display;
+		}
+
+		SetConfig(kConfigMapper, (mapper_num << 8) | submapper);
+		SetConfig(kConfigDisplay, system);
+		SetConfig(kConfigVramConfig, vram_config);
+		SetConfig(kConfigPrgRamSize, ram_size);
+		SetConfig(kConfigPrgNvramSize, ram_size_backed);
+		SetConfig(kConfigChrRamSize, chr_ram_size);
+		SetConfig(kConfigChrNvramSize, chr_ram_size_backed);
 		return true;
 	}
 
 	std::string GetType() { return "nes"; }
 	size_t GetSize() { return memory->GetSize(); }
+	const uint8_t* GetData() { return memory->Pointer(); }
 	const uint8_t* GetRegion(const char *type, uint32_t *size)
 	{
 		if(!strcmp(type, "CHR ROM")) {
@@ -104,59 +128,11 @@ public:
 		*size = 0;
 		return nullptr;
 	}
-	bool HasConfig(const char *type) override
-	{
-		return true;
-	}
-	bool GetConfig(const char *type, uint32_t *value) override
-	{
-		if(!strcmp(type, "PRG RAM SIZE")) {
-			*value = ram_size;
-			return true;
-		}
-		if(!strcmp(type, "PRG NVRAM SIZE")) {
-			*value = ram_size_backed;
-			return true;
-		}
-		if(!strcmp(type, "CHR RAM SIZE")) {
-			*value = chr_ram_size;
-			return true;
-		}
-		if(!strcmp(type, "CHR NVRAM SIZE")) {
-			*value = chr_ram_size_backed;
-			return true;
-		}
-		if(!strcmp(type, "PRG NVRAM SIZE")) {
-			*value = ram_size_backed;
-			return true;
-		}
-		if(!strcmp(type, "PRG NVRAM SIZE")) {
-			*value = ram_size_backed;
-			return true;
-		}
-		if(!strcmp(type, "PRG NVRAM SIZE")) {
-			*value = ram_size_backed;
-			return true;
-		}
-		if(!strcmp(type, "DISPLAY")) {
-			*value = system;
-			return true;
-		}
-		if(!strcmp(type, "VRAM CONFIG")) {
-			*value = vram_config;
-			return true;
-		}
-		if(!strcmp(type, "MAPPER")) {
-			*value = (mapper_num << 8) | submapper;
-			return true;
-		}
-		return false;
-	}
 
 private:
 	std::unique_ptr<NativeMemory> memory;
 
-	uint8_t *chr_rom, *prg_rom;
+	const uint8_t *chr_rom, *prg_rom;
 	uint32_t chr_rom_size, prg_rom_size;
 
 	uint32_t ram_size = 0, ram_size_backed = 0;
@@ -168,7 +144,7 @@ private:
 	int system;
 
 	bool has_trainer;
-	uint8_t trainer[512];
+	const uint8_t *trainer = nullptr;
 };
 
 #endif
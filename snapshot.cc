@@ -0,0 +1,157 @@
+#include "snapshot.h"
+
+#include <string.h>
+
+namespace {
+constexpr uint32_t kMagic = MakeSnapshotTag('R', 'C', 'S', 'N');
+constexpr uint32_t kFormatVersion = 1;
+// Windows maps views at 64 kB granularity, which also covers 4 kB pages
+constexpr uint64_t kRamAlignment = 0x10000;
+
+struct Header
+{
+	uint32_t magic;
+	uint32_t format_version;
+	// Version of the machine specific contents
+	uint32_t version;
+	uint32_t num_sections;
+	// Header, section table and small sections
+	uint64_t metadata_size;
+};
+
+uint64_t AlignUp(uint64_t v, uint64_t alignment)
+{
+	return (v + alignment - 1) & ~(alignment - 1);
+}
+}
+
+struct SnapshotReader::SectionInfo
+{
+	static constexpr uint32_t kRam = 1;
+
+	uint32_t tag;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t size;
+};
+
+void SnapshotWriter::AddSection(uint32_t tag, std::vector<uint8_t> data)
+{
+	size_t size = data.size();
+	sections.emplace_back(Section{tag, false, std::move(data), nullptr, size});
+}
+
+void SnapshotWriter::AddRamSection(uint32_t tag, const uint8_t *data, size_t size)
+{
+	sections.emplace_back(Section{tag, true, {}, data, size});
+}
+
+bool SnapshotWriter::Write(NativeFile *file)
+{
+	typedef SnapshotReader::SectionInfo SectionInfo;
+	std::vector<SectionInfo> table(sections.size());
+
+	// Small sections first, then the aligned RAM sections
+	uint64_t offset = sizeof(Header) + sizeof(SectionInfo) * table.size();
+	for(size_t i = 0; i < sections.size(); i++) {
+		table[i].tag = sections[i].tag;
+		table[i].size = sections[i].size;
+		if(sections[i].ram)
+			continue;
+		table[i].flags = 0;
+		table[i].offset = offset;
+		offset += sections[i].size;
+	}
+	uint64_t metadata_size = offset;
+	for(size_t i = 0; i < sections.size(); i++) {
+		if(!sections[i].ram)
+			continue;
+		offset = AlignUp(offset, kRamAlignment);
+		table[i].flags = SectionInfo::kRam;
+		table[i].offset = offset;
+		offset += sections[i].size;
+	}
+
+	Header h = {kMagic, kFormatVersion, version, (uint32_t)table.size(), metadata_size};
+	if(!file->Write(&h, sizeof(h)) || !file->Write(table.data(), sizeof(SectionInfo) * table.size()))
+		return false;
+	for(auto& s : sections) {
+		if(!s.ram && !file->Write(s.data.data(), s.size))
+			return false;
+	}
+	offset = metadata_size;
+	std::vector<uint8_t> padding(kRamAlignment);
+	for(size_t i = 0; i < sections.size(); i++) {
+		if(!sections[i].ram)
+			continue;
+		if(table[i].offset != offset && !file->Write(padding.data(), table[i].offset - offset))
+			return false;
+		if(!file->Write(sections[i].ram_data, sections[i].size))
+			return false;
+		offset = table[i].offset + sections[i].size;
+	}
+	return true;
+}
+
+bool SnapshotReader::Open(std::shared_ptr<NativeFile> f)
+{
+	size_t file_size = f->GetSize();
+	if(file_size < sizeof(Header))
+		return false;
+	auto header_map = NativeMemory::Create(f.get(), 0, sizeof(Header));
+	if(!header_map)
+		return false;
+	Header h;
+	memcpy(&h, header_map->Pointer(), sizeof(h));
+	if(h.magic != kMagic || h.format_version != kFormatVersion)
+		return false;
+	if(h.metadata_size > file_size ||
+		h.metadata_size < sizeof(Header) + (uint64_t)h.num_sections * sizeof(SectionInfo))
+		return false;
+
+	metadata = NativeMemory::Create(f.get(), 0, h.metadata_size);
+	if(!metadata)
+		return false;
+	auto table = reinterpret_cast<const SectionInfo*>(metadata->Pointer() + sizeof(Header));
+	for(uint32_t i = 0; i < h.num_sections; i++) {
+		uint64_t limit = (table[i].flags & SectionInfo::kRam) ? file_size : h.metadata_size;
+		if(table[i].offset > limit || table[i].size > limit - table[i].offset)
+			return false;
+		if((table[i].flags & SectionInfo::kRam) && (table[i].offset & (kRamAlignment - 1)))
+			return false;
+	}
+
+	file = std::move(f);
+	snapshot_version = h.version;
+	num_sections = h.num_sections;
+	return true;
+}
+
+const SnapshotReader::SectionInfo* SnapshotReader::Find(uint32_t tag, bool ram)
+{
+	if(!metadata)
+		return nullptr;
+	auto table = reinterpret_cast<const SectionInfo*>(metadata->Pointer() + sizeof(Header));
+	for(uint32_t i = 0; i < num_sections; i++) {
+		if(table[i].tag == tag && ((table[i].flags & SectionInfo::kRam) != 0) == ram)
+			return &table[i];
+	}
+	return nullptr;
+}
+
+const uint8_t* SnapshotReader::GetSection(uint32_t tag, size_t *size)
+{
+	auto s = Find(tag, false);
+	if(!s)
+		return nullptr;
+	*size = s->size;
+	return metadata->Pointer() + s->offset;
+}
+
+std::unique_ptr<NativeMemory> SnapshotReader::MapRamSection(uint32_t tag)
+{
+	auto s = Find(tag, true);
+	if(!s || !s->size)
+		return nullptr;
+	return NativeMemory::Create(file.get(), s->offset, s->size);
+}
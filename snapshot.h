@@ -0,0 +1,70 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "host_system.h"
+
+// Container for machine snapshots. The file starts with a header and a table
+// of tagged sections, followed by the small sections packed back to back.
+// RAM sections come last, aligned so that they can be mapped copy on write
+// straight from the file instead of being read. Instances loaded from the same
+// file share all pages they do not write to.
+constexpr uint32_t MakeSnapshotTag(char a, char b, char c, char d)
+{
+	return (uint32_t)(uint8_t)a | ((uint32_t)(uint8_t)b << 8) |
+		((uint32_t)(uint8_t)c << 16) | ((uint32_t)(uint8_t)d << 24);
+}
+
+class SnapshotWriter
+{
+public:
+	explicit SnapshotWriter(uint32_t version) : version(version) {}
+
+	void AddSection(uint32_t tag, std::vector<uint8_t> data);
+	// |data| is not copied and has to stay valid until Write()
+	void AddRamSection(uint32_t tag, const uint8_t *data, size_t size);
+
+	bool Write(NativeFile *file);
+
+private:
+	struct Section
+	{
+		uint32_t tag;
+		bool ram;
+		std::vector<uint8_t> data;
+		const uint8_t *ram_data;
+		size_t size;
+	};
+	uint32_t version;
+	std::vector<Section> sections;
+};
+
+class SnapshotReader
+{
+public:
+	bool Open(std::shared_ptr<NativeFile> file);
+
+	uint32_t version() const { return snapshot_version; }
+
+	// Returns nullptr if there is no such section
+	const uint8_t* GetSection(uint32_t tag, size_t *size);
+	// Maps a RAM section copy on write
+	std::unique_ptr<NativeMemory> MapRamSection(uint32_t tag);
+
+private:
+	friend class SnapshotWriter;
+	struct SectionInfo;
+	const SectionInfo* Find(uint32_t tag, bool ram);
+
+	std::shared_ptr<NativeFile> file;
+	std::unique_ptr<NativeMemory> metadata;
+	uint32_t snapshot_version = 0;
+	uint32_t num_sections = 0;
+};
+
+#endif
@@ -1,13 +1,58 @@
 #include "c256.h"
+#include <ctype.h>
 #include <string.h>
 
+#include <algorithm>
+
 namespace {
 
+// Gavin registers, relative to $100
+constexpr uint32_t kIntPending = 0x40;
+constexpr uint32_t kIntMask = 0x4C;
+constexpr uint32_t kNumIntRegs = 4;
+
+// 3 timers of 8 bytes: control, charge (reads back the count), compare
+// control, compare value
+constexpr uint32_t kTimerRegs = 0x60;
+constexpr uint32_t kTimerRegsSize = 8;
+constexpr uint32_t kNumTimers = 3;
+constexpr uint32_t kTimerMask = 0xFFFFFF;
+constexpr uint8_t kTimerEnable = 0x01;
+constexpr uint8_t kTimerClear = 0x02;
+constexpr uint8_t kTimerLoad = 0x04;
+constexpr uint8_t kTimerCountUp = 0x08;
+constexpr uint8_t kTimerReclear = 0x01;
+constexpr uint8_t kTimerReload = 0x02;
+
+// Control, fill byte, source, destination, size (24 bit, or 16 bit width and
+// height for 2D), source stride, destination stride, status
+constexpr uint32_t kSdmaCtrl = 0x80;
+constexpr uint32_t kSdmaStatus = 0x90;
+constexpr uint8_t kSdmaEnable = 0x01;
+constexpr uint8_t kSdma2D = 0x02;
+constexpr uint8_t kSdmaFill = 0x04;
+constexpr uint8_t kSdmaIrqEnable = 0x08;
+constexpr uint8_t kSdmaStart = 0x80;
+
+// Tags of events in the saved state, timers use 1 to 3
+constexpr uint32_t kTimerEventTag = 1;
+constexpr uint32_t kFrameEventTag = 4;
+
+uint32_t Get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+uint32_t Get24(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16;
+}
+
 static void MathCoproUMul(uint8_t *bytes)
 {
 	uint16_t a = bytes[0] + bytes[1] * 256;
 	uint16_t b = bytes[2] + bytes[3] * 256;
-	uint32_t result = a * b;
+	uint32_t result = (uint32_t)a * b;
 	bytes[4] = result;
 	bytes[5] = result >> 8;
 	bytes[6] = result >> 16;
@@ -15,9 +60,9 @@ static void MathCoproUMul(uint8_t *bytes)
 }
 static void MathCoproSMul(uint8_t *bytes)
 {
-	uint16_t a = bytes[0] + bytes[1] * 256;
-	uint16_t b = bytes[2] + bytes[3] * 256;
-	uint32_t result = static_cast<int>(a) * static_cast<int>(b);
+	int16_t a = static_cast<int16_t>(bytes[0] | bytes[1] << 8);
+	int16_t b = static_cast<int16_t>(bytes[2] | bytes[3] << 8);
+	uint32_t result = static_cast<uint32_t>(static_cast<int32_t>(a) * b);
 	bytes[4] = result;
 	bytes[5] = result >> 8;
 	bytes[6] = result >> 16;
@@ -41,14 +86,13 @@ static void MathCoproUDiv(uint8_t *bytes)
 }
 static void MathCoproSDiv(uint8_t *bytes)
 {
-	uint16_t a = bytes[0] + bytes[1] * 256;
-	uint16_t b = bytes[2] + bytes[3] * 256;
+	int16_t a = static_cast<int16_t>(bytes[0] | bytes[1] << 8);
+	int16_t b = static_cast<int16_t>(bytes[2] | bytes[3] << 8);
 	int16_t result, rem;
 	if(b != 0) {
-		int sa = static_cast<int>(a);
-		int sb = static_cast<int>(b);
-		result = sa / sb;
-		rem = sa % sb;
+		// -32768 / -1 wraps around to -32768
+		result = static_cast<int16_t>(a / b);
+		rem = static_cast<int16_t>(a % b);
 	} else {
 		result = rem = 0;
 	}
@@ -74,12 +118,102 @@ static void MathCoproAdd(uint8_t *bytes)
 	bytes[11] = sum >> 24;
 }
 
+// Math units, each computes its result registers from its inputs
+const struct {
+	uint32_t base;
+	uint32_t result;
+	void (*fn)(uint8_t *bytes);
+} kMathUnits[] = {
+	{ 0x00, 0x04, MathCoproUMul },
+	{ 0x08, 0x0C, MathCoproSMul },
+	{ 0x10, 0x14, MathCoproUDiv },
+	{ 0x18, 0x1C, MathCoproSDiv },
+	{ 0x20, 0x28, MathCoproAdd },
+};
+constexpr uint32_t kMathEnd = 0x30;
+
+uint32_t MathUnit(uint32_t reg)
+{
+	return std::min<uint32_t>(reg >> 3, 4);
+}
+
+static bool fromhex(uint8_t& v, uint8_t ch)
+{
+	if(ch >= '0' && ch <= '9')
+		v = ch - '0';
+	else if(ch >= 'a' && ch <= 'f')
+		v = ch - 'a' + 10;
+	else if(ch >= 'A' && ch <= 'F')
+		v = ch - 'A' + 10;
+	else
+		return false;
+	return true;
+}
+
+static bool WriteHexToMem(uint8_t *mem, size_t memsize, const std::vector<uint8_t>& hex)
+{
+	const uint8_t *p = hex.data();
+	const uint8_t *end = p + hex.size();
+
+	uint32_t addrbase = 0;
+
+	uint8_t data[300];
+	data[0] = 0;
+	while(p < end) {
+		if(*p == ':') {
+			p++;
+			uint32_t i;
+			uint8_t sum = 0;
+			for(i = 0; i < (uint32_t)data[0] + 5 && p < end; i++, p += 2) {
+				uint8_t lo, hi;
+				if(!fromhex(hi, p[0]) || !fromhex(lo, p[1]))
+					return false;
+				data[i] = lo | (hi << 4);
+				sum += data[i];
+			}
+			if(sum != 0) // Bad checksum!
+				return false;
+			uint16_t addr = ((uint16_t)data[1] << 8) | data[2];
+			uint8_t type = data[3];
+
+			switch(type) {
+			case 0:
+				if(addrbase + addr + data[0] > memsize)
+					return false;
+				memcpy(mem + addrbase + addr, &data[4], data[0]);
+				break;
+			case 1:
+				return true;
+			case 4:
+				if(data[0] != 2)
+					return false;
+				addrbase = (uint32_t)(((uint16_t)data[4] << 8) | data[5]) << 16;
+				break;
+			default:
+				return false;
+			}
+		} else if(isspace(*p)) {
+			p++;
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 
 
 }
 
-C256::C256(uint32_t ram_size, const std::string& sysflash_path, const std::string& userflash_path) : cpu(&sys)
+C256::C256(uint32_t ram_size, const std::string& sysflash_path, const std::string& userflash_path) : cpu(&sys), vicky(&sys)
 {
+	memset(gavin_low_regs, 0, sizeof(gavin_low_regs));
+	memset(gavin_low_regs + kIntMask, 0xFF, kNumIntRegs);
+	for(auto& t : timers)
+		t = Timer{0, 0, ~0ULL};
+	events.Schedule(next_frame_cycle, [this]() { OnFrameStart(); }, kFrameEventTag);
+
 	ram = NativeMemory::Create(ram_size);
 	vram = NativeMemory::Create(0x400000); // 4 MB VRAM
 	sysflash = NativeMemory::Create(0x80000); // 512 kB flashes
@@ -99,6 +233,7 @@ C256::C256(uint32_t ram_size, const std::string& sysflash_path, const std::strin
 			p.io_mask = 0;
 			p.io_eq = 1;
 			p.cycles_per_access = 1;
+			p.write_epoch = 0;
 
 			// IO is mapped at 00:01xx and AF:xxxx 
 			if(i == 0xAF) {
@@ -126,6 +261,7 @@ C256::C256(uint32_t ram_size, const std::string& sysflash_path, const std::strin
 	sys.io_devices.write = &IoWrite;
 	sys.io_devices.is_io_device_address = &IsIoDeviceAddress;
 	sys.io_devices.irq_taken = [](void*,uint32_t){};
+	sys.hooks = &hooks;
 
 	sys.Init(WDC65C816::kPageSizeBits, cpu.GetAddressBusBits(), pages);
 }
@@ -136,6 +272,7 @@ void C256::PowerOn()
 	// sysflash is coped to RAM and then the first 64k to first 64k
 	//memcpy(ram->Pointer() + 0x180000, sysflash->Pointer(), 0x80000);
 	memcpy(ram->Pointer(), ram->Pointer() + 0x180000, 0x10000);
+	sys.MarkDirty(0, 0x10000);
 	cpu.PowerOn();
 }
 void C256::Reset()
@@ -174,9 +311,24 @@ void C256::IoWrite(void *context, cpuaddr_t addr, const uint8_t *data, uint32_t
 	} else {
 		// Memory access that got trapped
 		memcpy(self->ram->Pointer() + addr, data, size);
+		self->sys.MarkDirty(addr, size);
 	}
 }
 
+uint8_t C256::GavinReadByte(uint32_t reg)
+{
+	uint32_t timer = (reg - kTimerRegs) / kTimerRegsSize;
+	uint32_t offset = reg - kTimerRegs - timer * kTimerRegsSize;
+	if(timer < kNumTimers && offset >= 1 && offset <= 3)
+		return TimerCounter(timer) >> ((offset - 1) * 8);
+	if(reg < kMathEnd) {
+		uint32_t unit = MathUnit(reg);
+		if(((math_dirty >> unit) & 1) && reg >= kMathUnits[unit].result)
+			UpdateMath(unit);
+	}
+	return gavin_low_regs[reg];
+}
+
 void C256::GavinIoRead(uint32_t reg, uint8_t *data, uint32_t size)
 {
 	// 100-12F: Math coprocessor
@@ -186,48 +338,442 @@ void C256::GavinIoRead(uint32_t reg, uint8_t *data, uint32_t size)
 	// 160-17F: Timers
 	// 180-19F: SDMA
 	// 1A0-1FF: ???
-	*data = gavin_low_regs[reg];
+	*data = GavinReadByte(reg);
 	if(size == 2) {
-		data[1] = gavin_low_regs[reg + 1];
+		data[1] = GavinReadByte(reg + 1);
 	}
 }
 
 void C256::GavinIoWrite(uint32_t reg, const uint8_t *data, uint32_t size)
 {
+	if(reg - kIntPending < kNumIntRegs) {
+		// Pending bits are cleared by writing 1
+		gavin_low_regs[reg] &= ~*data;
+		UpdateIrq();
+		return;
+	}
+	uint32_t timer = (reg - kTimerRegs) / kTimerRegsSize;
+	if(timer < kNumTimers) {
+		// Timers go on from their current count with the new settings
+		timers[timer].counter = TimerCounter(timer);
+		timers[timer].base = cpu.cpu_state.cycle;
+	}
+
 	gavin_low_regs[reg] = *data;
-	switch(reg >> 3) {
-	case 0:
-		MathCoproUMul(gavin_low_regs + 0);
-		break;
-	case 1:
-		MathCoproSMul(gavin_low_regs + 8);
-		break;
-	case 2:
-		MathCoproUDiv(gavin_low_regs + 0x10);
-		break;
-	case 3:
-		MathCoproSDiv(gavin_low_regs + 0x18);
-		break;
-	case 4:
-	case 5:
-		MathCoproAdd(gavin_low_regs + 0x20);
-		break;
-	default:
-		break;
+	if(reg < kMathEnd) {
+		// Results are computed when they are read
+		math_dirty |= 1U << MathUnit(reg);
+	} else if(reg - kIntMask < kNumIntRegs)
+		UpdateIrq();
+	else if(timer < kNumTimers)
+		TimerWrite(timer, reg - kTimerRegs - timer * kTimerRegsSize);
+	else if(reg == kSdmaCtrl && (*data & kSdmaStart))
+		StartSdma();
+}
+
+void C256::UpdateMath(uint32_t unit)
+{
+	auto& u = kMathUnits[unit];
+	// Writes to the result registers are overwritten like on every input write
+	u.fn(gavin_low_regs + u.base);
+	math_dirty &= ~(1U << unit);
+}
+
+void C256::FlushMath()
+{
+	for(uint32_t i = 0; i < sizeof(kMathUnits) / sizeof(kMathUnits[0]); i++) {
+		if((math_dirty >> i) & 1)
+			UpdateMath(i);
 	}
 }
 
+void C256::RaiseInterrupt(uint32_t irq)
+{
+	uint8_t& pending = gavin_low_regs[kIntPending + irq / 8];
+	uint8_t bit = 1 << (irq % 8);
+	if(pending & bit)
+		return;
+	pending |= bit;
+	hooks.Post(HookBus::kInterrupt, cpu.cpu_state.cycle, irq);
+	UpdateIrq();
+}
+
+void C256::UpdateIrq()
+{
+	bool irq = false;
+	for(uint32_t i = 0; i < kNumIntRegs; i++)
+		irq |= (gavin_low_regs[kIntPending + i] & ~gavin_low_regs[kIntMask + i]) != 0;
+	if(irq)
+		cpu.cpu_state.SetInterruptSource(1);
+	else
+		cpu.cpu_state.ClearInterruptSource(1);
+}
+
+uint32_t C256::TimerCounter(uint32_t i) const
+{
+	const Timer& t = timers[i];
+	const uint8_t *regs = gavin_low_regs + kTimerRegs + i * kTimerRegsSize;
+	if(!(regs[0] & kTimerEnable))
+		return t.counter;
+	uint64_t elapsed = cpu.cpu_state.cycle - t.base;
+	if(regs[0] & kTimerCountUp)
+		return (uint32_t)(t.counter + elapsed) & kTimerMask;
+	return (uint32_t)(t.counter - elapsed) & kTimerMask;
+}
+
+void C256::TimerWrite(uint32_t i, uint32_t offset)
+{
+	const uint8_t *regs = gavin_low_regs + kTimerRegs + i * kTimerRegsSize;
+	if(offset == 0) {
+		if(regs[0] & kTimerClear)
+			timers[i].counter = 0;
+		if(regs[0] & kTimerLoad)
+			timers[i].counter = Get24(regs + 1);
+	}
+	ScheduleTimer(i, false);
+}
+
+void C256::ScheduleTimer(uint32_t i, bool locked)
+{
+	Timer& t = timers[i];
+	const uint8_t *regs = gavin_low_regs + kTimerRegs + i * kTimerRegsSize;
+	// Only the latest match is pending, guests may write timer registers in a loop
+	if(locked)
+		events.CancelNoLock(kTimerEventTag + i);
+	else
+		events.Cancel(kTimerEventTag + i);
+	if(!(regs[0] & kTimerEnable)) {
+		t.next_match = ~0ULL;
+		return;
+	}
+	uint32_t compare = Get24(regs + 5);
+	uint32_t delta = (regs[0] & kTimerCountUp) ? compare - t.counter : t.counter - compare;
+	delta &= kTimerMask;
+	// Counting from the compare value takes a full wrap around
+	if(!delta)
+		delta = kTimerMask + 1;
+	t.next_match = t.base + delta;
+	auto f = [this, i]() { OnTimerMatch(i); };
+	if(locked)
+		events.ScheduleNoLock(t.next_match, std::move(f), kTimerEventTag + i);
+	else
+		events.Schedule(t.next_match, std::move(f), kTimerEventTag + i);
+}
+
+void C256::OnTimerMatch(uint32_t i)
+{
+	Timer& t = timers[i];
+	if(cpu.cpu_state.cycle < t.next_match)
+		return;
+	const uint8_t *regs = gavin_low_regs + kTimerRegs + i * kTimerRegsSize;
+	if(regs[4] & kTimerReclear)
+		t.counter = 0;
+	else if(regs[4] & kTimerReload)
+		t.counter = Get24(regs + 1);
+	else
+		t.counter = Get24(regs + 5);
+	t.base = t.next_match;
+	RaiseInterrupt(kIntTimer0 + i);
+	ScheduleTimer(i, true);
+}
+
+void C256::StartSdma()
+{
+	uint8_t *regs = gavin_low_regs + kSdmaCtrl;
+	regs[0] &= ~kSdmaStart;
+	if(!(regs[0] & kSdmaEnable))
+		return;
+
+	cpuaddr_t src = Get24(regs + 2);
+	cpuaddr_t dst = Get24(regs + 5);
+	uint32_t width, height, src_stride, dst_stride;
+	if(regs[0] & kSdma2D) {
+		width = Get16(regs + 8);
+		height = Get16(regs + 10);
+		src_stride = Get16(regs + 12);
+		dst_stride = Get16(regs + 14);
+	} else {
+		width = Get24(regs + 8);
+		height = 1;
+		src_stride = dst_stride = 0;
+	}
+
+	// Copied a page at a time through plain memory, the CPU is halted for a
+	// cycle per byte. The transfer ends at the first address that is not plain
+	// memory.
+	uint8_t buffer[0x1000];
+	if(regs[0] & kSdmaFill)
+		memset(buffer, regs[1], sizeof(buffer));
+	uint64_t copied = 0;
+	bool stopped = false;
+	for(uint32_t y = 0; y < height && !stopped; y++) {
+		for(uint32_t x = 0; x < width && !stopped; ) {
+			uint32_t n = std::min<uint32_t>(width - x, sizeof(buffer));
+			uint32_t read = n;
+			if(!(regs[0] & kSdmaFill))
+				read = sys.PeekRange(src + y * src_stride + x, buffer, n, false);
+			uint32_t written = sys.PokeRange(dst + y * dst_stride + x, buffer, read, false);
+			copied += written;
+			stopped = written < n;
+			x += n;
+		}
+	}
+	cpu.cpu_state.cycle += copied;
+
+	gavin_low_regs[kSdmaStatus] = 0;
+	if(regs[0] & kSdmaIrqEnable)
+		RaiseInterrupt(kIntSdma);
+}
+
+std::function<void()> C256::ResolveEvent(uint32_t tag)
+{
+	uint32_t i = tag - kTimerEventTag;
+	if(i < kNumTimers)
+		return [this, i]() { OnTimerMatch(i); };
+	if(tag == kFrameEventTag)
+		return [this]() { OnFrameStart(); };
+	return nullptr;
+}
+
 void C256::AfIoRead(uint32_t reg, uint8_t *data, uint32_t size)
 {
-	*data = 0;
+	*data = io->Pointer()[reg];
 }
 
 void C256::AfIoWrite(uint32_t reg, const uint8_t *data, uint32_t size)
 {
 	io->Pointer()[reg] = *data;
+	vicky.OnWrite(reg);
+}
+
+namespace {
+constexpr uint32_t kSnapshotVersion = 3;
+constexpr uint32_t kCpuTag = MakeSnapshotTag('C', '8', '1', '6');
+constexpr uint32_t kGavinTag = MakeSnapshotTag('G', 'A', 'V', 'N');
+constexpr uint32_t kIoTag = MakeSnapshotTag('A', 'F', 'I', 'O');
+constexpr uint32_t kTimerTag = MakeSnapshotTag('T', 'I', 'M', 'R');
+constexpr uint32_t kEventTag = MakeSnapshotTag('E', 'V', 'N', 'T');
+constexpr uint32_t kFrameTag = MakeSnapshotTag('F', 'R', 'A', 'M');
+
+struct FrameSaveData
+{
+	uint64_t next_frame_cycle;
+	uint32_t frame_id;
+	uint32_t padding;
+};
+constexpr uint32_t kRamTag = MakeSnapshotTag('R', 'A', 'M', ' ');
+constexpr uint32_t kVramTag = MakeSnapshotTag('V', 'R', 'A', 'M');
+}
+
+bool C256::SaveSnapshot(NativeFile *file)
+{
+	FlushMath();
+	SnapshotWriter w(kSnapshotVersion);
+	std::vector<uint8_t> cpu_state;
+	if(!cpu.SaveState(&cpu_state))
+		return false;
+	w.AddSection(kCpuTag, std::move(cpu_state));
+	w.AddSection(kGavinTag, std::vector<uint8_t>(gavin_low_regs, gavin_low_regs + sizeof(gavin_low_regs)));
+	w.AddSection(kIoTag, std::vector<uint8_t>(io->Pointer(), io->Pointer() + io->GetSize()));
+	const uint8_t *timer_data = reinterpret_cast<const uint8_t*>(timers);
+	w.AddSection(kTimerTag, std::vector<uint8_t>(timer_data, timer_data + sizeof(timers)));
+	std::vector<uint8_t> event_state;
+	if(!events.SaveState(&event_state))
+		return false;
+	w.AddSection(kEventTag, std::move(event_state));
+	FrameSaveData frame = {next_frame_cycle, frame_id, 0};
+	const uint8_t *frame_data = reinterpret_cast<const uint8_t*>(&frame);
+	w.AddSection(kFrameTag, std::vector<uint8_t>(frame_data, frame_data + sizeof(frame)));
+	w.AddRamSection(kRamTag, ram->Pointer(), ram->GetSize());
+	w.AddRamSection(kVramTag, vram->Pointer(), vram->GetSize());
+	return w.Write(file);
+}
+
+bool C256::LoadSnapshot(std::shared_ptr<NativeFile> file)
+{
+	SnapshotReader r;
+	if(!r.Open(std::move(file)) || r.version() != kSnapshotVersion)
+		return false;
+
+	size_t gavin_size, io_size, cpu_size, timer_size, event_size, frame_size;
+	auto gavin = r.GetSection(kGavinTag, &gavin_size);
+	auto io_data = r.GetSection(kIoTag, &io_size);
+	auto cpu_data = r.GetSection(kCpuTag, &cpu_size);
+	auto timer_data = r.GetSection(kTimerTag, &timer_size);
+	auto event_data = r.GetSection(kEventTag, &event_size);
+	auto frame_data = r.GetSection(kFrameTag, &frame_size);
+	if(!gavin || gavin_size != sizeof(gavin_low_regs) || !io_data || io_size != io->GetSize() || !cpu_data)
+		return false;
+	if(!timer_data || timer_size != sizeof(timers) || !event_data || !frame_data || frame_size != sizeof(FrameSaveData))
+		return false;
+	auto new_ram = r.MapRamSection(kRamTag);
+	auto new_vram = r.MapRamSection(kVramTag);
+	if(!new_ram || new_ram->GetSize() != ram->GetSize() || !new_vram || new_vram->GetSize() != vram->GetSize())
+		return false;
+	if(!cpu.LoadState(&cpu_data, cpu_data + cpu_size))
+		return false;
+	if(!events.LoadState(&event_data, event_data + event_size, [this](uint32_t tag) { return ResolveEvent(tag); }))
+		return false;
+
+	memcpy(gavin_low_regs, gavin, sizeof(gavin_low_regs));
+	math_dirty = 0;
+	memcpy(timers, timer_data, sizeof(timers));
+	FrameSaveData frame;
+	memcpy(&frame, frame_data, sizeof(frame));
+	next_frame_cycle = frame.next_frame_cycle;
+	frame_id = frame.frame_id;
+	memcpy(io->Pointer(), io_data, io_size);
+	ram = std::move(new_ram);
+	vram = std::move(new_vram);
+	Map(ram.get(), 0);
+	Map(vram.get(), 0xB00000);
+	sys.MarkDirty(0, 0x1000000);
+	vicky.Invalidate();
+	return true;
+}
+
+std::unique_ptr<C256> C256::Fork()
+{
+	std::vector<uint8_t> cpu_state;
+	if(!cpu.SaveState(&cpu_state))
+		return nullptr;
+
+	bool ram_modified = !forked || sys.IsDirtySince(fork_mark, 0, (uint32_t)ram->GetSize());
+	bool vram_modified = !forked || sys.IsDirtySince(fork_mark, 0xB00000, (uint32_t)vram->GetSize());
+	// Flash is read only to the CPU
+	bool flash_modified = !forked;
+	fork_mark = sys.MarkDirtyEpoch();
+	forked = true;
+
+	auto child = std::make_unique<C256>((uint32_t)ram->GetSize(), "", "");
+	child->ram = ram->Fork(ram_modified);
+	child->vram = vram->Fork(vram_modified);
+	child->sysflash = sysflash->Fork(flash_modified);
+	child->userflash = userflash->Fork(flash_modified);
+	child->io = io->Fork();
+	if(!child->ram || !child->vram || !child->sysflash || !child->userflash || !child->io)
+		return nullptr;
+	child->Map(child->ram.get(), 0);
+	child->Map(child->vram.get(), 0xB00000);
+	child->Map(child->sysflash.get(), 0xF00000);
+	child->Map(child->userflash.get(), 0xF80000);
+	child->Map(child->io.get(), 0xAF0000);
+	FlushMath();
+	memcpy(child->gavin_low_regs, gavin_low_regs, sizeof(gavin_low_regs));
+	memcpy(child->timers, timers, sizeof(timers));
+	std::vector<uint8_t> event_state;
+	if(!events.SaveState(&event_state))
+		return nullptr;
+	const uint8_t *e = event_state.data();
+	if(!child->events.LoadState(&e, e + event_state.size(), [&child](uint32_t tag) { return child->ResolveEvent(tag); }))
+		return nullptr;
+	child->frame_id = frame_id;
+	child->next_frame_cycle = next_frame_cycle;
+
+	const uint8_t *p = cpu_state.data();
+	if(!child->cpu.LoadState(&p, p + cpu_state.size()))
+		return nullptr;
+	return child;
+}
+
+bool C256::LoadIntelHex(const std::vector<uint8_t>& hex)
+{
+	if(!WriteHexToMem(ram->Pointer(), ram->GetSize(), hex))
+		return false;
+	sys.MarkDirty(0, (uint32_t)ram->GetSize());
+	return true;
+}
+
+void C256::GetStats(StatsList *stats)
+{
+	cpu.GetStats(stats);
+	sys.GetStats("bus", stats);
+	events.GetStats(stats);
+}
+
+void C256::ResetStats()
+{
+	cpu.ResetStats();
+	sys.ResetStats();
+	events.ResetStats();
+}
+
+void C256::OnFrameStart()
+{
+	hooks.Post(HookBus::kFrameEnd, cpu.cpu_state.cycle, frame_id);
+	frame_id++;
+	RaiseInterrupt(kIntStartOfFrame);
+	next_frame_cycle += kCyclesPerFrame;
+	events.ScheduleNoLock(next_frame_cycle, [this]() { OnFrameStart(); }, kFrameEventTag);
+}
+
+void C256::Run()
+{
+	cpu.cpu_state.cycle_stop = next_frame_cycle;
+	cpu.EmulateWithCycleProcessing(*this, &events);
+	hooks.Dispatch();
+}
+
+void C256::RunForOneFrame()
+{
+	Run();
+	RenderFrame();
+}
+
+void C256::RenderFrame()
+{
+	vicky.RenderFrame(io->Pointer(), vram->Pointer(), (uint32_t)vram->GetSize());
+}
+
+C256::RunResult C256::RunFor(uint64_t cycles)
+{
+	run_result = kRunCyclesDone;
+	cpu.cpu_state.cycle_stop = cpu.cpu_state.cycle + cycles;
+	cpu.EmulateWithCycleProcessing(*this, &events);
+	check_pc = false;
+	stop_on_idle = false;
+	hooks.Dispatch();
+	return run_result;
+}
+
+C256::RunResult C256::RunCycles(uint64_t cycles)
+{
+	return RunFor(cycles);
+}
+
+C256::RunResult C256::RunUntilPc(cpuaddr_t pc, uint64_t cycles)
+{
+	check_pc = true;
+	stop_pc = pc;
+	return RunFor(cycles);
+}
+
+C256::RunResult C256::RunUntilIdle(uint64_t cycles)
+{
+	if(cpu.cpu_state.halted)
+		return kRunIdle;
+	stop_on_idle = true;
+	return RunFor(cycles);
+}
+
+void C256::RequestStop()
+{
+	events.Schedule(0, [this]() { StopRun(kRunStopped); });
+}
+
+void C256::CheckRunConditions()
+{
+	auto& state = cpu.cpu_state;
+	if(check_pc && state.GetCanonicalAddress() == stop_pc) {
+		StopRun(kRunPcReached);
+	} else if(stop_on_idle && state.halted) {
+		StopRun(kRunIdle);
+	}
 }
 
-void C256::Emulate()
+void C256::StopRun(RunResult result)
 {
-	cpu.Emulate();
+	run_result = result;
+	cpu.cpu_state.cycle_stop = cpu.cpu_state.cycle;
+	cpu.cpu_state.event_cycle = cpu.cpu_state.cycle;
 }
@@ -2,24 +2,98 @@
 #define SYSTEM_C256_H_
 
 #include "cpu/65816/cpu_65c816.h"
+#include "hook_bus.h"
 #include "host_system.h"
+#include "snapshot.h"
+#include "vicky.h"
 
 #include <string>
 
 class C256
 {
 public:
+	// Interrupt controller bits, register * 8 + bit
+	enum Interrupt : uint32_t
+	{
+		kIntStartOfFrame = 0,
+		kIntStartOfLine = 1,
+		kIntTimer0 = 2,
+		kIntTimer1 = 3,
+		kIntTimer2 = 4,
+		kIntRtc = 5,
+		kIntKeyboard = 8,
+		kIntSdma = 19,
+		kIntVdma = 27,
+	};
+
+	// 14.318 MHz at 60 Hz
+	static constexpr uint64_t kCyclesPerFrame = 238636;
+
+	enum RunResult
+	{
+		kRunCyclesDone,
+		kRunPcReached,
+		kRunIdle,
+		kRunStopped,
+	};
+
 	C256(uint32_t ram_size, const std::string& sysflash_path, const std::string& userflash_path);
 
 	void PowerOn();
 	void Reset();
 
-	void Emulate();
+	// Emulates up to the next start of frame. Frames are timed by an event, so
+	// they stay in step with the headless runs below.
+	void Run();
+	// Run() and draw the frame into vicky.frame()
+	void RunForOneFrame();
+	// Draws the current VICKY state into vicky.frame()
+	void RenderFrame();
+
+	// Headless runs, they end after |cycles| unless their condition is met
+	// first or RequestStop() is called. Conditions are checked after every
+	// instruction. Hook events are dispatched when they return.
+	RunResult RunCycles(uint64_t cycles);
+	RunResult RunUntilPc(cpuaddr_t pc, uint64_t cycles);
+	// Returns kRunIdle once the CPU halts in WAI or STP
+	RunResult RunUntilIdle(uint64_t cycles);
+	// Ends the current run, or the next one if none is active. Can be called
+	// from any thread.
+	void RequestStop();
+
+	void PreCpuCycle() { }
+	void PostCpuCycle()
+	{
+		if(check_pc || stop_on_idle)
+			CheckRunConditions();
+	}
+
+	// Loads Intel HEX records into RAM
+	bool LoadIntelHex(const std::vector<uint8_t>& hex);
+
+	// RAM and VRAM are stored as raw sections, loading maps them copy on write
+	// from |file| so restoring is nearly free.
+	bool SaveSnapshot(NativeFile *file);
+	bool LoadSnapshot(std::shared_ptr<NativeFile> file);
 
+	// Clones the running machine. Memory is shared copy on write, only device
+	// state is copied. The clone is independent and can run on another thread.
+	std::unique_ptr<C256> Fork();
+
+	// Sets the pending bit of |irq|. The CPU sees an IRQ while any pending bit
+	// is not masked.
+	void RaiseInterrupt(uint32_t irq);
+
+	void GetStats(StatsList *stats);
+	void ResetStats();
+
+	// Writes through this pointer have to be reported with sys.MarkDirty()
 	uint8_t* rambase() { return ram->Pointer(); }
 
 	SystemBus sys;
 	WDC65C816 cpu;
+	HookBus hooks;
+	Vicky vicky;
 
 private:
 	static bool IsIoDeviceAddress(void *context, cpuaddr_t addr);
@@ -28,11 +102,36 @@ private:
 
 	void GavinIoRead(uint32_t reg, uint8_t *data, uint32_t size);
 	void GavinIoWrite(uint32_t reg, const uint8_t *data, uint32_t size);
+	uint8_t GavinReadByte(uint32_t reg);
 	void AfIoRead(uint32_t reg, uint8_t *data, uint32_t size);
 	void AfIoWrite(uint32_t reg, const uint8_t *data, uint32_t size);
 
 	void Map(NativeMemory *mem, uint32_t addr);
 
+	struct Timer
+	{
+		// Count at |base| cycles
+		uint32_t counter;
+		uint64_t base;
+		// Cycle of the next compare match, ~0 while stopped
+		uint64_t next_match;
+	};
+	void UpdateMath(uint32_t unit);
+	void FlushMath();
+
+	uint32_t TimerCounter(uint32_t i) const;
+	void TimerWrite(uint32_t i, uint32_t offset);
+	// |locked| is set when called from an event, with the queue locked
+	void ScheduleTimer(uint32_t i, bool locked);
+	void OnTimerMatch(uint32_t i);
+	void UpdateIrq();
+	void StartSdma();
+	void OnFrameStart();
+	RunResult RunFor(uint64_t cycles);
+	void CheckRunConditions();
+	void StopRun(RunResult result);
+	std::function<void()> ResolveEvent(uint32_t tag);
+
 	std::unique_ptr<NativeMemory> ram;
 	std::unique_ptr<NativeMemory> vram;
 	std::unique_ptr<NativeMemory> io;
@@ -40,6 +139,24 @@ private:
 	std::unique_ptr<NativeMemory> userflash;
 
 	uint8_t gavin_low_regs[256];
+	// One bit per math unit whose results are out of date
+	uint32_t math_dirty = 0;
+	// Timers count CPU cycles, matches are scheduled on |events|
+	Timer timers[3];
+	EventQueue events;
+	// Frames are counted at their start, |next_frame_cycle| is the next start
+	uint32_t frame_id = 0;
+	uint64_t next_frame_cycle = kCyclesPerFrame;
+
+	// Run conditions
+	bool check_pc = false;
+	cpuaddr_t stop_pc = 0;
+	bool stop_on_idle = false;
+	RunResult run_result = kRunCyclesDone;
+
+	// Memory that was not written since the last fork is not copied again
+	bool forked = false;
+	uint64_t fork_mark = 0;
 
 	// 16 MB
 	Page pages[0x1000000 >> WDC65C816::kPageSizeBits];
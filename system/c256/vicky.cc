@@ -0,0 +1,338 @@
+#include "vicky.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Offsets in the I/O block
+constexpr uint32_t kMasterCtrl = 0x0000;
+constexpr uint8_t kCtrlText = 0x01;
+constexpr uint8_t kCtrlTextOverlay = 0x02;
+constexpr uint8_t kCtrlGraphics = 0x04;
+constexpr uint8_t kCtrlBitmap = 0x08;
+constexpr uint8_t kCtrlTiles = 0x10;
+constexpr uint8_t kCtrlSprites = 0x20;
+constexpr uint8_t kCtrlDisable = 0x80;
+// Bits 0-1 resolution, bit 2 doubles graphics pixels
+constexpr uint32_t kMasterCtrlHigh = 0x0001;
+// Enable, border color B, G, R, border width, border height
+constexpr uint32_t kBorderCtrl = 0x0004;
+// B, G, R
+constexpr uint32_t kBackgroundColor = 0x000D;
+// Enable, unused, character, color, column (16 bit), row (16 bit)
+constexpr uint32_t kCursorCtrl = 0x0010;
+// 2 layers of 8 bytes: control, address
+constexpr uint32_t kBitmapRegs = 0x0140;
+// 4 layers of 12 bytes: control, map address, map width and height in tiles,
+// scroll x and y
+constexpr uint32_t kTileLayerRegs = 0x0200;
+// 8 sets of 4 bytes: address, unused. A set is 256 pixels wide, 16x16 tiles.
+constexpr uint32_t kTilesetRegs = 0x0280;
+// 64 sprites of 8 bytes: control, address, x, y. Sprites are 32x32.
+constexpr uint32_t kSpriteRegs = 0x0C00;
+constexpr uint32_t kNumSprites = 64;
+// 16 BGRA entries each
+constexpr uint32_t kTextFgLut = 0x1F40;
+constexpr uint32_t kTextBgLut = 0x1F80;
+// 8 LUTs of 256 BGRA entries
+constexpr uint32_t kLuts = 0x2000;
+constexpr uint32_t kLutsEnd = 0x4000;
+// 256 characters of 8x8
+constexpr uint32_t kFont = 0x8000;
+constexpr uint32_t kFontEnd = 0x8800;
+// One byte per character, color is FG index << 4 | BG index
+constexpr uint32_t kTextMemory = 0xA000;
+constexpr uint32_t kColorMemory = 0xC000;
+constexpr uint32_t kTextMemorySize = 0x2000;
+
+// Layer control bits
+constexpr uint8_t kLayerEnable = 0x01;
+
+constexpr uint32_t kTileSize = 16;
+constexpr uint32_t kTilesetWidth = 256;
+constexpr uint32_t kSpriteSize = 32;
+
+const struct {
+	uint32_t width, height;
+} kResolutions[4] = {
+	{ 640, 480 }, { 800, 600 }, { 640, 480 }, { 640, 400 },
+};
+
+uint32_t Get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+uint32_t Get24(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+uint32_t GetColor(const uint8_t *bgr)
+{
+	return bgr[0] | bgr[1] << 8 | bgr[2] << 16;
+}
+
+// dst[i] = lut[idx[i]] for all idx[i] != 0, 0 is transparent
+void ComposeIndexed(uint32_t *dst, const uint8_t *idx, const uint32_t *lut, uint32_t n)
+{
+	uint32_t i = 0;
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+	for(; i + 8 <= n; i += 8) {
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(idx + i)));
+		__m256i color = _mm256_i32gather_epi32((const int*)lut, index, 4);
+		__m256i old = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i transparent = _mm256_cmpeq_epi32(index, zero);
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(color, old, transparent));
+	}
+#endif
+	// Branch free so it vectorizes without AVX2 as well
+	for(; i < n; i++) {
+		uint32_t color = lut[idx[i]];
+		dst[i] = idx[i] ? color : dst[i];
+	}
+}
+
+}
+
+Vicky::Vicky(SystemBus *bus) : bus(bus), frame_buffer(kMaxWidth * kMaxHeight), line_buffer(kMaxWidth)
+{
+	sprites.reserve(kNumSprites);
+}
+
+void Vicky::OnWrite(uint32_t reg)
+{
+	if(reg >= kTextMemory && reg < kColorMemory + kTextMemorySize)
+		text_dirty |= 1ULL << ((reg & (kTextMemorySize - 1)) >> 7);
+	else if(reg < kLutsEnd || (reg >= kFont && reg < kFontEnd))
+		all_dirty = true;
+}
+
+void Vicky::PrepareFrame(const uint8_t *io, uint32_t vram_size)
+{
+	uint8_t ctrl = io[kMasterCtrl];
+	auto& res = kResolutions[io[kMasterCtrlHigh] & 3];
+	doubled = io[kMasterCtrlHigh] & 4;
+	if(res.width != frame_width || res.height != frame_height) {
+		frame_width = res.width;
+		frame_height = res.height;
+		all_dirty = true;
+	}
+
+	const uint8_t *border = io + kBorderCtrl;
+	border_x = border[0] & kLayerEnable ? std::min<uint32_t>(border[4], frame_width / 2) : 0;
+	border_y = border[0] & kLayerEnable ? std::min<uint32_t>(border[5], frame_height / 2) : 0;
+
+	// Tiles and sprites can come from anywhere in VRAM, anything that is
+	// visible can be cached only while none of it changed
+	bool graphics = (ctrl & kCtrlGraphics) && !(ctrl & kCtrlDisable);
+	if(graphics && (ctrl & (kCtrlTiles | kCtrlSprites)) && bus->IsDirtySince(vram_mark, kVramBase, vram_size))
+		all_dirty = true;
+	if(!all_dirty)
+		return;
+
+	for(uint32_t i = 0; i < 8; i++) {
+		for(uint32_t j = 0; j < 256; j++)
+			luts[i][j] = GetColor(io + kLuts + (i * 256 + j) * 4);
+	}
+	for(uint32_t i = 0; i < 16; i++) {
+		text_fg[i] = GetColor(io + kTextFgLut + i * 4);
+		text_bg[i] = GetColor(io + kTextBgLut + i * 4);
+	}
+
+	sprites.clear();
+	for(uint32_t i = 0; i < kNumSprites; i++) {
+		const uint8_t *regs = io + kSpriteRegs + i * 8;
+		Sprite s;
+		s.addr = Get24(regs + 1);
+		if(!(regs[0] & kLayerEnable) || s.addr + kSpriteSize * kSpriteSize > vram_size)
+			continue;
+		s.x = (int32_t)Get16(regs + 4);
+		s.y = (int32_t)Get16(regs + 6);
+		s.lut = (regs[0] >> 1) & 7;
+		s.depth = std::min((regs[0] >> 4) & 7, 4);
+		sprites.push_back(s);
+	}
+}
+
+bool Vicky::LineChanged(const uint8_t *io, uint32_t y) const
+{
+	uint8_t ctrl = io[kMasterCtrl];
+	if(ctrl & kCtrlDisable)
+		return false;
+
+	if((ctrl & kCtrlText) && text_dirty && y >= border_y) {
+		uint32_t cols = frame_width / 8;
+		uint32_t first = (y - border_y) / 8 * cols;
+		uint32_t last = std::min(first + cols, kTextMemorySize) - 1;
+		if(first < kTextMemorySize) {
+			uint64_t mask = (~0ULL >> (63 - (last >> 7))) & (~0ULL << (first >> 7));
+			if(text_dirty & mask)
+				return true;
+		}
+	}
+
+	if((ctrl & kCtrlGraphics) && (ctrl & kCtrlBitmap)) {
+		uint32_t width = frame_width >> doubled;
+		uint32_t sy = y >> doubled;
+		for(uint32_t i = 0; i < 2; i++) {
+			const uint8_t *regs = io + kBitmapRegs + i * 8;
+			if((regs[0] & kLayerEnable) && bus->IsDirtySince(vram_mark, kVramBase + Get24(regs + 1) + sy * width, width))
+				return true;
+		}
+	}
+	return false;
+}
+
+void Vicky::DrawTileLine(const uint8_t *io, const uint8_t *vram, uint32_t vram_size, uint32_t layer, uint32_t sy)
+{
+	const uint8_t *regs = io + kTileLayerRegs + layer * 12;
+	uint32_t map_addr = Get24(regs + 1);
+	uint32_t map_width = Get16(regs + 4);
+	uint32_t map_height = Get16(regs + 6);
+	if(!(regs[0] & kLayerEnable) || !map_width || !map_height || map_addr + map_width * map_height * 2 > vram_size)
+		return;
+
+	uint32_t ty = (sy + Get16(regs + 10)) % (map_height * kTileSize);
+	const uint8_t *map_row = vram + map_addr + ty / kTileSize * map_width * 2;
+	uint32_t tile_y = ty % kTileSize;
+	uint32_t width = frame_width >> doubled;
+	uint32_t tx = Get16(regs + 8) % (map_width * kTileSize);
+	for(uint32_t x = 0; x < width; ) {
+		uint32_t tile_x = tx % kTileSize;
+		uint32_t n = std::min(kTileSize - tile_x, width - x);
+		uint32_t entry = Get16(map_row + tx / kTileSize * 2);
+		uint32_t tile = entry & 0xFF;
+		uint32_t set_addr = Get24(io + kTilesetRegs + ((entry >> 8) & 7) * 4);
+		uint32_t src = set_addr + (tile / 16 * kTileSize + tile_y) * kTilesetWidth + tile % 16 * kTileSize + tile_x;
+		if(src + n <= vram_size)
+			ComposeIndexed(line_buffer.data() + x, vram + src, luts[(entry >> 11) & 7], n);
+		x += n;
+		tx += n;
+		if(tx == map_width * kTileSize)
+			tx = 0;
+	}
+}
+
+void Vicky::DrawSpriteLine(const uint8_t *vram, uint32_t depth, uint32_t sy)
+{
+	int32_t width = (int32_t)(frame_width >> doubled);
+	for(auto& s : sprites) {
+		int32_t row = (int32_t)sy - s.y;
+		if(s.depth != depth || row < 0 || row >= (int32_t)kSpriteSize || s.x >= width)
+			continue;
+		int32_t first = std::max(0, -s.x);
+		int32_t last = std::min((int32_t)kSpriteSize, width - s.x);
+		if(first < last)
+			ComposeIndexed(line_buffer.data() + s.x + first, vram + s.addr + row * kSpriteSize + first, luts[s.lut], last - first);
+	}
+}
+
+void Vicky::DrawTextLine(const uint8_t *io, uint32_t *out, uint32_t y, bool overlay)
+{
+	if(y < border_y || y >= frame_height - border_y)
+		return;
+	uint32_t cols = frame_width / 8;
+	uint32_t row = (y - border_y) / 8;
+	uint32_t font_row = (y - border_y) % 8;
+	const uint8_t *cursor = io + kCursorCtrl;
+	uint32_t cursor_col = (cursor[0] & kLayerEnable) && Get16(cursor + 6) == row ? Get16(cursor + 4) : ~0U;
+
+	for(uint32_t col = 0, x = border_x; x + 8 <= frame_width - border_x; col++, x += 8) {
+		uint32_t offset = row * cols + col;
+		if(offset >= kTextMemorySize)
+			break;
+		uint8_t ch = io[kTextMemory + offset];
+		uint8_t color = io[kColorMemory + offset];
+		if(col == cursor_col) {
+			ch = cursor[2];
+			color = cursor[3];
+		}
+		uint8_t bits = io[kFont + ch * 8 + font_row];
+		uint32_t fg = text_fg[color >> 4];
+		uint32_t bg = text_bg[color & 15];
+		for(uint32_t i = 0; i < 8; i++) {
+			uint32_t mask = 0U - ((bits >> (7 - i)) & 1);
+			uint32_t back = overlay ? out[x + i] : bg;
+			out[x + i] = (fg & mask) | (back & ~mask);
+		}
+	}
+}
+
+void Vicky::RenderLine(const uint8_t *io, const uint8_t *vram, uint32_t vram_size, uint32_t y)
+{
+	uint32_t *out = frame_buffer.data() + y * frame_width;
+	uint8_t ctrl = io[kMasterCtrl];
+	if(ctrl & kCtrlDisable) {
+		std::fill(out, out + frame_width, 0);
+		return;
+	}
+
+	uint32_t background = GetColor(io + kBackgroundColor);
+	bool graphics = ctrl & kCtrlGraphics;
+	if(graphics) {
+		uint32_t width = frame_width >> doubled;
+		uint32_t sy = y >> doubled;
+		uint32_t *line = line_buffer.data();
+		std::fill(line, line + width, background);
+
+		if(ctrl & kCtrlBitmap) {
+			for(uint32_t i = 2; i-- > 0; ) {
+				const uint8_t *regs = io + kBitmapRegs + i * 8;
+				uint32_t src = Get24(regs + 1) + sy * width;
+				if((regs[0] & kLayerEnable) && src + width <= vram_size)
+					ComposeIndexed(line, vram + src, luts[(regs[0] >> 1) & 7], width);
+			}
+		}
+		for(uint32_t depth = 5; depth-- > 0; ) {
+			if((ctrl & kCtrlTiles) && depth < 4)
+				DrawTileLine(io, vram, vram_size, depth, sy);
+			if(ctrl & kCtrlSprites)
+				DrawSpriteLine(vram, depth, sy);
+		}
+
+		if(doubled) {
+			for(uint32_t x = 0; x < width; x++)
+				out[x * 2] = out[x * 2 + 1] = line[x];
+		} else {
+			memcpy(out, line, width * sizeof(uint32_t));
+		}
+	} else {
+		std::fill(out, out + frame_width, background);
+	}
+
+	if(ctrl & kCtrlText)
+		DrawTextLine(io, out, y, graphics && (ctrl & kCtrlTextOverlay));
+
+	if(border_x || border_y) {
+		uint32_t border = GetColor(io + kBorderCtrl + 1);
+		if(y < border_y || y >= frame_height - border_y) {
+			std::fill(out, out + frame_width, border);
+		} else {
+			std::fill(out, out + border_x, border);
+			std::fill(out + frame_width - border_x, out + frame_width, border);
+		}
+	}
+}
+
+void Vicky::RenderFrame(const uint8_t *io, const uint8_t *vram, uint32_t vram_size)
+{
+	PrepareFrame(io, vram_size);
+	num_lines_rendered = 0;
+	for(uint32_t y = 0; y < frame_height; y++) {
+		if(!all_dirty && !LineChanged(io, y))
+			continue;
+		RenderLine(io, vram, vram_size, y);
+		num_lines_rendered++;
+	}
+	all_dirty = false;
+	text_dirty = 0;
+	vram_mark = bus->MarkDirtyEpoch();
+}
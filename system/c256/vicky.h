@@ -0,0 +1,82 @@
+#ifndef SYSTEM_C256_VICKY_H_
+#define SYSTEM_C256_VICKY_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "cpu.h"
+
+// VICKY II style video for the C256. Registers, LUTs, the font and text memory
+// live in the 64 kB I/O block at $AF0000, graphics data in VRAM at $B00000.
+// Frames are composited line by line into an XRGB8888 buffer. Lines whose
+// inputs did not change since the last frame are not drawn again.
+//
+// Back to front: background color, bitmap 1, bitmap 0, then for depth 4 to 0
+// tile layer 3 to 0 (there is no tile layer 4) followed by the sprites of that
+// depth, text and the border. Index 0 is transparent in all graphics layers.
+class Vicky
+{
+public:
+	static constexpr cpuaddr_t kVramBase = 0xB00000;
+	static constexpr uint32_t kMaxWidth = 800;
+	static constexpr uint32_t kMaxHeight = 600;
+
+	explicit Vicky(SystemBus *bus);
+
+	// Called after |reg| in the I/O block was written
+	void OnWrite(uint32_t reg);
+	// Draw everything on the next frame, for when memory was replaced
+	void Invalidate() { all_dirty = true; }
+
+	void RenderFrame(const uint8_t *io, const uint8_t *vram, uint32_t vram_size);
+
+	// width() pixels per line, no padding
+	const uint32_t* frame() const { return frame_buffer.data(); }
+	uint32_t width() const { return frame_width; }
+	uint32_t height() const { return frame_height; }
+	// Lines drawn by the last RenderFrame()
+	uint32_t lines_rendered() const { return num_lines_rendered; }
+
+private:
+	struct Sprite
+	{
+		uint32_t addr;
+		int32_t x, y;
+		uint32_t lut;
+		uint32_t depth;
+	};
+
+	void PrepareFrame(const uint8_t *io, uint32_t vram_size);
+	bool LineChanged(const uint8_t *io, uint32_t y) const;
+	void RenderLine(const uint8_t *io, const uint8_t *vram, uint32_t vram_size, uint32_t y);
+	void DrawTileLine(const uint8_t *io, const uint8_t *vram, uint32_t vram_size, uint32_t layer, uint32_t sy);
+	void DrawSpriteLine(const uint8_t *vram, uint32_t depth, uint32_t sy);
+	void DrawTextLine(const uint8_t *io, uint32_t *out, uint32_t y, bool overlay);
+
+	SystemBus *bus;
+	std::vector<uint32_t> frame_buffer;
+	// One graphics line before pixel doubling
+	std::vector<uint32_t> line_buffer;
+	uint32_t frame_width = 0;
+	uint32_t frame_height = 0;
+	uint32_t num_lines_rendered = 0;
+
+	// Per frame state taken from the registers
+	bool doubled = false;
+	uint32_t border_x = 0;
+	uint32_t border_y = 0;
+	uint32_t luts[8][256];
+	uint32_t text_fg[16];
+	uint32_t text_bg[16];
+	std::vector<Sprite> sprites;
+
+	// Registers, LUTs or the font changed
+	bool all_dirty = true;
+	// One bit per 128 bytes of text or color memory
+	uint64_t text_dirty = 0;
+	// SystemBus::MarkDirtyEpoch() after the last frame, for VRAM
+	uint64_t vram_mark = 0;
+};
+
+#endif
@@ -1,5 +1,8 @@
 #include "2c02.h"
 
+#include "hook_bus.h"
+#include "pixel_format.h"
+
 #include <memory.h>
 #include <assert.h>
 
@@ -75,6 +78,237 @@ RGB(0, 0, 0),
 RGB(0, 0, 0),
 };
 
+namespace {
+struct Xrgb8888Output
+{
+	static constexpr uint32_t kBytesPerPixel = 4;
+	static void Put(PPU_2C02 *ppu, uint8_t *p, uint8_t color)
+	{
+		memcpy(p, &ppu->rgb_palette[color], 4);
+	}
+};
+struct Pixel16Output
+{
+	static constexpr uint32_t kBytesPerPixel = 2;
+	static void Put(PPU_2C02 *ppu, uint8_t *p, uint8_t color)
+	{
+		uint16_t v = (uint16_t)ppu->rgb_palette[color];
+		memcpy(p, &v, 2);
+	}
+};
+struct NullOutput
+{
+	static constexpr uint32_t kBytesPerPixel = 0;
+	static void Put(PPU_2C02 *ppu, uint8_t *p, uint8_t color) {}
+};
+struct IndexedOutput
+{
+	static constexpr uint32_t kBytesPerPixel = 1;
+	static void Put(PPU_2C02 *ppu, uint8_t *p, uint8_t color)
+	{
+		*p = ppu->palette_indices[color] & ((ppu->mask & 1) ? 0x30 : 0x3F);
+	}
+};
+}
+
+const uint32_t* PPU_2C02::GetEmphasisPalette()
+{
+	static const struct Table {
+		Table()
+		{
+			for(uint32_t emphasis = 0; emphasis < 8; emphasis++) {
+				for(uint32_t i = 0; i < kEmphasisBankSize; i++) {
+					uint32_t rgb = global_rgb_palette[i];
+					uint32_t out = 0;
+					// Channels that are not emphasized get darkened
+					for(uint32_t channel = 0; channel < 3; channel++) {
+						uint32_t v = (rgb >> (16 - 8 * channel)) & 0xFF;
+						if(emphasis && !(emphasis & (1U << channel)))
+							v = v * 209 / 256;
+						out |= v << (16 - 8 * channel);
+					}
+					colors[emphasis * kEmphasisBankSize + i] = out;
+				}
+			}
+		}
+		uint32_t colors[8 * kEmphasisBankSize];
+	} table;
+	return table.colors;
+}
+
+uint32_t PPU_2C02::ResolveColor(uint8_t index) const
+{
+	uint8_t grey_mask = (mask & 1) ? 0x30 : 0x3F;
+	uint32_t rgb = GetEmphasisPalette()[(mask >> 5) * kEmphasisBankSize + (index & grey_mask)];
+	switch(palette_format) {
+	case kOutputRGB565:
+		return PackRgb565(rgb);
+	case kOutputXRGB1555:
+		return PackXrgb1555(rgb);
+	default:
+		return rgb;
+	}
+}
+
+OutputFormat PPU_2C02::PaletteFormatFor(OutputFormat format)
+{
+	switch(format) {
+	case kOutputRGB565:
+	case kOutputXRGB1555:
+		return format;
+	default:
+		return kOutputXRGB8888;
+	}
+}
+
+void PPU_2C02::UpdateRgbPalette()
+{
+	// Frames without output keep the palette of the visible ones
+	if(fb.format != kOutputNone)
+		palette_format = PaletteFormatFor(fb.format);
+	for(uint32_t i = 0; i < 32; i++)
+		rgb_palette[i] = ResolveColor(palette_indices[i]);
+}
+
+namespace {
+struct SaveData
+{
+	uint64_t last_ppu_cycle;
+	uint64_t ppu_cycle_of_next_nmi;
+	uint64_t ppu_frame_start_time;
+	uint64_t ppu_first_pixel_time;
+	uint64_t ppu_current_pixel_clock;
+	uint32_t current_scanline;
+	uint32_t current_pixel_clock;
+	uint32_t tile_x, tile_y;
+	uint32_t current, next, future;
+	uint32_t sprites[16];
+	uint32_t num_sprites;
+	uint32_t state;
+	uint32_t frame_id;
+	uint32_t x, y;
+	uint16_t vram_addr;
+	uint16_t reg_t;
+	uint16_t scroll_fine_x;
+	uint16_t sprite_pattern_addr;
+	uint16_t bg_pattern_addr;
+	uint16_t increment;
+	uint8_t palette_indices[32];
+	uint8_t oam[256];
+	uint8_t latch;
+	uint8_t ppudata_buffer;
+	uint8_t status;
+	uint8_t control;
+	uint8_t mask;
+	uint8_t oamaddr;
+	uint8_t addr_write;
+	uint8_t bg_enabled;
+	uint8_t sprite_enabled;
+	uint8_t rendering_enabled;
+	uint8_t tall_sprites;
+	uint8_t frame_produced;
+};
+}
+
+bool PPU_2C02::SaveState(std::vector<uint8_t> *out_data)
+{
+	size_t size = out_data->size();
+	out_data->resize(size + sizeof(SaveData));
+	SaveData *s = reinterpret_cast<SaveData*>(&(*out_data)[size]);
+	s->last_ppu_cycle = last_ppu_cycle;
+	s->ppu_cycle_of_next_nmi = ppu_cycle_of_next_nmi;
+	s->ppu_frame_start_time = ppu_frame_start_time;
+	s->ppu_first_pixel_time = ppu_first_pixel_time;
+	s->ppu_current_pixel_clock = ppu_current_pixel_clock;
+	s->current_scanline = current_scanline;
+	s->current_pixel_clock = current_pixel_clock;
+	s->tile_x = tile_x;
+	s->tile_y = tile_y;
+	s->current = current.u32;
+	s->next = next.u32;
+	s->future = future.u32;
+	for(uint32_t i = 0; i < 16; i++)
+		s->sprites[i] = sprites[i].data;
+	s->num_sprites = num_sprites;
+	s->state = state;
+	s->frame_id = frame_id;
+	s->x = x;
+	s->y = y;
+	s->vram_addr = vram_addr;
+	s->reg_t = reg_t;
+	s->scroll_fine_x = scroll_fine_x;
+	s->sprite_pattern_addr = sprite_pattern_addr;
+	s->bg_pattern_addr = bg_pattern_addr;
+	s->increment = increment;
+	memcpy(s->palette_indices, palette_indices, sizeof(palette_indices));
+	memcpy(s->oam, oam, sizeof(oam));
+	s->latch = latch;
+	s->ppudata_buffer = ppudata_buffer;
+	s->status = status;
+	s->control = control;
+	s->mask = mask;
+	s->oamaddr = oamaddr;
+	s->addr_write = addr_write;
+	s->bg_enabled = bg_enabled;
+	s->sprite_enabled = sprite_enabled;
+	s->rendering_enabled = rendering_enabled;
+	s->tall_sprites = tall_sprites;
+	s->frame_produced = frame_produced;
+	return true;
+}
+
+bool PPU_2C02::LoadState(const uint8_t **in_data, const uint8_t *end)
+{
+	if((size_t)(end - *in_data) < sizeof(SaveData))
+		return false;
+	SaveData s;
+	memcpy(&s, *in_data, sizeof(s));
+	*in_data += sizeof(SaveData);
+
+	last_ppu_cycle = s.last_ppu_cycle;
+	ppu_cycle_of_next_nmi = s.ppu_cycle_of_next_nmi;
+	ppu_frame_start_time = s.ppu_frame_start_time;
+	ppu_first_pixel_time = s.ppu_first_pixel_time;
+	ppu_current_pixel_clock = s.ppu_current_pixel_clock;
+	current_scanline = s.current_scanline;
+	current_pixel_clock = s.current_pixel_clock;
+	tile_x = s.tile_x;
+	tile_y = s.tile_y;
+	current.u32 = s.current;
+	next.u32 = s.next;
+	future.u32 = s.future;
+	for(uint32_t i = 0; i < 16; i++)
+		sprites[i].data = s.sprites[i];
+	num_sprites = s.num_sprites;
+	state = (PPUSTATE)s.state;
+	frame_id = s.frame_id;
+	x = s.x;
+	y = s.y;
+	vram_addr = s.vram_addr;
+	reg_t = s.reg_t;
+	scroll_fine_x = s.scroll_fine_x;
+	sprite_pattern_addr = s.sprite_pattern_addr;
+	bg_pattern_addr = s.bg_pattern_addr;
+	increment = s.increment;
+	memcpy(palette_indices, s.palette_indices, sizeof(palette_indices));
+	memcpy(oam, s.oam, sizeof(oam));
+	latch = s.latch;
+	ppudata_buffer = s.ppudata_buffer;
+	status = s.status;
+	control = s.control;
+	mask = s.mask;
+	oamaddr = s.oamaddr;
+	addr_write = s.addr_write;
+	bg_enabled = s.bg_enabled != 0;
+	sprite_enabled = s.sprite_enabled != 0;
+	rendering_enabled = s.rendering_enabled != 0;
+	tall_sprites = s.tall_sprites != 0;
+	frame_produced = s.frame_produced != 0;
+
+	UpdateRgbPalette();
+	return true;
+}
+
 void PPU_2C02::PowerOn()
 {
 	Reset();
@@ -281,6 +515,8 @@ void PPU_2C02::PpuStep()
 			state = FETCH_SCANLINE_START;
 			current_pixel_clock = 0;
 			current_scanline++;
+			if(hooks)
+				hooks->Post(HookBus::kScanline, *cpu_cycle, current_scanline);
 			if(current_scanline > num_render_scanlines) {
 				frame_produced = true;
 				state = POSTRENDER_SCANLINE;
@@ -308,6 +544,8 @@ void PPU_2C02::PpuStep()
 				current_scanline = 0;
 				state = FETCH_SCANLINE_START;
 			}
+			if(hooks)
+				hooks->Post(HookBus::kScanline, *cpu_cycle, current_scanline);
 		}
 		return;
 	}
@@ -387,12 +625,35 @@ void PPU_2C02::IncrVert()
 }
 
 void PPU_2C02::DrawPixels()
+{
+	switch(fb.format) {
+	case kOutputIndexed:
+		DrawPixelsTo<IndexedOutput>();
+		break;
+	case kOutputRGB565:
+	case kOutputXRGB1555:
+		DrawPixelsTo<Pixel16Output>();
+		break;
+	case kOutputNone:
+		// Colors still have to be evaluated for sprite 0 hits
+		DrawPixelsTo<NullOutput>();
+		break;
+	default:
+		DrawPixelsTo<Xrgb8888Output>();
+		break;
+	}
+}
+
+template<typename Output>
+void PPU_2C02::DrawPixelsTo()
 {
 	if(current_pixel_clock > 256)
 		return;
 	uint32_t x = current_pixel_clock - 8;
 	uint32_t y = current_scanline - 1;
-	uint8_t *p = fb.video_frame + fb.stride*y + x * 4;
+	uint8_t *p = Output::kBytesPerPixel ? fb.video_frame + fb.stride*y + x * Output::kBytesPerPixel : nullptr;
+	if(fb.line_emphasis)
+		fb.line_emphasis[y] = mask >> 5;
 
 	auto get_color = [&]() -> uint8_t {
 		unsigned color = 0;
@@ -433,27 +694,71 @@ void PPU_2C02::DrawPixels()
 
 	unsigned n = 8 - scroll_fine_x;
 
-	for(unsigned i = 0; i < n; i++, x++, p+=4) {
+	for(unsigned i = 0; i < n; i++, x++, p += Output::kBytesPerPixel) {
 		uint8_t color = get_color();
-		memcpy(p, &rgb_palette[color], 4);
+		Output::Put(this, p, color);
 	}
 
 	current = next;
-	for(unsigned i = n; i < 8; i++, x++, p+=4) {
+	for(unsigned i = n; i < 8; i++, x++, p += Output::kBytesPerPixel) {
 		uint8_t color = get_color();
-		memcpy(p, &rgb_palette[color], 4);
+		Output::Put(this, p, color);
 	}
 }
 
 void PPU_2C02::CatchUpToCpu()
 {
 	uint64_t current_cycle = *cpu_cycle;
+	STATS_INC(num_catch_ups);
 	while(last_ppu_cycle < current_cycle) {
 		last_ppu_cycle += ppu_clock_size;
+		STATS_INC(num_catch_up_steps);
 		PpuStep();
 	}
 }
 
+uint64_t PPU_2C02::NextStatusChange(bool status_read) const
+{
+	// Lines with rendering may be a dot short or wait for an even dot, so count
+	// them as shorter than they are
+	constexpr uint32_t kMinDotsPerLine = 339;
+	uint32_t s = current_scanline;
+	uint32_t d = current_pixel_clock;
+	uint64_t dots = ~0ULL;
+	auto until = [&](uint32_t line, uint32_t dot) {
+		if(line < s || (line == s && dot < d))
+			line += total_scanlines;
+		uint64_t n = (uint64_t)(line - s) * kMinDotsPerLine + dot;
+		dots = std::min(dots, n > d ? n - d : 0);
+	};
+
+	// Vblank is flagged on dot 1, NMI follows on dot 4
+	if(status_read || (control & 0x80))
+		until(num_render_scanlines + num_postrender_scanlines, 1);
+	if(status_read && status)
+		until(0, 0);
+	if(status_read && !(status & 0x40) && bg_enabled && sprite_enabled) {
+		// Sprites are drawn on the line after the one they are evaluated for, and
+		// the last evaluation of a frame is drawn on line 1 of the next one
+		uint32_t first = typed_oam[0].y + 2;
+		uint32_t last = first + (tall_sprites ? 15 : 7);
+		if(first <= num_render_scanlines) {
+			if(s >= first && s <= last)
+				return *cpu_cycle;
+			until(first, 0);
+		}
+		if(last >= num_render_scanlines) {
+			if(s == 1)
+				return *cpu_cycle;
+			until(1, 0);
+		}
+	}
+	if(dots == ~0ULL)
+		return ~0ULL;
+	// A step shows once the CPU is past the cycle before it
+	return last_ppu_cycle + dots * ppu_clock_size;
+}
+
 void PPU_2C02::OamDma(SystemBus *bus, uint16_t base, uint32_t rate)
 {
 	CatchUpToCpu();
@@ -504,7 +809,12 @@ void PPU_2C02::WritePPU(void *self, uint32_t addr, uint8_t value)
 		ppu->bg_pattern_addr = (value & 0x10) ? 0x1000 : 0;
 		break;
 	case 1: // PPUMASK
+	{
+		uint8_t changed = ppu->mask ^ value;
 		ppu->mask = value;
+		// Greyscale and emphasis bits change the resolved colors
+		if(changed & 0xE1)
+			ppu->UpdateRgbPalette();
 		if(ppu->rendering_enabled) {
 			if(!(value & 0x18))
 				ppu->rendering_enabled = false;
@@ -514,6 +824,7 @@ void PPU_2C02::WritePPU(void *self, uint32_t addr, uint8_t value)
 		ppu->bg_enabled = !!(value & 8);
 		ppu->sprite_enabled = !!(value & 0x10);
 		break;
+	}
 	case 3:
 		if(ppu->rendering_enabled) {
 			panic();
@@ -580,7 +891,7 @@ void PPU_2C02::Write(uint32_t addr, uint8_t value)
 			b ^= 0x10;
 		value &= 0x3F;
 		palette_indices[b] = value;
-		rgb_palette[b] = global_rgb_palette[value];
+		rgb_palette[b] = ResolveColor(value);
 	} else {
 		WriteByte(addr, value);
 	}
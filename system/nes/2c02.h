@@ -43,10 +43,26 @@ enum PPUSTATE {
 	RENDER_DISABLED_SCANLINE,
 };
 
+enum OutputFormat {
+	// 32 bit pixels resolved through rgb_palette
+	kOutputXRGB8888,
+	// One byte per pixel holding the 6 bit palette index. The emphasis bits of
+	// PPUMASK are written per line to |line_emphasis|, and the frame is resolved
+	// later through GetEmphasisPalette().
+	kOutputIndexed,
+	// 16 bit pixels resolved through rgb_palette
+	kOutputRGB565,
+	kOutputXRGB1555,
+	// Nothing is written, e.g. for frames emulated while running ahead
+	kOutputNone,
+};
+
 struct Framebuffer
 {
 	uint32_t width, height, stride;
 	uint8_t *video_frame;
+	OutputFormat format = kOutputXRGB8888;
+	uint8_t *line_emphasis = nullptr;
 };
 
 struct PPU_2C02 : public SystemBus
@@ -60,12 +76,27 @@ struct PPU_2C02 : public SystemBus
 
 	void EvaluateSprites();
 	void DrawPixels();
+	template<typename Output>
+	void DrawPixelsTo();
+	void UpdateRgbPalette();
+	uint32_t ResolveColor(uint8_t index) const;
+	static OutputFormat PaletteFormatFor(OutputFormat format);
+
+	// 8 banks of 64 XRGB8888 colors, one bank per combination of emphasis bits
+	static constexpr uint32_t kEmphasisBankSize = 64;
+	static const uint32_t* GetEmphasisPalette();
 
 	void IncrHoriz();
 	void IncrVert();
 
+	bool SaveState(std::vector<uint8_t> *out_data);
+	bool LoadState(const uint8_t **in_data, const uint8_t *end);
+
 	void OamDma(SystemBus *bus, uint16_t base, uint32_t rate);
 	void CatchUpToCpu();
+	// First CPU cycle at which a read of STATUS may see a change, or an NMI may
+	// be raised. Errs on the early side, ~0 if nothing is coming.
+	uint64_t NextStatusChange(bool status_read) const;
 
 	uint8_t Read(uint32_t addr);
 	void Write(uint32_t addr, uint8_t value);
@@ -92,6 +123,9 @@ struct PPU_2C02 : public SystemBus
 	EventQueue *event_queue;
 	const uint64_t *cpu_cycle;
 	uint64_t last_ppu_cycle = 0;
+	// CatchUpToCpu() calls and the PPU cycles they ran
+	uint64_t num_catch_ups = 0;
+	uint64_t num_catch_up_steps = 0;
 	uint32_t nominal_ppu_frame_time;
 	uint64_t ppu_cycle_of_next_nmi;
 	uint32_t ppu_clock_size;
@@ -124,7 +158,9 @@ struct PPU_2C02 : public SystemBus
 	tile_data current, next, future;
 
 	uint8_t palette_indices[32];
+	// Colors in the pixel format of |palette_format|
 	uint32_t rgb_palette[32];
+	OutputFormat palette_format = kOutputXRGB8888;
 
 	struct sprite
 	{
@@ -1,5 +1,10 @@
 #include "nes.h"
 
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+
 namespace nes {
 
 Nes::Nes() : cpu(&main_bus)
@@ -8,6 +13,8 @@ Nes::Nes() : cpu(&main_bus)
 	ppu.cpu_cycle = &cpu.cpu_state.cycle;
 	ppu.assert_nmi = &AssertNMI;
 	ppu.assert_nmi_context = this;
+	main_bus.hooks = &hooks;
+	ppu.hooks = &hooks;
 }
 
 void Nes::Step()
@@ -22,20 +29,24 @@ void Nes::Run()
 	cpu.cpu_state.cycle_stop = current_frame_start_cycle + master_clocks_per_frame;
 	cpu.EmulateWithCycleProcessing(*this, &event_queue);
 	current_frame_start_cycle += master_clocks_per_frame;
+	hooks.Post(HookBus::kFrameEnd, cpu.cpu_state.cycle, ppu.frame_id);
+	hooks.Dispatch();
 }
 void Nes::RunForOneFrame(Framebuffer *fb)
 {
 	ppu.fb = *fb;
+	if(fb->format != kOutputNone && PPU_2C02::PaletteFormatFor(fb->format) != ppu.palette_format)
+		ppu.UpdateRgbPalette();
 	Run();
 }
 
 
 bool Nes::LoadRom(std::shared_ptr<Rom> rom)
 {
-	if(!rom->GetConfig("DISPLAY", &system))
+	if(!rom->GetConfig(Rom::kConfigDisplay, &system))
 		return false;
 	uint32_t mapper_num;
-	if(!rom->GetConfig("MAPPER", &mapper_num))
+	if(!rom->GetConfig(Rom::kConfigMapper, &mapper_num))
 		return false;
 
 	uint32_t master_frequency;
@@ -75,6 +86,7 @@ bool Nes::LoadRom(std::shared_ptr<Rom> rom)
 	main_bus.io_devices.is_io_device_address = &IsIoDeviceAddress;
 	main_bus.io_devices.read = &IoRead;
 	main_bus.io_devices.write = &IoWrite;
+	main_bus.io_devices.quiet_until = &IoQuietUntil;
 	main_bus.io_devices.irq_taken = [](void *context, uint32_t type) {
 		((Nes*)context)->cpu.cpu_state.ClearInterruptSource(type);
 	};
@@ -112,6 +124,218 @@ void Nes::Reset()
 	ppu.Reset();
 }
 
+namespace {
+constexpr uint32_t kSaveMagic = 0x5353454E; // "NESS"
+constexpr uint32_t kSaveVersion = 1;
+
+struct SaveData
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t current_frame_start_cycle;
+	uint32_t frame_id;
+	uint32_t controller_latch;
+	NesInputData latched_input_data;
+	uint8_t sysram[2048];
+};
+
+bool SaveMemory(std::vector<uint8_t> *out_data, NativeMemory *mem)
+{
+	if(!mem)
+		return true;
+	size_t size = out_data->size();
+	out_data->resize(size + mem->GetSize());
+	memcpy(&(*out_data)[size], mem->Pointer(), mem->GetSize());
+	return true;
+}
+
+bool LoadMemory(const uint8_t **in_data, const uint8_t *end, NativeMemory *mem)
+{
+	if(!mem)
+		return true;
+	if((size_t)(end - *in_data) < mem->GetSize())
+		return false;
+	memcpy(mem->Pointer(), *in_data, mem->GetSize());
+	*in_data += mem->GetSize();
+	return true;
+}
+
+// Everything but the RAM
+void SaveHeader(const Nes& nes, SaveData *s)
+{
+	s->magic = kSaveMagic;
+	s->version = kSaveVersion;
+	s->current_frame_start_cycle = nes.current_frame_start_cycle;
+	s->frame_id = nes.frame_id;
+	s->controller_latch = nes.controller_latch ? 1 : 0;
+	s->latched_input_data = nes.latched_input_data;
+}
+}
+
+bool Nes::SaveState(std::vector<uint8_t> *out_data)
+{
+	size_t size = out_data->size();
+	out_data->resize(size + sizeof(SaveData));
+	SaveData *s = reinterpret_cast<SaveData*>(&(*out_data)[size]);
+	SaveHeader(*this, s);
+	memcpy(s->sysram, sysram, sizeof(sysram));
+
+	return cpu.SaveState(out_data) &&
+		ppu.SaveState(out_data) &&
+		SaveMemory(out_data, chr_ram.get()) &&
+		SaveMemory(out_data, chr_nvram.get()) &&
+		SaveMemory(out_data, prg_nvram.get()) &&
+		mapper->SaveState(out_data) &&
+		event_queue.SaveState(out_data);
+}
+
+bool Nes::LoadState(const uint8_t **in_data, const uint8_t *end)
+{
+	if((size_t)(end - *in_data) < sizeof(SaveData))
+		return false;
+	SaveData s;
+	memcpy(&s, *in_data, sizeof(s));
+	if(s.magic != kSaveMagic || s.version != kSaveVersion)
+		return false;
+	*in_data += sizeof(SaveData);
+
+	current_frame_start_cycle = s.current_frame_start_cycle;
+	frame_id = s.frame_id;
+	controller_latch = s.controller_latch != 0;
+	latched_input_data = s.latched_input_data;
+	memcpy(sysram, s.sysram, sizeof(sysram));
+
+	// No NES device schedules tagged events yet
+	auto resolve = [](uint32_t tag) -> std::function<void()> { return nullptr; };
+	// Memory was replaced behind the back of the buses
+	main_bus.MarkDirty(0, 0x10000);
+	ppu.MarkDirty(0, 0x4000);
+	return cpu.LoadState(in_data, end) &&
+		ppu.LoadState(in_data, end) &&
+		LoadMemory(in_data, end, chr_ram.get()) &&
+		LoadMemory(in_data, end, chr_nvram.get()) &&
+		LoadMemory(in_data, end, prg_nvram.get()) &&
+		mapper->LoadState(in_data, end) &&
+		event_queue.LoadState(in_data, end, resolve);
+}
+
+bool Nes::UpdateState(std::vector<uint8_t> *state, std::vector<std::pair<size_t, size_t>> *changed)
+{
+	// Devices are saved every time, they are small
+	state_scratch.clear();
+	if(!cpu.SaveState(&state_scratch) || !ppu.SaveState(&state_scratch))
+		return false;
+	size_t offset = sizeof(SaveData) + state_scratch.size();
+
+	state_memory.clear();
+	state_memory.push_back({sysram, sizeof(sysram), offsetof(SaveData, sysram)});
+	for(NativeMemory *mem : {chr_ram.get(), chr_nvram.get(), prg_nvram.get()}) {
+		if(mem) {
+			state_memory.push_back({mem->Pointer(), mem->GetSize(), offset});
+			offset += mem->GetSize();
+		}
+	}
+	// Mappers that do not tell where their memory is are saved every time too
+	size_t devices_size = state_scratch.size();
+	state_blocks.clear();
+	if(mapper->GetStateMemory(&state_blocks)) {
+		for(auto& b : state_blocks) {
+			state_memory.push_back({b.first, b.second, offset});
+			offset += b.second;
+		}
+	} else {
+		if(!mapper->SaveState(&state_scratch))
+			return false;
+		offset += state_scratch.size() - devices_size;
+	}
+
+	if(state->size() < offset || state_tail != offset) {
+		state->clear();
+		if(!SaveState(state))
+			return false;
+		changed->emplace_back(0, state->size());
+	} else {
+		SaveHeader(*this, reinterpret_cast<SaveData*>(state->data()));
+		changed->emplace_back(0, offsetof(SaveData, sysram));
+		memcpy(state->data() + sizeof(SaveData), state_scratch.data(), devices_size);
+		changed->emplace_back(sizeof(SaveData), devices_size);
+		size_t mapper_size = state_scratch.size() - devices_size;
+		memcpy(state->data() + offset - mapper_size, state_scratch.data() + devices_size, mapper_size);
+		changed->emplace_back(offset - mapper_size, mapper_size);
+		CopyDirtyState(&main_bus, state_main_mark, state->data(), changed);
+		CopyDirtyState(&ppu, state_ppu_mark, state->data(), changed);
+
+		// The event queue changes size
+		state->resize(offset);
+		if(!event_queue.SaveState(state))
+			return false;
+		changed->emplace_back(offset, state->size() - offset);
+	}
+	state_tail = offset;
+	state_main_mark = main_bus.MarkDirtyEpoch();
+	state_ppu_mark = ppu.MarkDirtyEpoch();
+	return true;
+}
+
+void Nes::CopyDirtyState(SystemBus *bus, uint64_t mark, uint8_t *state, std::vector<std::pair<size_t, size_t>> *changed)
+{
+	state_dirty.clear();
+	bus->GetDirtyRanges(mark, &state_dirty);
+	for(auto& range : state_dirty) {
+		for(uint32_t i = 0; i < range.second; i += bus->memory.page_size) {
+			const uint8_t *ptr = bus->memory.pages[(range.first + i) >> bus->memory.page_shift].ptr;
+			// ROM and I/O pages are not part of the state
+			for(auto& m : state_memory) {
+				if(ptr < m.ptr || ptr >= m.ptr + m.size)
+					continue;
+				size_t pos = ptr - m.ptr;
+				size_t len = std::min<size_t>(bus->memory.page_size, m.size - pos);
+				memcpy(state + m.offset + pos, ptr, len);
+				changed->emplace_back(m.offset + pos, len);
+				break;
+			}
+		}
+	}
+}
+
+std::unique_ptr<Nes> Nes::Fork()
+{
+	// All writable NES memory is a few kB, so it is cheaper to copy it through a
+	// snapshot than to remap it
+	std::vector<uint8_t> state;
+	if(!SaveState(&state))
+		return nullptr;
+	auto child = std::make_unique<Nes>();
+	if(!child->LoadRom(current_rom))
+		return nullptr;
+	const uint8_t *p = state.data();
+	if(!child->LoadState(&p, p + state.size()))
+		return nullptr;
+	child->update_controllers = update_controllers;
+	child->SetIdleLoopSkipping(cpu.idle_loops.enabled());
+	return child;
+}
+
+void Nes::GetStats(StatsList *stats)
+{
+	cpu.GetStats(stats);
+	main_bus.GetStats("bus", stats);
+	ppu.GetStats("ppu_bus", stats);
+	event_queue.GetStats(stats);
+	stats->emplace_back("ppu.catch_ups", ppu.num_catch_ups);
+	stats->emplace_back("ppu.catch_up_steps", ppu.num_catch_up_steps);
+}
+
+void Nes::ResetStats()
+{
+	cpu.ResetStats();
+	main_bus.ResetStats();
+	ppu.ResetStats();
+	event_queue.ResetStats();
+	ppu.num_catch_ups = 0;
+	ppu.num_catch_up_steps = 0;
+}
+
 void Nes::SetUpdateControllersFunc(std::function<void(NesInputData*)> fn)
 {
 	update_controllers = std::move(fn);
@@ -140,6 +364,7 @@ void Nes::AssertNMI(void *context)
 {
 	Nes *self = (Nes*)context;
 	self->cpu.cpu_state.SetInterruptSource(2);
+	self->hooks.Post(HookBus::kInterrupt, self->cpu.cpu_state.cycle, 2);
 }
 
 void Nes::ReadReg(uint32_t reg, uint8_t *v)
@@ -209,4 +434,30 @@ void Nes::IoWrite(void *context, cpuaddr_t addr, const uint8_t *data, uint32_t s
 	}
 }
 
+uint64_t Nes::IoQuietUntil(void *context, const cpuaddr_t *reads, uint32_t num_reads, uint64_t cycle)
+{
+	Nes *self = (Nes*)context;
+	bool status_read = false;
+	for(uint32_t i = 0; i < num_reads; i++) {
+		cpuaddr_t addr = reads[i];
+		if(addr < 0x4000) {
+			// PPUDATA reads move the VRAM address, the rest only return the
+			// latch or OAM
+			if((addr & 7) == 7)
+				return cycle;
+			status_read |= (addr & 7) == 2;
+		} else if(addr == 0x4016 || addr == 0x4017) {
+			// Reads shift the controller bits until all are out
+			for(auto bits: self->latched_input_data.devices[addr & 1].serial_bits) {
+				if(bits)
+					return cycle;
+			}
+		} else if(addr > 0x401F) {
+			// Mapper registers
+			return cycle;
+		}
+	}
+	return self->ppu.NextStatusChange(status_read);
+}
+
 }
@@ -3,6 +3,7 @@
 
 #include "rom.h"
 #include "cpu/65816/cpu_65c816.h"
+#include "hook_bus.h"
 
 #include "2c02.h"
 #include "nes_mapper.h"
@@ -45,8 +46,29 @@ public:
 
 	void Reset();
 
+	// Snapshots of the whole machine. Appending to a vector with enough capacity
+	// does not allocate, so this is cheap enough to do every frame.
+	bool SaveState(std::vector<uint8_t> *out_data);
+	bool LoadState(const uint8_t **in_data, const uint8_t *end);
+	// Like SaveState(), for taking one every frame. |state| holds what the last
+	// call left in it and only the devices and the memory pages written since
+	// are saved again. Their (offset, size) ranges are appended to |changed|.
+	// An empty |state| gets a full snapshot.
+	bool UpdateState(std::vector<uint8_t> *state, std::vector<std::pair<size_t, size_t>> *changed);
+
+	// Clones the running machine, ROM data is shared. The clone is independent
+	// and can run on another thread.
+	std::unique_ptr<Nes> Fork();
+
+	void GetStats(StatsList *stats);
+	void ResetStats();
+
 	bool is_ntsc() const { return system == 0; }
 
+	// Skips loops that wait for vblank or NMI, see IdleLoopDetector. Off for
+	// accuracy tests.
+	void SetIdleLoopSkipping(bool enable) { cpu.idle_loops.SetEnabled(enable); }
+
 	void PreCpuCycle() { }
 	void PostCpuCycle() { ppu.CatchUpToCpu(); }
 
@@ -54,6 +76,7 @@ public:
 	static bool IsIoDeviceAddress(void *context, cpuaddr_t addr);
 	static void IoRead(void *context, cpuaddr_t addr, uint8_t *data, uint32_t size);
 	static void IoWrite(void *context, cpuaddr_t addr, const uint8_t *data, uint32_t size);
+	static uint64_t IoQuietUntil(void *context, const cpuaddr_t *reads, uint32_t num_reads, uint64_t cycle);
 
 	static void AssertNMI(void *context);
 
@@ -78,6 +101,9 @@ public:
 	WDC65C816 cpu;
 	SystemBus main_bus;
 	EventQueue event_queue;
+	// Frame end, scanline, NMI and watched write events, dispatched after
+	// every frame
+	HookBus hooks;
 
 	PPU_2C02 ppu;
 
@@ -94,6 +120,23 @@ public:
 	std::unique_ptr<NativeMemory> chr_ram;
 	std::unique_ptr<NativeMemory> chr_nvram;
 	std::unique_ptr<NativeMemory> prg_nvram;
+
+	// For UpdateState()
+	struct StateMemory
+	{
+		const uint8_t *ptr;
+		size_t size;
+		size_t offset;
+	};
+	void CopyDirtyState(SystemBus *bus, uint64_t mark, uint8_t *state, std::vector<std::pair<size_t, size_t>> *changed);
+	uint64_t state_main_mark = 0;
+	uint64_t state_ppu_mark = 0;
+	// Offset of the event queue in the last state
+	size_t state_tail = 0;
+	std::vector<StateMemory> state_memory;
+	std::vector<std::pair<const uint8_t*, size_t>> state_blocks;
+	std::vector<std::pair<cpuaddr_t, uint32_t>> state_dirty;
+	std::vector<uint8_t> state_scratch;
 };
 
 }
@@ -5,10 +5,11 @@ namespace {
 bool reg = LibRetroSystem::RegisterType<NesLibretro>(std::vector<std::string>{"nes"});
 }
 
-LibRetroSystem* NesLibretro::Load(const uint8_t *data, size_t size)
+LibRetroSystem* NesLibretro::Load(const uint8_t *data, size_t size, const char *path)
 {
-	auto rom = Rom::LoadRom(data, size);
-	if(rom->GetType() == "nes")
+	// Instances started from the same file share its pages
+	auto rom = Rom::LoadRom(data, size, path);
+	if(rom && rom->GetType() == "nes")
 		return new NesLibretro(rom);
 	return nullptr;
 }
@@ -75,6 +76,17 @@ void NesLibretro::Tick(LibretroFramebuffer *fb)
 	nes_fb.width = fb->width;
 	nes_fb.stride = fb->pitch;
 	nes_fb.video_frame = fb->data;
+	if(!fb->data)
+		nes_fb.format = kOutputNone;
+	else if(fb->indexed)
+		nes_fb.format = kOutputIndexed;
+	else if(fb->format == RETRO_PIXEL_FORMAT_RGB565)
+		nes_fb.format = kOutputRGB565;
+	else if(fb->format == RETRO_PIXEL_FORMAT_0RGB1555)
+		nes_fb.format = kOutputXRGB1555;
+	else
+		nes_fb.format = kOutputXRGB8888;
+	nes_fb.line_emphasis = fb->indexed ? fb->line_palette_bank : nullptr;
 //	memset(fb->data, 0, fb->pitch * fb->height);
 	nes.RunForOneFrame(&nes_fb);
 }
@@ -89,5 +101,23 @@ void NesLibretro::Reset()
 void NesLibretro::UpdateController(uint32_t port, uint32_t device)
 {
 }
+const uint32_t* NesLibretro::GetIndexedPalette(uint32_t *bank_size, uint32_t *num_banks)
+{
+	*bank_size = PPU_2C02::kEmphasisBankSize;
+	*num_banks = 8;
+	return PPU_2C02::GetEmphasisPalette();
+}
+bool NesLibretro::SaveState(std::vector<uint8_t> *out_data)
+{
+	return nes.SaveState(out_data);
+}
+bool NesLibretro::LoadState(const uint8_t **in_data, const uint8_t *end)
+{
+	return nes.LoadState(in_data, end);
+}
+bool NesLibretro::UpdateState(std::vector<uint8_t> *state, std::vector<std::pair<size_t, size_t>> *changed)
+{
+	return nes.UpdateState(state, changed);
+}
 
 }
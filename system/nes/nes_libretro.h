@@ -10,7 +10,7 @@ namespace nes {
 class NesLibretro : public LibRetroSystem
 {
 public:
-	static LibRetroSystem* Load(const uint8_t *data, size_t size);
+	static LibRetroSystem* Load(const uint8_t *data, size_t size, const char *path);
 
 	NesLibretro(std::shared_ptr<Rom> rom);
 
@@ -23,6 +23,10 @@ public:
 	bool IsNtsc() override;
 	void Reset() override;
 	void UpdateController(uint32_t port, uint32_t device) override;
+	const uint32_t* GetIndexedPalette(uint32_t *bank_size, uint32_t *num_banks) override;
+	bool SaveState(std::vector<uint8_t> *out_data) override;
+	bool LoadState(const uint8_t **in_data, const uint8_t *end) override;
+	bool UpdateState(std::vector<uint8_t> *state, std::vector<std::pair<size_t, size_t>> *changed) override;
 
 private:
 	void UpdateControllers(NesInputData *input);
@@ -1,5 +1,7 @@
 #include "nes_mapper.h"
 
+#include <string.h>
+
 namespace nes {
 
 class Mapper0 : public Mapper
@@ -17,8 +19,8 @@ public:
 			return false;
 
 		uint32_t vram_config = 0;
-		rom->GetConfig("VRAM CONFIG", &vram_config);
-		vram = NativeMemory::Create(0x1000);
+		rom->GetConfig(Rom::kConfigVramConfig, &vram_config);
+		vram = NativeMemory::Create(kVramSize);
 		// Map VRAM in mirroring modes
 		if(vram_config == 0) {
 			// vertical mirror
@@ -57,6 +59,29 @@ public:
 		}
 		return true;
 	}
+
+	bool SaveState(std::vector<uint8_t> *out_data) override
+	{
+		size_t size = out_data->size();
+		out_data->resize(size + kVramSize);
+		memcpy(&(*out_data)[size], vram->Pointer(), kVramSize);
+		return true;
+	}
+	bool LoadState(const uint8_t **in_data, const uint8_t *end) override
+	{
+		if((size_t)(end - *in_data) < kVramSize)
+			return false;
+		memcpy(vram->Pointer(), *in_data, kVramSize);
+		*in_data += kVramSize;
+		return true;
+	}
+	bool GetStateMemory(std::vector<std::pair<const uint8_t*, size_t>> *blocks) override
+	{
+		blocks->emplace_back(vram->Pointer(), kVramSize);
+		return true;
+	}
+
+	static constexpr uint32_t kVramSize = 0x1000;
 	std::unique_ptr<NativeMemory> vram;
 };
 
@@ -2,6 +2,7 @@
 #define NES_MAPPER_H_
 
 #include <memory>
+#include <vector>
 
 #include "cpu.h"
 #include "rom.h"
@@ -21,6 +22,12 @@ public:
 
 	virtual bool IoRead(uint32_t addr, uint8_t *data) { return false; }
 	virtual bool IoWrite(uint32_t addr, uint8_t data) { return false; }
+
+	virtual bool SaveState(std::vector<uint8_t> *out_data) { return true; }
+	virtual bool LoadState(const uint8_t **in_data, const uint8_t *end) { return true; }
+	// Memory that SaveState() stores as is and in order, when that is all it
+	// stores. Lets snapshots taken every frame copy only the pages written.
+	virtual bool GetStateMemory(std::vector<std::pair<const uint8_t*, size_t>> *blocks) { return false; }
 };
 
 }
@@ -0,0 +1,92 @@
+#include "lua_interface/lua_cpu.h"
+#include "lua_interface/lua_state.h"
+#include "rom.h"
+#include "system/nes/nes.h"
+
+#include "lua.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Runs a NES on its own thread and uses the Lua CPU interface from this one
+// while a frame_end hook is set. The hook needs the Lua state on the emulation
+// thread, so every call that waits for that thread has to let go of the state
+// or the test hangs until ctest times it out.
+
+namespace {
+// Every run of the script needs more frames, so it cannot pass without the
+// hook running between its calls
+const char *kScript = R"(
+local frames = 0
+cpu:set_hook("frame_end", function(p) frames = frames + p.count end)
+while frames < 5 do cpu:peek(0) end
+cpu:pause()
+local paused_at = frames
+cpu:resume()
+while frames < paused_at + 5 do cpu:poke(0x10, frames % 256) end
+while frames < paused_at + 10 do cpu:get_stats() end
+cpu:set_hook("frame_end", nil)
+)";
+
+// NROM with JMP $C000 at $C000 and every vector pointing there
+std::shared_ptr<Rom> LoopRom()
+{
+	std::vector<uint8_t> image(16 + 0x4000 + 0x2000);
+	memcpy(image.data(), "NES\x1A", 4);
+	image[4] = 1;
+	image[5] = 1;
+	uint8_t *prg = &image[16];
+	const uint8_t loop[] = {0x4C, 0x00, 0xC0};
+	memcpy(prg, loop, sizeof(loop));
+	for(uint32_t vector = 0x3FFA; vector < 0x4000; vector += 2) {
+		prg[vector] = 0x00;
+		prg[vector + 1] = 0xC0;
+	}
+	return Rom::LoadRom(image.data(), image.size());
+}
+}
+
+int main()
+{
+	auto rom = LoopRom();
+	nes::Nes nes;
+	if(!rom || !nes.LoadRom(rom)) {
+		fprintf(stderr, "could not load the test ROM\n");
+		return 1;
+	}
+	DebugInterface debug(&nes.cpu, &nes.event_queue, &nes.main_bus, true);
+	debug.SetHookBus(&nes.hooks);
+
+	std::atomic<bool> stop(false);
+	std::thread emulation([&]() {
+		nes::Framebuffer fb = {};
+		fb.format = nes::kOutputNone;
+		while(!stop)
+			nes.RunForOneFrame(&fb);
+	});
+
+	bool ok = false;
+	{
+		LuaState state;
+		LuaCpu cpu(&debug);
+		state.Execute([&](lua_State *L) {
+			cpu.Push(L);
+			lua_setglobal(L, "cpu");
+			ok = !luaL_dostring(L, kScript);
+			if(!ok)
+				fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		});
+		// The LuaCpu goes first and needs the emulation thread to remove its hook
+	}
+	stop = true;
+	emulation.join();
+
+	if(!ok)
+		return 1;
+	printf("lua hook tests passed\n");
+	return 0;
+}
@@ -0,0 +1,337 @@
+#include "unpack.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+// Checks Unpack() against files written by Python's gzip and zipfile modules.
+// Rebuild the tables with the same payload if they ever need to change.
+
+namespace {
+int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if(!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while(0)
+
+// Words in a fixed pseudo random order, so the payload needs no table of its own
+std::vector<uint8_t> Payload()
+{
+	static const char *const kWords[16] = {
+		"lda", "sta", "ldx", "jsr", "rts", "bne", "beq", "inx",
+		"dey", "#$00", "$2000", "($10),y", "nmi", "vblank", "ppu", "oam",
+	};
+	const size_t kSize = 1500;
+	std::vector<uint8_t> out;
+	uint32_t x = 1;
+	for(uint32_t i = 0; out.size() < kSize; i++) {
+		x = x * 1103515245 + 12345;
+		const char *word = kWords[(x >> 16) % 16];
+		out.insert(out.end(), word, word + strlen(word));
+		out.push_back(i % 8 == 7 ? '\n' : ' ');
+	}
+	out.resize(kSize);
+	return out;
+}
+const uint32_t kPayloadCrc = 0x62a0d110;
+
+// gzip -0, the payload goes in between
+const uint8_t kGzip0Head[] = {
+	0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x01, 0xdc,
+	0x05, 0x23, 0xfa,
+};
+
+const uint8_t kGzip0Tail[] = {
+	0x10, 0xd1, 0xa0, 0x62, 0xdc, 0x05, 0x00, 0x00,
+};
+
+// gzip -1
+const uint8_t kGzip1[] = {
+	0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0xff, 0x6d, 0x94,
+	0x4d, 0x6e, 0x02, 0x31, 0x0c, 0x85, 0xf7, 0x39, 0x45, 0xa4, 0xb2, 0x68,
+	0xa5, 0x2e, 0xa6, 0xbd, 0x11, 0x23, 0x58, 0x40, 0x61, 0x4a, 0x81, 0x56,
+	0x70, 0xfb, 0xfa, 0x7b, 0xf6, 0x1b, 0x46, 0x6a, 0x17, 0x21, 0xc4, 0xb1,
+	0xdf, 0x8f, 0x1d, 0x18, 0xb7, 0x5f, 0xfd, 0x74, 0xfa, 0xee, 0x97, 0xeb,
+	0xba, 0x3f, 0xaf, 0xde, 0x86, 0x97, 0xd7, 0xfb, 0x9f, 0xfd, 0xb0, 0xb9,
+	0x39, 0xd6, 0xce, 0xd7, 0x4b, 0x1f, 0xa3, 0xe6, 0x67, 0x3c, 0xac, 0xa7,
+	0x8f, 0xfe, 0xb9, 0x3e, 0xf6, 0xe9, 0xb8, 0xd3, 0x02, 0x62, 0x37, 0xdd,
+	0x1a, 0x3b, 0x71, 0x76, 0xa0, 0x49, 0x07, 0x82, 0x18, 0xf7, 0xb1, 0x14,
+	0x63, 0x7f, 0x5a, 0x0d, 0x43, 0x5f, 0xbd, 0x0f, 0xf1, 0xb9, 0xd9, 0xde,
+	0x05, 0x43, 0xa8, 0x65, 0x88, 0xca, 0xfd, 0xe5, 0x6c, 0x72, 0xa1, 0x8c,
+	0xd3, 0x56, 0xc8, 0x91, 0xde, 0x60, 0x96, 0xa0, 0x88, 0x15, 0x7a, 0x32,
+	0xc6, 0xb9, 0xcc, 0x14, 0x12, 0xfc, 0xe2, 0x32, 0x0b, 0xb0, 0x33, 0x49,
+	0x43, 0x26, 0x00, 0x4a, 0xd1, 0x07, 0x27, 0xaf, 0x90, 0xa1, 0x0c, 0x6a,
+	0xa8, 0x2f, 0xef, 0xb5, 0x25, 0x4a, 0x19, 0x2d, 0x3a, 0x77, 0x89, 0x28,
+	0x22, 0x05, 0x59, 0xf9, 0x11, 0x6b, 0x20, 0x63, 0x8e, 0x16, 0x1d, 0x36,
+	0xb9, 0xdc, 0x7d, 0xee, 0x22, 0xde, 0x60, 0xc2, 0x2c, 0xf7, 0xec, 0xc2,
+	0x00, 0x0c, 0x19, 0x89, 0x55, 0x6c, 0xae, 0xa4, 0x42, 0x59, 0xb8, 0x25,
+	0x8b, 0xbd, 0x32, 0x61, 0x03, 0xb9, 0x3c, 0x0b, 0x37, 0xc7, 0x50, 0xae,
+	0xda, 0x5c, 0xe9, 0xb9, 0xc1, 0x05, 0x02, 0xb0, 0x08, 0xf2, 0x19, 0x28,
+	0x4f, 0xc1, 0xb0, 0xcc, 0x95, 0xef, 0x4b, 0xa3, 0x9c, 0x93, 0x0e, 0x84,
+	0x9a, 0x93, 0x6c, 0x81, 0xc4, 0xf4, 0xd9, 0x61, 0xb3, 0x81, 0xea, 0x10,
+	0x64, 0x9e, 0x08, 0xee, 0x05, 0x4a, 0xfe, 0x32, 0x37, 0xcc, 0xb4, 0x47,
+	0x27, 0x74, 0x45, 0x6e, 0x41, 0xa0, 0xaf, 0xbe, 0x56, 0x03, 0xcc, 0xb1,
+	0xa8, 0x81, 0xc3, 0x3c, 0xec, 0x21, 0x58, 0xf2, 0x3c, 0xbd, 0x14, 0x0f,
+	0x29, 0x45, 0x2c, 0x94, 0xd9, 0x0c, 0x82, 0x0c, 0x9a, 0x99, 0x9e, 0x24,
+	0x59, 0x64, 0xd3, 0xef, 0xea, 0xaa, 0x7e, 0x19, 0xea, 0x26, 0x17, 0xa1,
+	0xae, 0x91, 0x0c, 0x34, 0x0b, 0x28, 0x14, 0xd3, 0x6d, 0xf6, 0xa0, 0xd0,
+	0x13, 0xb1, 0x40, 0x81, 0x98, 0x0b, 0x75, 0x20, 0x07, 0x40, 0x2b, 0x8b,
+	0xba, 0x27, 0x39, 0x75, 0x38, 0x93, 0x01, 0x94, 0x26, 0x0d, 0x87, 0x2a,
+	0xb7, 0x9d, 0x3b, 0xa8, 0xe6, 0x01, 0x69, 0xbc, 0xae, 0xa4, 0xca, 0xdf,
+	0xa9, 0x10, 0x01, 0xc4, 0xa1, 0x50, 0xd6, 0xfc, 0x2e, 0x48, 0x04, 0x06,
+	0xb8, 0x72, 0xa1, 0xdf, 0xb7, 0x69, 0xb8, 0xa7, 0xce, 0x60, 0xb8, 0x8f,
+	0x73, 0xb8, 0x7f, 0x3c, 0x3e, 0x5e, 0x41, 0x75, 0x25, 0x89, 0xc2, 0x49,
+	0xbd, 0xec, 0x54, 0xc7, 0x25, 0x40, 0xe5, 0xd6, 0x58, 0x74, 0x8e, 0x54,
+	0x8c, 0x4b, 0xa0, 0x9f, 0x95, 0x0e, 0xdc, 0x52, 0x28, 0x08, 0xe5, 0x3c,
+	0xec, 0x12, 0x27, 0xb9, 0x5e, 0xb6, 0x06, 0x4f, 0xbe, 0x91, 0xc9, 0xc4,
+	0x01, 0xca, 0x53, 0x82, 0x20, 0x79, 0x72, 0xf4, 0x30, 0xfb, 0x7a, 0x5b,
+	0x6a, 0xa2, 0x9a, 0x2a, 0xfa, 0x43, 0xa5, 0x91, 0xe4, 0x33, 0xe2, 0x68,
+	0xa4, 0xb4, 0x2c, 0x04, 0xc2, 0xfc, 0x43, 0xf8, 0xc7, 0x19, 0xbc, 0x20,
+	0x86, 0xc6, 0x66, 0x24, 0xeb, 0x61, 0x47, 0x7f, 0x21, 0x41, 0x10, 0xc7,
+	0xf9, 0x7f, 0x19, 0x11, 0x94, 0xb2, 0x7e, 0x01, 0x10, 0xd1, 0xa0, 0x62,
+	0xdc, 0x05, 0x00, 0x00,
+};
+
+// gzip -9
+const uint8_t kGzip9[] = {
+	0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0xff, 0x6d, 0x94,
+	0xcd, 0x6e, 0x02, 0x31, 0x0c, 0x84, 0xef, 0x7e, 0x8a, 0x48, 0xe5, 0xd0,
+	0x4a, 0x3d, 0x6c, 0xfb, 0x46, 0xac, 0xe0, 0x00, 0x85, 0x2d, 0x05, 0x5a,
+	0xc1, 0xdb, 0x37, 0x9f, 0xe3, 0x71, 0x82, 0xda, 0x43, 0x08, 0x49, 0xc6,
+	0xe3, 0x9f, 0xb1, 0x77, 0xde, 0x7e, 0x95, 0xd3, 0xe9, 0xbb, 0x5c, 0xae,
+	0xeb, 0xf2, 0xbc, 0x7a, 0x9b, 0x5e, 0x5e, 0xef, 0x7f, 0xf6, 0xc3, 0xe6,
+	0xa6, 0xff, 0x76, 0xbe, 0x5e, 0xca, 0x5c, 0x6d, 0x7e, 0xe6, 0xc3, 0x7a,
+	0xf9, 0x28, 0x9f, 0xeb, 0x63, 0x59, 0x8e, 0x3b, 0x5f, 0x50, 0xec, 0x96,
+	0x9b, 0xb1, 0x73, 0xcf, 0x0e, 0x35, 0x70, 0x28, 0xb8, 0xe3, 0xbd, 0x2e,
+	0xbf, 0x63, 0x7f, 0x5a, 0x4d, 0x53, 0x59, 0xbd, 0x4f, 0xf5, 0x77, 0xb3,
+	0xbd, 0x3b, 0x0d, 0x57, 0xd6, 0xae, 0x40, 0xed, 0x2f, 0xe7, 0x87, 0x40,
+	0xe6, 0x65, 0xeb, 0xcc, 0x15, 0x6e, 0xc0, 0x3d, 0xa0, 0x7a, 0x17, 0xec,
+	0xcd, 0x63, 0x3d, 0x2b, 0xe0, 0xc6, 0x84, 0xa5, 0xfb, 0x92, 0x17, 0x68,
+	0xd3, 0x89, 0x61, 0x04, 0x81, 0x43, 0xfc, 0x87, 0x93, 0x96, 0x10, 0xd8,
+	0x60, 0x1f, 0xb9, 0xc7, 0xd6, 0x58, 0x22, 0xd1, 0x70, 0xa7, 0x2a, 0x71,
+	0xab, 0x9c, 0x84, 0xaf, 0x77, 0x16, 0xac, 0x9e, 0xc8, 0x61, 0xd3, 0x96,
+	0x92, 0x8c, 0xd2, 0x19, 0x9e, 0x48, 0x84, 0x37, 0x76, 0xe7, 0x50, 0xe8,
+	0x8d, 0x2b, 0xbc, 0xc9, 0x12, 0x0b, 0x47, 0x91, 0x2d, 0x28, 0xf6, 0x40,
+	0xe2, 0x0d, 0xe6, 0xc8, 0xd9, 0x79, 0x6f, 0x59, 0x60, 0x8a, 0x99, 0x96,
+	0xd2, 0x0d, 0x5f, 0x9c, 0xa1, 0x25, 0x20, 0x9d, 0x31, 0x92, 0x0a, 0xa2,
+	0x45, 0x57, 0xfe, 0x8f, 0x89, 0x72, 0xee, 0xd2, 0x86, 0x4e, 0x26, 0x01,
+	0xd0, 0x4a, 0x5d, 0xa3, 0x04, 0xc2, 0x10, 0x67, 0x52, 0x84, 0xec, 0x9d,
+	0x14, 0xfc, 0x88, 0xad, 0x8f, 0xd6, 0x2b, 0x91, 0x95, 0x94, 0xef, 0x1a,
+	0xdf, 0x83, 0x4c, 0x26, 0xbb, 0xc1, 0x06, 0x1f, 0xf2, 0x23, 0xfd, 0x32,
+	0xd4, 0x0c, 0x1e, 0x66, 0x8c, 0x58, 0xd2, 0x05, 0x04, 0x01, 0x89, 0x54,
+	0x4d, 0xd6, 0x62, 0x00, 0x05, 0x3a, 0x3b, 0x8a, 0x4b, 0xe0, 0xd2, 0x85,
+	0x3a, 0x04, 0x50, 0x53, 0xd3, 0x25, 0xa9, 0x3b, 0x72, 0x28, 0x28, 0x96,
+	0x93, 0xc8, 0x17, 0xbe, 0xa3, 0x32, 0x16, 0x89, 0xf8, 0x3b, 0xc0, 0xc7,
+	0x7e, 0x68, 0x83, 0xe7, 0x31, 0xd9, 0x20, 0x94, 0x97, 0x5d, 0x22, 0xa6,
+	0x40, 0x2e, 0x6f, 0x1f, 0xb4, 0x5e, 0xe8, 0x1c, 0x53, 0x1c, 0xd7, 0x08,
+	0x4d, 0x9d, 0x45, 0x21, 0xd4, 0x9c, 0x9a, 0x67, 0x32, 0x63, 0x97, 0x1b,
+	0xde, 0xb1, 0x1b, 0xab, 0x5f, 0xcf, 0x36, 0x36, 0x9f, 0x7a, 0x3a, 0x9b,
+	0x9c, 0x09, 0x69, 0x71, 0xb5, 0xdf, 0xe6, 0x30, 0xb5, 0x15, 0x57, 0xf4,
+	0xa9, 0x65, 0x85, 0xd4, 0x56, 0x7e, 0x90, 0x6c, 0x4e, 0x61, 0xfa, 0x2a,
+	0x74, 0x42, 0xc0, 0xd1, 0xd9, 0x2e, 0xfc, 0xd8, 0x5b, 0x20, 0x21, 0x22,
+	0xf2, 0x66, 0xa1, 0x6f, 0x42, 0x4e, 0x2e, 0x09, 0x0c, 0x31, 0x39, 0x4b,
+	0x53, 0xd0, 0xc6, 0xc6, 0x90, 0xa2, 0x6a, 0xb3, 0x3e, 0x1a, 0x39, 0x08,
+	0xff, 0x64, 0x86, 0x5f, 0x18, 0xeb, 0xb3, 0x8d, 0x32, 0xa8, 0xed, 0x86,
+	0x1e, 0x8e, 0x96, 0xca, 0xef, 0xb2, 0x06, 0x93, 0xf5, 0x0b, 0x10, 0xd1,
+	0xa0, 0x62, 0xdc, 0x05, 0x00, 0x00,
+};
+
+// Stored game.nes, the payload goes in between
+const uint8_t kZipStoredHead[] = {
+	0x50, 0x4b, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x21, 0x00, 0x10, 0xd1, 0xa0, 0x62, 0xdc, 0x05, 0x00, 0x00, 0xdc, 0x05,
+	0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x67, 0x61, 0x6d, 0x65, 0x2e, 0x6e,
+	0x65, 0x73,
+};
+
+const uint8_t kZipStoredTail[] = {
+	0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x21, 0x00, 0x10, 0xd1, 0xa0, 0x62, 0xdc, 0x05, 0x00, 0x00,
+	0xdc, 0x05, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00, 0x00, 0x00, 0x67, 0x61,
+	0x6d, 0x65, 0x2e, 0x6e, 0x65, 0x73, 0x50, 0x4b, 0x05, 0x06, 0x00, 0x00,
+	0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x36, 0x00, 0x00, 0x00, 0x02, 0x06,
+	0x00, 0x00, 0x00, 0x00,
+};
+
+// Deflated game.nes
+const uint8_t kZipDeflated[] = {
+	0x50, 0x4b, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
+	0x21, 0x00, 0x10, 0xd1, 0xa0, 0x62, 0xc8, 0x01, 0x00, 0x00, 0xdc, 0x05,
+	0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x67, 0x61, 0x6d, 0x65, 0x2e, 0x6e,
+	0x65, 0x73, 0x6d, 0x94, 0xcd, 0x6e, 0x02, 0x31, 0x0c, 0x84, 0xef, 0x7e,
+	0x8a, 0x48, 0xe5, 0xd0, 0x4a, 0x3d, 0x6c, 0xfb, 0x46, 0xac, 0xe0, 0x00,
+	0x85, 0x2d, 0x05, 0x5a, 0xc1, 0xdb, 0x37, 0x9f, 0xe3, 0x71, 0x82, 0xda,
+	0x43, 0x08, 0x49, 0xc6, 0xe3, 0x9f, 0xb1, 0x77, 0xde, 0x7e, 0x95, 0xd3,
+	0xe9, 0xbb, 0x5c, 0xae, 0xeb, 0xf2, 0xbc, 0x7a, 0x9b, 0x5e, 0x5e, 0xef,
+	0x7f, 0xf6, 0xc3, 0xe6, 0xa6, 0xff, 0x76, 0xbe, 0x5e, 0xca, 0x5c, 0x6d,
+	0x7e, 0xe6, 0xc3, 0x7a, 0xf9, 0x28, 0x9f, 0xeb, 0x63, 0x59, 0x8e, 0x3b,
+	0x5f, 0x50, 0xec, 0x96, 0x9b, 0xb1, 0x73, 0xcf, 0x0e, 0x35, 0x70, 0x28,
+	0xb8, 0xe3, 0xbd, 0x2e, 0xbf, 0x63, 0x7f, 0x5a, 0x4d, 0x53, 0x59, 0xbd,
+	0x4f, 0xf5, 0x77, 0xb3, 0xbd, 0x3b, 0x0d, 0x57, 0xd6, 0xae, 0x40, 0xed,
+	0x2f, 0xe7, 0x87, 0x40, 0xe6, 0x65, 0xeb, 0xcc, 0x15, 0x6e, 0xc0, 0x3d,
+	0xa0, 0x7a, 0x17, 0xec, 0xcd, 0x63, 0x3d, 0x2b, 0xe0, 0xc6, 0x84, 0xa5,
+	0xfb, 0x92, 0x17, 0x68, 0xd3, 0x89, 0x61, 0x04, 0x81, 0x43, 0xfc, 0x87,
+	0x93, 0x96, 0x10, 0xd8, 0x60, 0x1f, 0xb9, 0xc7, 0xd6, 0x58, 0x22, 0xd1,
+	0x70, 0xa7, 0x2a, 0x71, 0xab, 0x9c, 0x84, 0xaf, 0x77, 0x16, 0xac, 0x9e,
+	0xc8, 0x61, 0xd3, 0x96, 0x92, 0x8c, 0xd2, 0x19, 0x9e, 0x48, 0x84, 0x37,
+	0x76, 0xe7, 0x50, 0xe8, 0x8d, 0x2b, 0xbc, 0xc9, 0x12, 0x0b, 0x47, 0x91,
+	0x2d, 0x28, 0xf6, 0x40, 0xe2, 0x0d, 0xe6, 0xc8, 0xd9, 0x79, 0x6f, 0x59,
+	0x60, 0x8a, 0x99, 0x96, 0xd2, 0x0d, 0x5f, 0x9c, 0xa1, 0x25, 0x20, 0x9d,
+	0x31, 0x92, 0x0a, 0xa2, 0x45, 0x57, 0xfe, 0x8f, 0x89, 0x72, 0xee, 0xd2,
+	0x86, 0x4e, 0x26, 0x01, 0xd0, 0x4a, 0x5d, 0xa3, 0x04, 0xc2, 0x10, 0x67,
+	0x52, 0x84, 0xec, 0x9d, 0x14, 0xfc, 0x88, 0xad, 0x8f, 0xd6, 0x2b, 0x91,
+	0x95, 0x94, 0xef, 0x1a, 0xdf, 0x83, 0x4c, 0x26, 0xbb, 0xc1, 0x06, 0x1f,
+	0xf2, 0x23, 0xfd, 0x32, 0xd4, 0x0c, 0x1e, 0x66, 0x8c, 0x58, 0xd2, 0x05,
+	0x04, 0x01, 0x89, 0x54, 0x4d, 0xd6, 0x62, 0x00, 0x05, 0x3a, 0x3b, 0x8a,
+	0x4b, 0xe0, 0xd2, 0x85, 0x3a, 0x04, 0x50, 0x53, 0xd3, 0x25, 0xa9, 0x3b,
+	0x72, 0x28, 0x28, 0x96, 0x93, 0xc8, 0x17, 0xbe, 0xa3, 0x32, 0x16, 0x89,
+	0xf8, 0x3b, 0xc0, 0xc7, 0x7e, 0x68, 0x83, 0xe7, 0x31, 0xd9, 0x20, 0x94,
+	0x97, 0x5d, 0x22, 0xa6, 0x40, 0x2e, 0x6f, 0x1f, 0xb4, 0x5e, 0xe8, 0x1c,
+	0x53, 0x1c, 0xd7, 0x08, 0x4d, 0x9d, 0x45, 0x21, 0xd4, 0x9c, 0x9a, 0x67,
+	0x32, 0x63, 0x97, 0x1b, 0xde, 0xb1, 0x1b, 0xab, 0x5f, 0xcf, 0x36, 0x36,
+	0x9f, 0x7a, 0x3a, 0x9b, 0x9c, 0x09, 0x69, 0x71, 0xb5, 0xdf, 0xe6, 0x30,
+	0xb5, 0x15, 0x57, 0xf4, 0xa9, 0x65, 0x85, 0xd4, 0x56, 0x7e, 0x90, 0x6c,
+	0x4e, 0x61, 0xfa, 0x2a, 0x74, 0x42, 0xc0, 0xd1, 0xd9, 0x2e, 0xfc, 0xd8,
+	0x5b, 0x20, 0x21, 0x22, 0xf2, 0x66, 0xa1, 0x6f, 0x42, 0x4e, 0x2e, 0x09,
+	0x0c, 0x31, 0x39, 0x4b, 0x53, 0xd0, 0xc6, 0xc6, 0x90, 0xa2, 0x6a, 0xb3,
+	0x3e, 0x1a, 0x39, 0x08, 0xff, 0x64, 0x86, 0x5f, 0x18, 0xeb, 0xb3, 0x8d,
+	0x32, 0xa8, 0xed, 0x86, 0x1e, 0x8e, 0x96, 0xca, 0xef, 0xb2, 0x06, 0x93,
+	0xf5, 0x0b, 0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00, 0x00, 0x00,
+	0x08, 0x00, 0x00, 0x00, 0x21, 0x00, 0x10, 0xd1, 0xa0, 0x62, 0xc8, 0x01,
+	0x00, 0x00, 0xdc, 0x05, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00, 0x00, 0x00,
+	0x67, 0x61, 0x6d, 0x65, 0x2e, 0x6e, 0x65, 0x73, 0x50, 0x4b, 0x05, 0x06,
+	0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x36, 0x00, 0x00, 0x00,
+	0xee, 0x01, 0x00, 0x00, 0x00, 0x00,
+};
+
+// "hello hello hello hello\n", small enough for the fixed codes
+const uint8_t kGzipFixed[] = {
+	0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0xff, 0xcb, 0x48,
+	0xcd, 0xc9, 0xc9, 0x57, 0xc8, 0x40, 0x27, 0xb9, 0x00, 0x00, 0x88, 0x59,
+	0x0b, 0x18, 0x00, 0x00, 0x00,
+};
+
+template<size_t N>
+std::vector<uint8_t> Bytes(const uint8_t (&data)[N])
+{
+	return std::vector<uint8_t>(data, data + N);
+}
+
+template<size_t H, size_t T>
+std::vector<uint8_t> Join(const uint8_t (&head)[H], const std::vector<uint8_t>& payload,
+	const uint8_t (&tail)[T])
+{
+	std::vector<uint8_t> out(head, head + H);
+	out.insert(out.end(), payload.begin(), payload.end());
+	out.insert(out.end(), tail, tail + T);
+	return out;
+}
+
+uint32_t Read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool Unpacks(const std::vector<uint8_t>& packed, const std::vector<uint8_t>& expected)
+{
+	auto mem = Unpack(packed.data(), packed.size());
+	return mem && mem->GetSize() == expected.size() &&
+		!memcmp(mem->Pointer(), expected.data(), expected.size());
+}
+
+// Every truncation of |packed|, and every damaged byte in [first, last), must
+// be rejected. Each attempt gets a buffer of its own size so overreads show up
+// under a sanitizer.
+void CheckRejectsDamage(const char *name, const std::vector<uint8_t>& packed,
+	size_t first, size_t last)
+{
+	for(size_t size = 0; size < packed.size(); size++) {
+		std::vector<uint8_t> truncated(packed.begin(), packed.begin() + size);
+		if(Unpack(truncated.data(), truncated.size())) {
+			fprintf(stderr, "%s: accepted when cut to %zu bytes\n", name, size);
+			failures++;
+			break;
+		}
+	}
+	std::vector<uint8_t> damaged = packed;
+	for(size_t i = first; i < last; i++) {
+		damaged[i] ^= 0x55;
+		if(Unpack(damaged.data(), damaged.size())) {
+			fprintf(stderr, "%s: accepted with byte %zu damaged\n", name, i);
+			failures++;
+			break;
+		}
+		damaged[i] ^= 0x55;
+	}
+}
+
+// Offset and size of the data of the first entry in a zip
+void ZipEntryData(const std::vector<uint8_t>& zip, size_t *start, size_t *size)
+{
+	*start = 30 + (zip[26] | (zip[27] << 8)) + (zip[28] | (zip[29] << 8));
+	*size = Read32(&zip[18]);
+}
+}
+
+int main()
+{
+	std::vector<uint8_t> payload = Payload();
+	CHECK(Crc32(payload.data(), payload.size()) == kPayloadCrc);
+	CHECK(Crc32(payload.data() + 100, payload.size() - 100, Crc32(payload.data(), 100)) == kPayloadCrc);
+
+	std::vector<uint8_t> gzip0 = Join(kGzip0Head, payload, kGzip0Tail);
+	std::vector<uint8_t> gzip1 = Bytes(kGzip1);
+	std::vector<uint8_t> gzip9 = Bytes(kGzip9);
+	std::vector<uint8_t> zip_stored = Join(kZipStoredHead, payload, kZipStoredTail);
+	std::vector<uint8_t> zip_deflated = Bytes(kZipDeflated);
+	const char *hello = "hello hello hello hello\n";
+
+	CHECK(IsPacked(gzip9.data(), gzip9.size()));
+	CHECK(IsPacked(zip_stored.data(), zip_stored.size()));
+	CHECK(!IsPacked(payload.data(), payload.size()));
+
+	CHECK(Unpacks(gzip0, payload));
+	CHECK(Unpacks(gzip1, payload));
+	CHECK(Unpacks(gzip9, payload));
+	CHECK(Unpacks(zip_stored, payload));
+	CHECK(Unpacks(zip_deflated, payload));
+	CHECK(Unpacks(Bytes(kGzipFixed), std::vector<uint8_t>(hello, hello + strlen(hello))));
+	CHECK(!Unpack(payload.data(), payload.size()));
+
+	// The raw stream only inflates into a buffer of exactly the right size
+	std::vector<uint8_t> out(payload.size() + 1);
+	const uint8_t *stream = gzip9.data() + 10;
+	size_t stream_size = gzip9.size() - 18;
+	CHECK(Inflate(stream, stream_size, out.data(), payload.size()));
+	CHECK(!memcmp(out.data(), payload.data(), payload.size()));
+	CHECK(!Inflate(stream, stream_size, out.data(), payload.size() - 1));
+	CHECK(!Inflate(stream, stream_size, out.data(), payload.size() + 1));
+	CHECK(!Inflate(stream, stream_size - 1, out.data(), payload.size()));
+
+	// The gzip header has fields nobody checks, everything after it counts
+	CheckRejectsDamage("gzip -0", gzip0, 10, gzip0.size());
+	CheckRejectsDamage("gzip -1", gzip1, 10, gzip1.size());
+	CheckRejectsDamage("gzip -9", gzip9, 10, gzip9.size());
+	size_t start, size;
+	ZipEntryData(zip_stored, &start, &size);
+	CheckRejectsDamage("stored zip", zip_stored, start, start + size);
+	ZipEntryData(zip_deflated, &start, &size);
+	CheckRejectsDamage("deflated zip", zip_deflated, start, start + size);
+	// The CRC in the central directory is the one that counts
+	size_t central = Read32(&zip_deflated[zip_deflated.size() - 6]);
+	CheckRejectsDamage("zip CRC", zip_deflated, central + 16, central + 20);
+
+	if(failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("unpack tests passed\n");
+	return 0;
+}
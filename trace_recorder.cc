@@ -0,0 +1,165 @@
+#include "trace_recorder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+template<class T>
+uint8_t* PutColumn(uint8_t *out, const T *column, uint64_t begin, uint32_t count, uint64_t mask)
+{
+	for(uint32_t k = 0; k < count; k++) {
+		memcpy(out, &column[(begin + k) & mask], sizeof(T));
+		out += sizeof(T);
+	}
+	return out;
+}
+
+constexpr size_t kBytesPerEntry = 4 * sizeof(uint32_t) + 4 * sizeof(uint16_t) + sizeof(uint8_t);
+}
+
+TraceRecorder::TraceRecorder(uint32_t capacity_bits)
+{
+	if(capacity_bits < 8)
+		capacity_bits = 8;
+	else if(capacity_bits > 30)
+		capacity_bits = 30;
+	size_t n = (size_t)1 << capacity_bits;
+	mask = n - 1;
+	// Eight blocks leave the writer thread enough room to fall behind
+	block_size = (uint32_t)(n >> 3);
+
+	cycles.reset(new uint64_t[n]);
+	pcs.reset(new uint32_t[n]);
+	instruction_bytes.reset(new uint32_t[n]);
+	effective_addrs.reset(new uint32_t[n]);
+	as.reset(new uint16_t[n]);
+	xs.reset(new uint16_t[n]);
+	ys.reset(new uint16_t[n]);
+	sps.reset(new uint16_t[n]);
+	ps.reset(new uint8_t[n]);
+	block_buffer.resize(sizeof(BlockHeader) + kBytesPerEntry * block_size);
+}
+
+TraceRecorder::~TraceRecorder()
+{
+	StopStreaming();
+}
+
+void TraceRecorder::Clear()
+{
+	if(!streaming)
+		write_pos = 0;
+}
+
+bool TraceRecorder::StartStreaming(std::shared_ptr<NativeFile> file)
+{
+	if(streaming || !file)
+		return false;
+	FileHeader h = {kFileMagic, kFileVersion};
+	if(!file->Write(&h, sizeof(h)))
+		return false;
+	stream_file = std::move(file);
+	flushed_pos = ready_pos = write_pos;
+	writer_quit = false;
+	write_failed = false;
+	streaming = true;
+	writer_thread = std::thread(&TraceRecorder::WriterThreadFunc, this);
+	return true;
+}
+
+void TraceRecorder::StopStreaming()
+{
+	if(!streaming)
+		return;
+	{
+		std::lock_guard<std::mutex> l(lock);
+		ready_pos = write_pos;
+		writer_quit = true;
+	}
+	ready_var.notify_one();
+	writer_thread.join();
+	streaming = false;
+	stream_file.reset();
+}
+
+void TraceRecorder::BlockFilled()
+{
+	std::unique_lock<std::mutex> l(lock);
+	ready_pos = write_pos;
+	ready_var.notify_one();
+	// The next block must not overwrite entries that are still being written
+	flushed_var.wait(l, [this]() {
+		return write_failed || write_pos + block_size - flushed_pos <= mask + 1;
+	});
+}
+
+void TraceRecorder::WriterThreadFunc()
+{
+	std::unique_lock<std::mutex> l(lock);
+	while(true) {
+		ready_var.wait(l, [this]() { return writer_quit || ready_pos != flushed_pos; });
+		if(ready_pos == flushed_pos)
+			break;
+		uint64_t begin = flushed_pos;
+		uint64_t end = ready_pos;
+		l.unlock();
+		bool ok = WriteRange(stream_file.get(), begin, end);
+		l.lock();
+		if(!ok) {
+			write_failed = true;
+			flushed_var.notify_one();
+			break;
+		}
+		flushed_pos = end;
+		flushed_var.notify_one();
+	}
+}
+
+bool TraceRecorder::Export(NativeFile *file)
+{
+	if(streaming)
+		return false;
+	FileHeader h = {kFileMagic, kFileVersion};
+	if(!file->Write(&h, sizeof(h)))
+		return false;
+	uint64_t begin = write_pos > mask + 1 ? write_pos - (mask + 1) : 0;
+	return WriteRange(file, begin, write_pos);
+}
+
+bool TraceRecorder::WriteRange(NativeFile *file, uint64_t begin, uint64_t end)
+{
+	while(begin < end) {
+		uint32_t count = (uint32_t)std::min<uint64_t>(end - begin, block_size);
+		if(!WriteBlock(file, begin, count))
+			return false;
+		begin += count;
+	}
+	return true;
+}
+
+bool TraceRecorder::WriteBlock(NativeFile *file, uint64_t begin, uint32_t count)
+{
+	BlockHeader h = {count, 0, cycles[begin & mask]};
+	uint8_t *out = block_buffer.data();
+	memcpy(out, &h, sizeof(h));
+	out += sizeof(h);
+
+	uint64_t prev = h.first_cycle;
+	for(uint32_t k = 0; k < count; k++) {
+		uint64_t c = cycles[(begin + k) & mask];
+		uint32_t delta = (uint32_t)(c - prev);
+		memcpy(out, &delta, sizeof(delta));
+		out += sizeof(delta);
+		prev = c;
+	}
+	out = PutColumn(out, pcs.get(), begin, count, mask);
+	out = PutColumn(out, instruction_bytes.get(), begin, count, mask);
+	out = PutColumn(out, effective_addrs.get(), begin, count, mask);
+	out = PutColumn(out, as.get(), begin, count, mask);
+	out = PutColumn(out, xs.get(), begin, count, mask);
+	out = PutColumn(out, ys.get(), begin, count, mask);
+	out = PutColumn(out, sps.get(), begin, count, mask);
+	out = PutColumn(out, ps.get(), begin, count, mask);
+	return file->Write(block_buffer.data(), out - block_buffer.data());
+}
@@ -0,0 +1,119 @@
+#ifndef TRACE_RECORDER_H_
+#define TRACE_RECORDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "host_system.h"
+
+// Execution trace kept in a fixed size structure of arrays ring. Recording never
+// allocates. While streaming, completed blocks of the ring are written to a file
+// by a background thread, and recording only waits when the ring is full.
+//
+// File format: a FileHeader followed by blocks. Every block is a BlockHeader
+// and then |count| entries per column, in the order cycle delta (u32, from the
+// previous entry), pc (u32), bytes (u32), effective address (u32), a, x, y,
+// sp (u16) and p (u8).
+class TraceRecorder
+{
+public:
+	static constexpr uint32_t kFileMagic = 0x52544352; // "RCTR"
+	static constexpr uint32_t kFileVersion = 1;
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+	};
+	struct BlockHeader
+	{
+		uint32_t count;
+		uint32_t reserved;
+		uint64_t first_cycle;
+	};
+
+	// The ring holds 2^|capacity_bits| entries
+	explicit TraceRecorder(uint32_t capacity_bits = 20);
+	~TraceRecorder();
+
+	// |bytes| holds up to 4 instruction bytes, first one in the low byte.
+	// Returns the slot so the rest can be filled in afterwards. The entry is
+	// not part of the trace until Commit().
+	uint32_t Record(uint64_t cycle, uint32_t pc, uint32_t bytes,
+		uint16_t a, uint16_t x, uint16_t y, uint16_t sp, uint8_t p)
+	{
+		uint32_t i = (uint32_t)(write_pos & mask);
+		cycles[i] = cycle;
+		pcs[i] = pc;
+		instruction_bytes[i] = bytes;
+		as[i] = a;
+		xs[i] = x;
+		ys[i] = y;
+		sps[i] = sp;
+		ps[i] = p;
+		effective_addrs[i] = 0;
+		return i;
+	}
+	void Commit()
+	{
+		if(!(++write_pos & (block_size - 1)) && streaming)
+			BlockFilled();
+	}
+	void SetOpcode(uint32_t slot, uint8_t opcode)
+	{
+		instruction_bytes[slot] = (instruction_bytes[slot] & ~0xFFU) | opcode;
+	}
+	void SetEffectiveAddress(uint32_t slot, uint32_t ea) { effective_addrs[slot] = ea; }
+
+	bool StartStreaming(std::shared_ptr<NativeFile> file);
+	// Writes out everything recorded so far and closes the stream
+	void StopStreaming();
+
+	// Writes the entries currently in the ring, oldest first
+	bool Export(NativeFile *file);
+
+	void Clear();
+
+	uint64_t total_recorded() const { return write_pos; }
+	size_t capacity() const { return mask + 1; }
+	bool is_streaming() const { return streaming; }
+
+private:
+	void BlockFilled();
+	void WriterThreadFunc();
+	bool WriteRange(NativeFile *file, uint64_t begin, uint64_t end);
+	bool WriteBlock(NativeFile *file, uint64_t begin, uint32_t count);
+
+	uint64_t mask;
+	uint32_t block_size;
+	uint64_t write_pos = 0;
+
+	std::unique_ptr<uint64_t[]> cycles;
+	std::unique_ptr<uint32_t[]> pcs;
+	std::unique_ptr<uint32_t[]> instruction_bytes;
+	std::unique_ptr<uint32_t[]> effective_addrs;
+	std::unique_ptr<uint16_t[]> as, xs, ys, sps;
+	std::unique_ptr<uint8_t[]> ps;
+	// Used by the writer thread to build blocks
+	std::vector<uint8_t> block_buffer;
+
+	bool streaming = false;
+	bool writer_quit = false;
+	bool write_failed = false;
+	std::shared_ptr<NativeFile> stream_file;
+	// Everything before |flushed_pos| is on disk, everything before |ready_pos|
+	// may be written
+	uint64_t flushed_pos = 0;
+	uint64_t ready_pos = 0;
+	std::thread writer_thread;
+	std::mutex lock;
+	std::condition_variable ready_var;
+	std::condition_variable flushed_var;
+};
+
+#endif
@@ -0,0 +1,441 @@
+#include "unpack.h"
+
+#include <string.h>
+
+namespace {
+uint32_t Read16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+uint32_t Read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+struct CrcTable
+{
+	uint32_t entries[256];
+
+	CrcTable()
+	{
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for(int k = 0; k < 8; k++)
+				c = (c >> 1) ^ (c & 1 ? 0xEDB88320 : 0);
+			entries[i] = c;
+		}
+	}
+};
+
+// Reads deflate bits, least significant first. Reading past the end gives
+// zeros and marks the stream as overrun.
+class BitReader
+{
+public:
+	BitReader(const uint8_t *data, size_t size) : p(data), end(data + size) {}
+
+	uint32_t Peek(int n)
+	{
+		if(count < n)
+			Fill();
+		return (uint32_t)(buffer & ((1ULL << n) - 1));
+	}
+	void Skip(int n)
+	{
+		buffer >>= n;
+		count -= n;
+	}
+	uint32_t Get(int n)
+	{
+		uint32_t v = Peek(n);
+		Skip(n);
+		return v;
+	}
+	bool Overrun() const { return count < padding * 8; }
+
+	// Drops bits up to the next byte and hands out the bytes that follow
+	const uint8_t* Align(size_t size)
+	{
+		Skip(count & 7);
+		int buffered = count / 8 - padding;
+		if(buffered < 0)
+			return nullptr;
+		p -= buffered;
+		buffer = 0;
+		count = 0;
+		padding = 0;
+		if((size_t)(end - p) < size)
+			return nullptr;
+		p += size;
+		return p - size;
+	}
+
+private:
+	void Fill()
+	{
+		while(count <= 56) {
+			if(p < end)
+				buffer |= (uint64_t)*p++ << count;
+			else
+				padding++;
+			count += 8;
+		}
+	}
+
+	const uint8_t *p;
+	const uint8_t *end;
+	uint64_t buffer = 0;
+	int count = 0;
+	int padding = 0;
+};
+
+// Canonical Huffman code. Codes up to kFastBits long are found with one
+// lookup, longer ones a bit at a time.
+struct Huffman
+{
+	static constexpr int kFastBits = 9;
+	static constexpr int kMaxBits = 15;
+
+	uint16_t fast[1 << kFastBits]; // symbol << 4 | length, 0 for longer codes
+	uint16_t count[kMaxBits + 1];
+	uint16_t symbols[288];
+
+	// Incomplete codes are allowed, their unused codes fail to decode
+	bool Build(const uint8_t *lengths, int n)
+	{
+		memset(count, 0, sizeof(count));
+		for(int i = 0; i < n; i++)
+			count[lengths[i]]++;
+		count[0] = 0;
+		int left = 1;
+		uint16_t offsets[kMaxBits + 1];
+		offsets[1] = 0;
+		for(int len = 1; len <= kMaxBits; len++) {
+			left = (left << 1) - count[len];
+			if(left < 0)
+				return false;
+			if(len < kMaxBits)
+				offsets[len + 1] = offsets[len] + count[len];
+		}
+		for(int i = 0; i < n; i++) {
+			if(lengths[i])
+				symbols[offsets[lengths[i]]++] = i;
+		}
+
+		memset(fast, 0, sizeof(fast));
+		uint32_t code = 0;
+		int index = 0;
+		for(int len = 1; len <= kFastBits; len++) {
+			for(int i = 0; i < count[len]; i++, index++, code++) {
+				uint32_t reversed = 0;
+				for(int b = 0; b < len; b++)
+					reversed |= ((code >> b) & 1) << (len - 1 - b);
+				for(uint32_t j = reversed; j < (1U << kFastBits); j += 1U << len)
+					fast[j] = (symbols[index] << 4) | len;
+			}
+			code <<= 1;
+		}
+		return true;
+	}
+
+	int Decode(BitReader *bits) const
+	{
+		uint16_t entry = fast[bits->Peek(kMaxBits) & ((1 << kFastBits) - 1)];
+		if(entry) {
+			bits->Skip(entry & 15);
+			return entry >> 4;
+		}
+		int code = 0, first = 0, index = 0;
+		for(int len = 1; len <= kMaxBits; len++) {
+			code |= bits->Get(1);
+			if(code - count[len] < first)
+				return symbols[index + code - first];
+			index += count[len];
+			first = (first + count[len]) << 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+};
+
+struct FixedCodes
+{
+	Huffman lengths;
+	Huffman distances;
+
+	FixedCodes()
+	{
+		uint8_t l[288];
+		memset(l, 8, 144);
+		memset(l + 144, 9, 112);
+		memset(l + 256, 7, 24);
+		memset(l + 280, 8, 8);
+		lengths.Build(l, 288);
+		memset(l, 5, 30);
+		distances.Build(l, 30);
+	}
+};
+
+const uint16_t kLengthBase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const uint8_t kLengthExtra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const uint16_t kDistanceBase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+const uint8_t kDistanceExtra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+bool ReadDynamicCodes(BitReader *bits, Huffman *lengths, Huffman *distances)
+{
+	static const uint8_t kOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+	int num_lengths = bits->Get(5) + 257;
+	int num_distances = bits->Get(5) + 1;
+	int num_codes = bits->Get(4) + 4;
+	if(num_lengths > 286 || num_distances > 30)
+		return false;
+
+	uint8_t l[286 + 30] = {};
+	for(int i = 0; i < num_codes; i++)
+		l[kOrder[i]] = bits->Get(3);
+	Huffman codes;
+	if(!codes.Build(l, 19))
+		return false;
+
+	int total = num_lengths + num_distances;
+	for(int i = 0; i < total;) {
+		int sym = codes.Decode(bits);
+		if(sym < 0)
+			return false;
+		if(sym < 16) {
+			l[i++] = sym;
+			continue;
+		}
+		uint8_t len = 0;
+		int repeat;
+		if(sym == 16) {
+			if(!i)
+				return false;
+			len = l[i - 1];
+			repeat = 3 + bits->Get(2);
+		} else if(sym == 17) {
+			repeat = 3 + bits->Get(3);
+		} else {
+			repeat = 11 + bits->Get(7);
+		}
+		if(i + repeat > total)
+			return false;
+		memset(l + i, len, repeat);
+		i += repeat;
+	}
+	if(!l[256] || bits->Overrun())
+		return false;
+	return lengths->Build(l, num_lengths) && distances->Build(l + num_lengths, num_distances);
+}
+
+bool InflateBlock(BitReader *bits, const Huffman& lengths, const Huffman& distances,
+	uint8_t *out, size_t out_size, size_t *pos)
+{
+	size_t p = *pos;
+	for(;;) {
+		int sym = lengths.Decode(bits);
+		if(sym < 256) {
+			if(sym < 0 || p == out_size)
+				return false;
+			out[p++] = sym;
+			continue;
+		}
+		if(sym == 256)
+			break;
+		sym -= 257;
+		if(sym >= 29)
+			return false;
+		size_t len = kLengthBase[sym] + bits->Get(kLengthExtra[sym]);
+		int d = distances.Decode(bits);
+		if(d < 0 || d >= 30)
+			return false;
+		size_t distance = kDistanceBase[d] + bits->Get(kDistanceExtra[d]);
+		if(distance > p || len > out_size - p || bits->Overrun())
+			return false;
+		const uint8_t *from = out + p - distance;
+		if(distance >= len) {
+			memcpy(out + p, from, len);
+		} else {
+			for(size_t i = 0; i < len; i++)
+				out[p + i] = from[i];
+		}
+		p += len;
+	}
+	*pos = p;
+	return !bits->Overrun();
+}
+
+// Deflate never gets below about 1/1032 of the input
+bool PlausibleSize(size_t packed, size_t size)
+{
+	return size && size / 1032 <= packed;
+}
+
+std::unique_ptr<NativeMemory> Extract(const uint8_t *data, size_t packed, uint32_t method,
+	size_t size, uint32_t crc)
+{
+	if(!PlausibleSize(packed, size) || (method == 0 && packed != size))
+		return nullptr;
+	auto mem = NativeMemory::Create(size);
+	if(!mem)
+		return nullptr;
+	if(method == 0)
+		memcpy(mem->Pointer(), data, size);
+	else if(method != 8 || !Inflate(data, packed, mem->Pointer(), size))
+		return nullptr;
+	if(Crc32(mem->Pointer(), size) != crc)
+		return nullptr;
+	mem->MakeReadonly();
+	return mem;
+}
+
+std::unique_ptr<NativeMemory> UnpackGzip(const uint8_t *data, size_t size)
+{
+	if(size < 18 || data[2] != 8)
+		return nullptr;
+	uint8_t flags = data[3];
+	const uint8_t *p = data + 10;
+	const uint8_t *end = data + size - 8;
+	if(flags & 4) {
+		if(end - p < 2 || (size_t)(end - p - 2) < Read16(p))
+			return nullptr;
+		p += 2 + Read16(p);
+	}
+	for(uint8_t name_flag = 8; name_flag <= 16; name_flag <<= 1) {
+		if(!(flags & name_flag))
+			continue;
+		p = (const uint8_t*)memchr(p, 0, end - p);
+		if(!p)
+			return nullptr;
+		p++;
+	}
+	if(flags & 2)
+		p += 2;
+	if(p > end)
+		return nullptr;
+	return Extract(p, end - p, 8, Read32(end + 4), Read32(end));
+}
+
+std::unique_ptr<NativeMemory> UnpackZip(const uint8_t *data, size_t size)
+{
+	// The central directory has the sizes even when the local headers do not
+	if(size < 22)
+		return nullptr;
+	size_t eocd = size - 22;
+	size_t lowest = size > 22 + 0xFFFF ? size - 22 - 0xFFFF : 0;
+	while(Read32(data + eocd) != 0x06054B50) {
+		if(eocd == lowest)
+			return nullptr;
+		eocd--;
+	}
+	uint32_t num_entries = Read16(data + eocd + 10);
+	size_t dir = Read32(data + eocd + 16);
+
+	const uint8_t *entry = nullptr;
+	for(uint32_t i = 0; i < num_entries; i++) {
+		if(dir > eocd || eocd - dir < 46 || Read32(data + dir) != 0x02014B50)
+			return nullptr;
+		const uint8_t *e = data + dir;
+		uint32_t name_size = Read16(e + 28);
+		dir += 46 + name_size + Read16(e + 30) + Read16(e + 32);
+		if(dir > eocd)
+			return nullptr;
+		const char *name = (const char*)e + 46;
+		if(!name_size || name[name_size - 1] == '/')
+			continue;
+		bool nes = name_size >= 4 && !_strnicmp(name + name_size - 4, ".nes", 4);
+		if(!entry || nes)
+			entry = e;
+		if(nes)
+			break;
+	}
+	if(!entry)
+		return nullptr;
+
+	// Encrypted, or sizes in a zip64 record
+	uint32_t packed = Read32(entry + 20);
+	uint32_t unpacked = Read32(entry + 24);
+	if((Read16(entry + 8) & 1) || packed == 0xFFFFFFFF || unpacked == 0xFFFFFFFF)
+		return nullptr;
+	size_t local = Read32(entry + 42);
+	if(local > size || size - local < 30 || Read32(data + local) != 0x04034B50)
+		return nullptr;
+	size_t start = local + 30 + Read16(data + local + 26) + Read16(data + local + 28);
+	if(start > size || size - start < packed)
+		return nullptr;
+	return Extract(data + start, packed, Read16(entry + 10), unpacked, Read32(entry + 16));
+}
+}
+
+uint32_t Crc32(const uint8_t *data, size_t size, uint32_t crc)
+{
+	static const CrcTable table;
+	crc = ~crc;
+	for(size_t i = 0; i < size; i++)
+		crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+bool Inflate(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+{
+	static const FixedCodes fixed;
+
+	BitReader bits(in, in_size);
+	size_t pos = 0;
+	bool last;
+	do {
+		last = bits.Get(1);
+		uint32_t type = bits.Get(2);
+		if(type == 0) {
+			const uint8_t *header = bits.Align(4);
+			if(!header || Read16(header) != (~Read16(header + 2) & 0xFFFF))
+				return false;
+			size_t len = Read16(header);
+			const uint8_t *stored = bits.Align(len);
+			if(!stored || len > out_size - pos)
+				return false;
+			memcpy(out + pos, stored, len);
+			pos += len;
+		} else if(type == 1) {
+			if(!InflateBlock(&bits, fixed.lengths, fixed.distances, out, out_size, &pos))
+				return false;
+		} else if(type == 2) {
+			Huffman lengths, distances;
+			if(!ReadDynamicCodes(&bits, &lengths, &distances) ||
+				!InflateBlock(&bits, lengths, distances, out, out_size, &pos))
+				return false;
+		} else {
+			return false;
+		}
+	} while(!last);
+	return pos == out_size && !bits.Overrun();
+}
+
+bool IsPacked(const uint8_t *data, size_t size)
+{
+	if(size >= 4 && Read32(data) == 0x04034B50)
+		return true;
+	return size >= 2 && data[0] == 0x1F && data[1] == 0x8B;
+}
+
+std::unique_ptr<NativeMemory> Unpack(const uint8_t *data, size_t size)
+{
+	if(size >= 4 && Read32(data) == 0x04034B50)
+		return UnpackZip(data, size);
+	if(size >= 2 && data[0] == 0x1F && data[1] == 0x8B)
+		return UnpackGzip(data, size);
+	return nullptr;
+}
@@ -0,0 +1,26 @@
+#ifndef UNPACK_H_
+#define UNPACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "host_system.h"
+
+// CRC-32 as used by zip and gzip. Pass the previous result to continue a CRC.
+uint32_t Crc32(const uint8_t *data, size_t size, uint32_t crc = 0);
+
+// Decompresses a raw deflate stream. Fails unless the stream ends exactly when
+// |out| is full.
+bool Inflate(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size);
+
+// True for zip and gzip containers
+bool IsPacked(const uint8_t *data, size_t size);
+
+// Decompresses a container straight into memory sized from its header, and
+// checks its CRC. Zip files give their first file with a .nes name, or their
+// first file. Only stored and deflated entries are supported.
+std::unique_ptr<NativeMemory> Unpack(const uint8_t *data, size_t size);
+
+#endif